@@ -0,0 +1,62 @@
+#include "alloc-counter.h"
+#include <stddef.h>
+#include <errno.h>
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+//initial-exec TLS of the executable, touching it never allocates
+static __thread uint64_t allocations = 0;
+
+uint64_t ThreadAllocations(){
+	return allocations;
+}
+
+extern "C" {
+
+void* malloc(size_t size){
+	allocations++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size){
+	allocations++;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size){
+	allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr){
+	__libc_free(ptr);
+}
+
+void* memalign(size_t alignment, size_t size){
+	allocations++;
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size){
+	allocations++;
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, size_t alignment, size_t size){
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+		return EINVAL;
+	allocations++;
+	void* p = __libc_memalign(alignment, size);
+	if (p == NULL && size != 0)
+		return ENOMEM;
+	*ptr = p;
+	return 0;
+}
+
+}
@@ -0,0 +1,13 @@
+#ifndef __DETECT_ALLOC_COUNTER_H__
+#define __DETECT_ALLOC_COUNTER_H__
+
+#include <stdint.h>
+
+//Counts heap allocations per thread. Linking alloc-counter.o replaces
+//malloc and friends of the whole program with thin wrappers around glibc's
+//own, so it only goes into the allocation test (bin/detect-alloc-test).
+
+//malloc, calloc, realloc and aligned allocations made by the calling thread
+uint64_t ThreadAllocations();
+
+#endif
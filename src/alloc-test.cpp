@@ -0,0 +1,95 @@
+#include "detector.h"
+#include "config.h"
+#include "alloc-counter.h"
+#include <iostream>
+#include <unistd.h>
+using namespace std;
+
+//Checks that face search and alignment stop allocating once a Detector has
+//seen an image of the size: each image is searched and aligned a few times on
+//one thread, then one more run of findFace and alignFace is counted and must
+//make no heap allocation. Decoding, IntraFace and the result Mats the callers
+//keep are outside what is counted. Linked with alloc-counter.o, which replaces
+//malloc, so it is a separate binary (make test).
+
+//runs that grow the workspace before the counted one
+#define WARM_UP_RUNS 2
+
+static void usage(const char* name){
+	cerr<<"Usage: "<<name<<" [-c detector.cfg] image..."<<endl;
+	cerr<<"Fails if findFace or alignFace allocates once warmed up on an image."<<endl;
+}
+
+class AllocationTest{
+	public:
+		//allocations of the counted run, -1 if the image has no face to align
+		static int64_t count(Detector& detector, const string& path, int numLandmarks);
+};
+
+int64_t AllocationTest::count(Detector& detector, const string& path, int numLandmarks){
+	DetectOptions options(SLANDMARKS|SPOSE|SALIGNED);
+	options.numLandmarks = numLandmarks;
+	//the landmarks alignFace starts from
+	DetectResult result;
+	if (!detector.detect(path, options, result))
+		return -1;
+	Mat frame, gray;
+	if (!detector.loadImage(path, frame))
+		return -1;
+	detector.toGray(frame, PIX_BGR, gray);
+	ScanParams scan = MergeScanParams(detector.config->scan, options.scan);
+	//OpenCV's Haar scan allocates on every call, only the MB-LBP search is checked
+	bool search = detector.dtype == DSZU;
+	
+	Rect face;
+	Mat aligned, alignedLandmarks;
+	uint64_t allocations = 0;
+	for (int run = 0; run <= WARM_UP_RUNS; run++){
+		uint64_t before = ThreadAllocations();
+		if (search && !detector.findFace(gray, face, scan))
+			return -1;
+		if (!detector.alignFace(frame, result.pose[0], options, result.landmarks, aligned, alignedLandmarks))
+			return -1;
+		allocations = ThreadAllocations() - before;
+	}
+	return allocations;
+}
+
+int main(int argc, char** argv){
+	const char* cfgname = "detector.cfg";
+	int opt;
+	while ((opt = getopt(argc, argv, "c:h")) != -1){
+		switch (opt){
+			case 'c': cfgname = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind >= argc){
+		usage(argv[0]);
+		return 1;
+	}
+	
+	Detector detector(cfgname);
+	int checked = 0, failed = 0;
+	const int layouts[] = {49, 5};
+	for (int i = optind; i < argc; i++){
+		for (int l = 0; l < 2; l++){
+			int64_t allocations = AllocationTest::count(detector, argv[i], layouts[l]);
+			if (allocations < 0){
+				cerr<<argv[i]<<": no single face, skipped"<<endl;
+				break;
+			}
+			checked++;
+			if (allocations > 0){
+				failed++;
+				cerr<<argv[i]<<", "<<layouts[l]<<" landmarks: "<<allocations<<" allocations"<<endl;
+			}
+		}
+	}
+	if (checked == 0){
+		cerr<<"No image had a face to check"<<endl;
+		return 1;
+	}
+	cerr<<checked - failed<<" of "<<checked<<" runs made no allocation"<<endl;
+	return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,183 @@
+#include <opencv2/highgui/highgui.hpp>
+#include "detector.h"
+#include "model-registry.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "face-tracker.h"
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <ctime>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+using namespace std;
+
+//The smoke tests and measurements bin/detect used to run: the single image
+//APIs, reduced size decoding, every face of a group photo, the cost of each
+//pipeline mode, batch throughput against threads, the staged DetectPipeline
+//and FaceTracker against detecting every frame. Runs on the images of data/
+//and writes the drawn faces to tmp/ (make test).
+
+static void usage(const char* name){
+	cerr<<"Usage: "<<name<<" [-c detector.cfg]"<<endl;
+	cerr<<"Runs the detector APIs on data/, faces are saved to tmp/."<<endl;
+}
+
+int main(int argc, char** argv){
+	const char* cfgname = "detector.cfg";
+	int opt;
+	while ((opt = getopt(argc, argv, "c:h")) != -1){
+		switch (opt){
+			case 'c': cfgname = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	
+	Detector detector(cfgname);
+	ModelRegistry::report(cout);
+	
+	//test 1, detect landmarks, save to tmp/face1.jpg
+	cout<<"--------------test 1--------------"<<endl;
+	string img1= "./data/cat.jpg";
+	Mat face1 = detector.detect(img1);
+	imwrite( "./tmp/face1.jpg" , face1 );
+	cout<<"Image saved to ./tmp/face1.jpg"<<endl;
+	//test 2, detect landmarks, save to tmp/face2.jpg
+	cout<<endl<<"--------------test 2--------------"<<endl;
+	string img2= "./data/test1.jpg";
+	Mat landmarks;
+	int* pose = new int[3];
+	Mat face2 = detector.detect(img2, landmarks, pose);
+	imwrite( "./tmp/face2.jpg" , face2 );
+	cout<<"Roll: "<<pose[0]<<" Yaw: "<<pose[1]<<" Pitch: "<<pose[2]<<endl;
+	cout<<"Position of Nose Tip: "<<landmarks.at<float>(0, 14)<<" "<<landmarks.at<float>(1,14)<<endl;
+	cout<<"Image saved to ./tmp/face2.jpg"<<endl;
+	//test 3, detect landmarks, normalized it to 144 x 192, with 25 buffer size to the bound
+	cout<<endl<<"--------------test 3--------------"<<endl;
+	string img3= "./data/test1.jpg";
+	Mat face3 = detector.detectNorm(img3, 144, 192, 50, landmarks, 49, true);
+	imwrite( "./tmp/face3.jpg" , face3 );
+	cout<<"Image saved to ./tmp/face3.jpg"<<endl;
+	//test 4, detect landmarks from encoded bytes and from raw pixels, nothing touches the disk
+	cout<<endl<<"--------------test 4--------------"<<endl;
+	ifstream fin(img2.data(), ios::binary);
+	vector<uchar> buffer((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+	Mat face4 = detector.detect(&buffer[0], buffer.size(), landmarks, pose);
+	cout<<"Buffer: Roll: "<<pose[0]<<" Yaw: "<<pose[1]<<" Pitch: "<<pose[2]<<endl;
+	Mat pixels = imread(img2);
+	ImageView view = {pixels.data, pixels.cols, pixels.rows, pixels.step, PIX_BGR};
+	if (detector.detect(view, landmarks, pose))
+		cout<<"View: Roll: "<<pose[0]<<" Yaw: "<<pose[1]<<" Pitch: "<<pose[2]<<endl;
+	//test 5, detect on a reduced size decode, landmark on the full resolution face region
+	cout<<endl<<"--------------test 5--------------"<<endl;
+	struct timeval begin, end;
+	gettimeofday(&begin, NULL);
+	bool found = detector.detectReduced("./data/rola.jpg", landmarks, pose, 400);
+	gettimeofday(&end, NULL);
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	cout<<"Reduced: "<<(found ? "face found" : "no face")<<" in "<<(end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0)
+		<<" seconds, peak memory "<<usage.ru_maxrss/1024<<" MB"<<endl;
+	//test 6, every face in a group photo, largest first
+	cout<<endl<<"--------------test 6--------------"<<endl;
+	vector<FaceResult> faces;
+	int nFaces = detector.detectAll("./data/10.jpg", faces, 10);
+	for (int i = 0; i < nFaces; i++){
+		cout<<"Face "<<i<<" at "<<faces[i].face.x<<","<<faces[i].face.y<<" size "<<faces[i].face.width
+			<<" score "<<faces[i].score<<" Roll: "<<faces[i].pose[0]<<" Yaw: "<<faces[i].pose[1]<<" Pitch: "<<faces[i].pose[2]<<endl;
+	}
+	//test 7, latency of each pipeline mode
+	cout<<endl<<"--------------test 7--------------"<<endl;
+	const char* modeNames[] = {"box", "landmarks", "pose", "aligned", "annotated"};
+	int modes[] = {SBOX, SLANDMARKS, SLANDMARKS|SPOSE, SALIGNED, SANNOTATED};
+	DetectResult result;
+	for (int i = 0; i < 5; i++){
+		DetectOptions options(modes[i]);
+		options.width = 144;
+		options.height = 192;
+		options.patchSize = 36;
+		gettimeofday(&begin, NULL);
+		found = detector.detect(&buffer[0], buffer.size(), options, result);
+		gettimeofday(&end, NULL);
+		cout<<"Mode "<<modeNames[i]<<": "<<(found ? "face found" : "no face")<<" in "
+			<<(end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0)<<" seconds"<<endl;
+	}
+	//test 8, batch throughput against the number of threads
+	cout<<endl<<"--------------test 8--------------"<<endl;
+	vector<BatchInput> inputs;
+	const char* batchFiles[] = {"./data/10.jpg", "./data/lin.jpg", "./data/liuyifei.jpg", "./data/rola.jpg", 
+		"./data/test1.jpg", "./data/test2.jpg", "./data/wangdongcheng.jpg"};
+	for (int r = 0; r < 10; r++){
+		for (int i = 0; i < 7; i++)
+			inputs.push_back(BatchInput(batchFiles[i]));
+	}
+	vector<DetectResult> results;
+	int threads = 1;
+	while (true){
+		int nFound = detector.detectBatch(inputs, results, DetectOptions(SBOX|SLANDMARKS|SPOSE), threads);
+		cout<<threads<<" threads: "<<nFound<<" of "<<inputs.size()<<" images with a face"<<endl;
+		if (threads >= (int)sysconf(_SC_NPROCESSORS_ONLN))
+			break;
+		threads *= 2;
+	}
+	//test 9, decode, detect and landmark stages overlapping on their own threads
+	cout<<endl<<"--------------test 9--------------"<<endl;
+	{
+		DetectPipeline pipeline(cfgname, DetectOptions(SBOX|SLANDMARKS|SPOSE), 2, 2, 2);
+		PipelineResult piped;
+		size_t submitted = 0, collected = 0;
+		int nFound = 0;
+		gettimeofday(&begin, NULL);
+		while (collected < inputs.size()){
+			if (submitted < inputs.size() && pipeline.trySubmit(inputs[submitted]) >= 0){
+				if (++submitted == inputs.size())
+					pipeline.close();
+				continue;
+			}
+			if (!pipeline.next(piped))
+				break;
+			collected++;
+			nFound += piped.result.found;
+		}
+		gettimeofday(&end, NULL);
+		double elapsed = (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+		cout<<"Pipeline: "<<nFound<<" of "<<collected<<" images with a face, "<<collected/elapsed<<" images/sec"<<endl;
+	}
+	//test 10, a panning clip made from one photo, tracked against detected on every frame
+	cout<<endl<<"--------------test 10--------------"<<endl;
+	{
+		Mat photo = imread(img2);
+		vector<Mat> clip;
+		for (int i = 0; i < 60; i++){
+			Mat shift = (Mat_<double>(2, 3) << 1, 0, i % 20 - 10, 0, 1, (i/20)*3);
+			Mat frame;
+			warpAffine(photo, frame, shift, photo.size());
+			clip.push_back(frame);
+		}
+		FaceTracker tracker(cfgname, 30);
+		TrackResult tracked;
+		double trackTime = 0, detectTime = 0;
+		int nDetected = 0;
+		for (size_t i = 0; i < clip.size(); i++){
+			gettimeofday(&begin, NULL);
+			tracker.track(clip[i], tracked);
+			gettimeofday(&end, NULL);
+			trackTime += (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+			nDetected += tracked.detected;
+			
+			ImageView frameView = {clip[i].data, clip[i].cols, clip[i].rows, clip[i].step, PIX_BGR};
+			gettimeofday(&begin, NULL);
+			detector.detect(frameView, landmarks, pose);
+			gettimeofday(&end, NULL);
+			detectTime += (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+		}
+		cout<<"Tracking: "<<trackTime/clip.size()<<" seconds per frame, "<<nDetected<<" of "<<clip.size()<<" frames detected"<<endl;
+		cout<<"Detect every frame: "<<detectTime/clip.size()<<" seconds per frame"<<endl;
+	}
+	delete[] pose;
+	cout<<endl;
+	Metrics::report(cout);
+	return 0;
+}
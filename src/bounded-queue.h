@@ -0,0 +1,155 @@
+#ifndef __BOUNDED_QUEUE_H__
+#define __BOUNDED_QUEUE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+#include <unistd.h>
+
+//Lock-free multi-producer multi-consumer queue of fixed capacity (Dmitry
+//Vyukov's bounded MPMC queue). Every cell carries a sequence number telling
+//producers and consumers whose turn it is, so a push or pop is a single CAS
+//on the position counter. push and pop wait with backoff, which is the
+//backpressure between pipeline stages.
+template <class T>
+class BoundedQueue{
+	public:
+		//capacity is rounded up to a power of two
+		BoundedQueue(size_t capacity);
+		~BoundedQueue();
+		
+		bool tryPush(const T& value);
+		bool tryPop(T& value);
+		//waits while the queue is full
+		void push(const T& value);
+		//waits while the queue is empty, false once it is closed and drained
+		bool pop(T& value);
+		//no more pushes, called after the last producer is done
+		void close();
+	private:
+		struct Cell{
+			size_t sequence;
+			T value;
+		};
+		//positions on their own cache lines, producers and consumers do not share them
+		char pad0[64];
+		Cell* buffer;
+		size_t mask;
+		char pad1[64];
+		size_t enqueuePos;
+		char pad2[64];
+		size_t dequeuePos;
+		char pad3[64];
+		int closed;
+		
+		BoundedQueue(const BoundedQueue&);
+		BoundedQueue& operator=(const BoundedQueue&);
+		static void backoff(int& spins);
+};
+
+template <class T>
+BoundedQueue<T>::BoundedQueue(size_t capacity){
+	size_t size = 2;
+	while (size < capacity)
+		size <<= 1;
+	buffer = new Cell[size];
+	mask = size - 1;
+	for (size_t i = 0; i < size; i++)
+		__atomic_store_n(&buffer[i].sequence, i, __ATOMIC_RELAXED);
+	__atomic_store_n(&enqueuePos, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dequeuePos, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&closed, 0, __ATOMIC_RELEASE);
+}
+
+template <class T>
+BoundedQueue<T>::~BoundedQueue(){
+	delete[] buffer;
+}
+
+template <class T>
+bool BoundedQueue<T>::tryPush(const T& value){
+	Cell* cell;
+	size_t pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+	while (true){
+		cell = &buffer[pos & mask];
+		size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+		if (dif == 0){
+			if (__atomic_compare_exchange_n(&enqueuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0){
+			//full
+			return false;
+		}
+		else{
+			pos = __atomic_load_n(&enqueuePos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->value = value;
+	__atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+template <class T>
+bool BoundedQueue<T>::tryPop(T& value){
+	Cell* cell;
+	size_t pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+	while (true){
+		cell = &buffer[pos & mask];
+		size_t seq = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+		intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+		if (dif == 0){
+			if (__atomic_compare_exchange_n(&dequeuePos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		}
+		else if (dif < 0){
+			//empty
+			return false;
+		}
+		else{
+			pos = __atomic_load_n(&dequeuePos, __ATOMIC_RELAXED);
+		}
+	}
+	value = cell->value;
+	__atomic_store_n(&cell->sequence, pos + mask + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+template <class T>
+void BoundedQueue<T>::push(const T& value){
+	int spins = 0;
+	while (!tryPush(value))
+		backoff(spins);
+}
+
+template <class T>
+bool BoundedQueue<T>::pop(T& value){
+	int spins = 0;
+	while (!tryPop(value)){
+		//everything pushed before close is visible once closed is
+		if (__atomic_load_n(&closed, __ATOMIC_ACQUIRE))
+			return tryPop(value);
+		backoff(spins);
+	}
+	return true;
+}
+
+template <class T>
+void BoundedQueue<T>::close(){
+	__atomic_store_n(&closed, 1, __ATOMIC_RELEASE);
+}
+
+template <class T>
+void BoundedQueue<T>::backoff(int& spins){
+	//yield first, sleep once the other side is clearly not keeping up
+	if (spins < 64){
+		spins++;
+		sched_yield();
+	}
+	else{
+		usleep(200);
+	}
+}
+
+#endif
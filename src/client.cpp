@@ -0,0 +1,276 @@
+#include "detector.h"
+#include "protocol.h"
+#include "shm-ring.h"
+#include <iostream>
+#include <fstream>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+using namespace std;
+
+//Sends images to bin/detectd and prints the results, one line per image.
+
+static void usage(const char* name){
+	cerr<<"Usage: "<<name<<" [options] image..."<<endl;
+	cerr<<"       "<<name<<" -M [-s socket]"<<endl;
+	cerr<<"  -s  socket path, default /tmp/kbdetect.sock"<<endl;
+	cerr<<"  -m  comma separated outputs: box,landmarks,pose,aligned,annotated, default box,landmarks,pose"<<endl;
+	cerr<<"  -W, -H, -P  aligned face width, height and patch size, default 100 100 30"<<endl;
+	cerr<<"  -n  aligned landmarks, 5 or 49, default 49"<<endl;
+	cerr<<"  -d  milliseconds the face search may take, the best face found by then is returned"<<endl;
+	cerr<<"  -p  send the path instead of the file, the daemon reads it"<<endl;
+	cerr<<"  -l  print landmarks"<<endl;
+	cerr<<"  -o  directory for aligned (.png) and annotated (.jpg) images"<<endl;
+	cerr<<"  -b  benchmark decoded frames sent through the socket against the shared memory ring,"<<endl;
+	cerr<<"      the given number of requests per image, box/landmarks/pose only"<<endl;
+	cerr<<"  -M  print the daemon's metrics after the images"<<endl;
+}
+
+static bool printMetrics(int fd){
+	DetectRequestHeader request;
+	memset(&request, 0, sizeof(request));
+	request.magic = DETECT_REQUEST_MAGIC;
+	request.source = SOURCE_METRICS;
+	DetectResponseHeader response;
+	vector<float> landmarks, alignedLandmarks;
+	vector<unsigned char> aligned, text;
+	if (!WriteDetectRequest(fd, request, NULL) ||
+		!ReadDetectResponse(fd, response, landmarks, alignedLandmarks, aligned, text))
+		return false;
+	if (!text.empty())
+		cout.write((const char*)&text[0], text.size());
+	cout.flush();
+	return true;
+}
+
+static double seconds(const struct timeval& begin, const struct timeval& end){
+	return (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+}
+
+//the same decoded frames, copied over the socket and then handed over in shared memory,
+//one connection at a time so that a single worker daemon can serve both
+static int benchmark(int fd, const char* socketPath, DetectRequestHeader request, const vector<string>& images, int iterations){
+	request.stages &= SBOX|SLANDMARKS|SPOSE;
+	request.source = SOURCE_PIXELS;
+	DetectResponseHeader response;
+	vector<float> landmarks, alignedLandmarks;
+	vector<unsigned char> aligned, annotated;
+	
+	vector<Mat> frames;
+	size_t largest = 0;
+	for (size_t i = 0; i < images.size(); i++){
+		Mat frame = imread(images[i]);
+		if (frame.empty()){
+			cerr<<images[i]<<" cannot be read"<<endl;
+			return 1;
+		}
+		frames.push_back(frame);
+		largest = MAX(largest, frame.total()*frame.elemSize());
+	}
+	
+	struct timeval begin, end;
+	vector<double> socketTimes;
+	for (size_t i = 0; i < frames.size(); i++){
+		const Mat& frame = frames[i];
+		size_t bytes = frame.total()*frame.elemSize();
+		DetectPixelHeader pixels = {frame.cols, frame.rows, PIX_BGR};
+		vector<unsigned char> payload(sizeof(pixels) + bytes);
+		memcpy(&payload[0], &pixels, sizeof(pixels));
+		memcpy(&payload[sizeof(pixels)], frame.data, bytes);
+		request.length = payload.size();
+		
+		gettimeofday(&begin, NULL);
+		for (int k = 0; k < iterations; k++){
+			if (!WriteDetectRequest(fd, request, &payload[0]) ||
+				!ReadDetectResponse(fd, response, landmarks, alignedLandmarks, aligned, annotated)){
+				cerr<<"Connection to "<<socketPath<<" lost"<<endl;
+				return 1;
+			}
+		}
+		gettimeofday(&end, NULL);
+		socketTimes.push_back(seconds(begin, end)/iterations);
+	}
+	close(fd);
+	
+	ShmClient shm;
+	if (!shm.connect(socketPath, 1, largest))
+		return 1;
+	for (size_t i = 0; i < frames.size(); i++){
+		const Mat& frame = frames[i];
+		size_t bytes = frame.total()*frame.elemSize();
+		int slot;
+		gettimeofday(&begin, NULL);
+		for (int k = 0; k < iterations; k++){
+			//a real client would decode straight into the slot
+			memcpy(shm.buffer(0), frame.data, bytes);
+			if (!shm.post(0, frame.cols, frame.rows, frame.step, PIX_BGR, request.stages) || !shm.wait(slot)){
+				cerr<<"Connection to "<<socketPath<<" lost"<<endl;
+				return 1;
+			}
+		}
+		gettimeofday(&end, NULL);
+		double shmTime = seconds(begin, end)/iterations;
+		
+		cout<<images[i]<<" "<<frame.cols<<"x"<<frame.rows<<" ("<<bytes/1024<<" KB)"
+			<<" socket "<<socketTimes[i]*1000<<" ms, "<<1/socketTimes[i]<<" images/sec,"
+			<<" shared memory "<<shmTime*1000<<" ms, "<<1/shmTime<<" images/sec"<<endl;
+	}
+	return 0;
+}
+
+static int parseStages(char* list){
+	int stages = 0;
+	for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")){
+		if (strcmp(tok, "box") == 0) stages |= SBOX;
+		else if (strcmp(tok, "landmarks") == 0) stages |= SLANDMARKS;
+		else if (strcmp(tok, "pose") == 0) stages |= SPOSE;
+		else if (strcmp(tok, "aligned") == 0) stages |= SALIGNED;
+		else if (strcmp(tok, "annotated") == 0) stages |= SANNOTATED;
+		else return -1;
+	}
+	return stages;
+}
+
+static bool saveBytes(const string& filename, const vector<unsigned char>& bytes){
+	ofstream fout(filename.data(), ios::binary);
+	fout.write((const char*)&bytes[0], bytes.size());
+	return fout.good();
+}
+
+static string baseName(const string& path){
+	size_t slash = path.find_last_of('/');
+	string name = slash == string::npos ? path : path.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+	return dot == string::npos ? name : name.substr(0, dot);
+}
+
+int main(int argc, char** argv){
+	const char* socketPath = "/tmp/kbdetect.sock";
+	const char* outDir = NULL;
+	DetectRequestHeader request;
+	memset(&request, 0, sizeof(request));
+	request.magic = DETECT_REQUEST_MAGIC;
+	request.stages = SBOX|SLANDMARKS|SPOSE;
+	request.width = 100;
+	request.height = 100;
+	request.patchSize = 30;
+	request.numLandmarks = 49;
+	request.source = SOURCE_BYTES;
+	bool printLandmarks = false;
+	bool metrics = false;
+	int iterations = 0;
+	int opt, stages;
+	while ((opt = getopt(argc, argv, "s:m:W:H:P:n:d:plo:b:Mh")) != -1){
+		switch (opt){
+			case 's': socketPath = optarg; break;
+			case 'm':
+				stages = parseStages(optarg);
+				if (stages <= 0){
+					usage(argv[0]);
+					return 1;
+				}
+				request.stages = stages;
+				break;
+			case 'W': request.width = atof(optarg); break;
+			case 'H': request.height = atof(optarg); break;
+			case 'P': request.patchSize = atof(optarg); break;
+			case 'n': request.numLandmarks = atoi(optarg); break;
+			case 'd': request.budget = (uint32_t)(atof(optarg)*1000); break;
+			case 'p': request.source = SOURCE_PATH; break;
+			case 'l': printLandmarks = true; break;
+			case 'o': outDir = optarg; break;
+			case 'b': iterations = atoi(optarg); break;
+			case 'M': metrics = true; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind >= argc && !metrics){
+		usage(argv[0]);
+		return 1;
+	}
+	
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+		cerr<<"Cannot connect to "<<socketPath<<": "<<strerror(errno)<<endl;
+		return 1;
+	}
+	
+	if (iterations > 0){
+		return benchmark(fd, socketPath, request, vector<string>(argv + optind, argv + argc), iterations);
+	}
+	
+	int failed = 0;
+	DetectResponseHeader response;
+	vector<float> landmarks, alignedLandmarks;
+	vector<unsigned char> payload, aligned, annotated;
+	for (int i = optind; i < argc; i++){
+		string path = argv[i];
+		if (request.source == SOURCE_PATH){
+			//relative paths would be resolved in the daemon's directory
+			char* full = realpath(argv[i], NULL);
+			if (full != NULL){
+				path = full;
+				free(full);
+			}
+			payload.assign(path.begin(), path.end());
+		}
+		else{
+			ifstream fin(argv[i], ios::binary);
+			payload.assign((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+		}
+		if (payload.empty()){
+			cout<<argv[i]<<" cannot be read"<<endl;
+			failed++;
+			continue;
+		}
+		request.length = payload.size();
+		
+		struct timeval begin, end;
+		gettimeofday(&begin, NULL);
+		if (!WriteDetectRequest(fd, request, &payload[0]) ||
+			!ReadDetectResponse(fd, response, landmarks, alignedLandmarks, aligned, annotated)){
+			cerr<<"Connection to "<<socketPath<<" lost"<<endl;
+			return 1;
+		}
+		gettimeofday(&end, NULL);
+		double elapsed = (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+		
+		if (!response.found){
+			cout<<argv[i]<<" no face in "<<elapsed<<" seconds"<<(response.truncated ? " (truncated)" : "")<<endl;
+			failed++;
+			continue;
+		}
+		cout<<argv[i]<<" face "<<response.face[0]<<" "<<response.face[1]<<" "<<response.face[2]<<" "<<response.face[3]
+			<<" score "<<response.score<<" roll "<<response.pose[0]<<" yaw "<<response.pose[1]<<" pitch "<<response.pose[2]
+			<<" in "<<elapsed<<" seconds"<<(response.truncated ? " (truncated)" : "")<<endl;
+		if (printLandmarks){
+			for (uint32_t k = 0; k < response.landmarks; k++)
+				cout<<" "<<landmarks[k]<<","<<landmarks[response.landmarks + k];
+			if (response.landmarks > 0)
+				cout<<endl;
+		}
+		if (outDir != NULL){
+			string base = string(outDir) + "/" + baseName(argv[i]);
+			if (!aligned.empty())
+				saveBytes(base + "_aligned.png", aligned);
+			if (!annotated.empty())
+				saveBytes(base + "_annotated.jpg", annotated);
+		}
+	}
+	if (metrics && !printMetrics(fd)){
+		cerr<<"Connection to "<<socketPath<<" lost"<<endl;
+		return 1;
+	}
+	close(fd);
+	return failed == 0 ? 0 : 2;
+}
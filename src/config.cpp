@@ -0,0 +1,214 @@
+#include "config.h"
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+
+ScanParams::ScanParams(){
+	scaleFactor = -1;
+	minNeighbors = -1;
+	minFace = -1;
+	maxFace = -1;
+	haarMinFace = -1;
+	notFace = -1;
+}
+
+QualityGate::QualityGate(){
+	minFace = 0;
+	minSharpness = 0;
+	minNeighbors = 0;
+	minBrightness = 0;
+	maxBrightness = 255;
+	shadow = false;
+}
+
+DetectorConfig::DetectorConfig(){
+	haarcascade = "./model/haarcascade_frontalface_alt2.xml";
+	threads = 0;
+	scan.scaleFactor = 1229/1024.0f;
+	scan.minNeighbors = 1;
+	scan.minFace = 50;
+	scan.maxFace = 500;
+	scan.haarMinFace = 100;
+	scan.notFace = 0.5;
+}
+
+//the MB-LBP scan steps in 1024ths, a step that rounds to 1 never leaves the first level
+static bool validScaleFactor(float scaleFactor){
+	return scaleFactor*1024 >= 1024.5f;
+}
+
+const char* InvalidScanParam(const ScanParams& scan){
+	if (!validScaleFactor(scan.scaleFactor))
+		return "SCALE_FACTOR";
+	if (scan.minNeighbors < 0)
+		return "MIN_NEIGHBORS";
+	if (scan.minFace <= 0)
+		return "MIN_FACE";
+	if (scan.maxFace < 0)
+		return "MAX_FACE";
+	if (scan.haarMinFace <= 0)
+		return "HAAR_MIN_FACE";
+	return NULL;
+}
+
+bool LoadDetectorConfig(const char* filename, DetectorConfig& config){
+	ifstream fin;
+	fin.open(filename);
+	if (fin.fail()){
+		return false;
+	}
+	
+	//parse parameters
+	char line[1024];
+	while(fin.getline(line,1024)){
+		char *tok = strtok(line, " \t\r");
+		char *value = strtok(NULL, " \t\r");
+		if (tok == NULL || value == NULL){
+			continue;
+		}
+		if (strcmp(tok,"TYPE")==0){
+			config.type = value;
+		}		
+		else if (strcmp(tok,"CASCADE")==0){
+			config.cascade = value;
+		}
+		else if (strcmp(tok,"HAARCASCADE")==0){
+			config.haarcascade = value;
+		}
+		else if (strcmp(tok,"INTRADETECT")==0){
+			config.intradetect = value;
+		}
+		else if (strcmp(tok,"INTRATRACK")==0){
+			config.intratrack = value;
+		}		
+		else if (strcmp(tok,"THREADS")==0){
+			config.threads = atoi(value);
+		}
+		else if (strcmp(tok,"GATE_MIN_FACE")==0){
+			config.gate.minFace = atoi(value);
+		}
+		else if (strcmp(tok,"GATE_MIN_SHARPNESS")==0){
+			config.gate.minSharpness = atof(value);
+		}
+		else if (strcmp(tok,"GATE_MIN_NEIGHBORS")==0){
+			config.gate.minNeighbors = atoi(value);
+		}
+		else if (strcmp(tok,"GATE_MIN_BRIGHTNESS")==0){
+			config.gate.minBrightness = atof(value);
+		}
+		else if (strcmp(tok,"GATE_MAX_BRIGHTNESS")==0){
+			config.gate.maxBrightness = atof(value);
+		}
+		else if (strcmp(tok,"GATE_SHADOW")==0){
+			config.gate.shadow = atoi(value) != 0;
+		}
+		else{
+			ScanParams scan = config.scan;
+			SetScanParam(config.scan, tok, value);
+			if (InvalidScanParam(config.scan) != NULL){
+				fprintf(stderr, "Invalid %s %s in %s, ignored\n", tok, value, filename);
+				config.scan = scan;
+			}
+		}
+	}
+	return true;
+}
+
+bool SetScanParam(ScanParams& scan, const char* key, const char* value){
+	if (strcmp(key,"SCALE_FACTOR")==0){
+		scan.scaleFactor = atof(value);
+	}
+	else if (strcmp(key,"MIN_NEIGHBORS")==0){
+		scan.minNeighbors = atoi(value);
+	}
+	else if (strcmp(key,"MIN_FACE")==0){
+		scan.minFace = atoi(value);
+	}
+	else if (strcmp(key,"MAX_FACE")==0){
+		scan.maxFace = atoi(value);
+	}
+	else if (strcmp(key,"HAAR_MIN_FACE")==0){
+		scan.haarMinFace = atoi(value);
+	}
+	else if (strcmp(key,"NOT_FACE")==0){
+		scan.notFace = atof(value);
+	}
+	else{
+		return false;
+	}
+	return true;
+}
+
+ScanParams MergeScanParams(const ScanParams& configured, const ScanParams& request){
+	ScanParams scan = configured;
+	//a step of 1 or less would never leave the first pyramid level
+	if (validScaleFactor(request.scaleFactor))
+		scan.scaleFactor = request.scaleFactor;
+	if (request.minNeighbors >= 0)
+		scan.minNeighbors = request.minNeighbors;
+	if (request.minFace >= 0)
+		scan.minFace = request.minFace;
+	if (request.maxFace >= 0)
+		scan.maxFace = request.maxFace;
+	if (request.haarMinFace >= 0)
+		scan.haarMinFace = request.haarMinFace;
+	if (request.notFace >= 0)
+		scan.notFace = request.notFace;
+	return scan;
+}
+
+bool SaveScanParams(const char* filename, const ScanParams& scan){
+	const char* keys[] = {"SCALE_FACTOR", "MIN_NEIGHBORS", "MIN_FACE", "MAX_FACE", "HAAR_MIN_FACE", "NOT_FACE"};
+	const int nkeys = sizeof(keys)/sizeof(keys[0]);
+	//LoadDetectorConfig would ignore it
+	const char* invalid = InvalidScanParam(scan);
+	if (invalid != NULL){
+		fprintf(stderr, "Invalid %s, %s not written\n", invalid, filename);
+		return false;
+	}
+	char values[nkeys][32];
+	snprintf(values[0], sizeof(values[0]), "%g", scan.scaleFactor);
+	snprintf(values[1], sizeof(values[1]), "%d", scan.minNeighbors);
+	snprintf(values[2], sizeof(values[2]), "%d", scan.minFace);
+	snprintf(values[3], sizeof(values[3]), "%d", scan.maxFace);
+	snprintf(values[4], sizeof(values[4]), "%d", scan.haarMinFace);
+	snprintf(values[5], sizeof(values[5]), "%g", scan.notFace);
+	
+	vector<string> lines;
+	bool written[nkeys] = {false};
+	ifstream fin(filename);
+	string line;
+	while (getline(fin, line)){
+		istringstream in(line);
+		string key;
+		in>>key;
+		for (int k = 0; k < nkeys; k++){
+			if (key == keys[k]){
+				line = key + " " + values[k];
+				written[k] = true;
+				break;
+			}
+		}
+		lines.push_back(line);
+	}
+	fin.close();
+	for (int k = 0; k < nkeys; k++){
+		if (!written[k])
+			lines.push_back(string(keys[k]) + " " + values[k]);
+	}
+	
+	//replaced in one step, detectors starting meanwhile read the old or the new file
+	string temp = string(filename) + ".tmp";
+	ofstream fout(temp.data());
+	for (size_t i = 0; i < lines.size(); i++)
+		fout<<lines[i]<<"\n";
+	fout.close();
+	if (!fout || rename(temp.data(), filename) != 0){
+		remove(temp.data());
+		return false;
+	}
+	return true;
+}
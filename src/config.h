@@ -0,0 +1,64 @@
+#ifndef __DETECTOR_CONFIG_H__
+#define __DETECTOR_CONFIG_H__
+
+#include <string>
+
+using namespace std;
+
+//Face search settings. In detector.cfg they are the keys in brackets, in a
+//request (DetectOptions::scan) a negative value keeps the configured one
+struct ScanParams{
+	float scaleFactor; //MB-LBP pyramid step (SCALE_FACTOR), 1.2
+	int minNeighbors; //MB-LBP windows a face needs (MIN_NEIGHBORS), 1, 0 for no grouping
+	int minFace; //smallest MB-LBP face width in pixels (MIN_FACE), 50
+	int maxFace; //largest MB-LBP face width (MAX_FACE), 500, 0 for the image size
+	int haarMinFace; //smallest face of the OPENCV detector (HAAR_MIN_FACE), 100
+	float notFace; //IntraFace score below which a face is a false positive (NOT_FACE), 0.5
+	
+	//every value unset
+	ScanParams();
+};
+
+//Checks on a detected face before IntraFace landmarks it (quality.h), each
+//off at its default. Sharpness and brightness are measured on the face
+//scaled to QUALITY_SIZE x QUALITY_SIZE gray pixels
+struct QualityGate{
+	int minFace; //smallest face width to landmark (GATE_MIN_FACE), 0
+	float minSharpness; //variance of the Laplacian (GATE_MIN_SHARPNESS), 0
+	int minNeighbors; //cascade windows grouped into the face (GATE_MIN_NEIGHBORS), 0
+	float minBrightness; //mean gray level (GATE_MIN_BRIGHTNESS), 0
+	float maxBrightness; //(GATE_MAX_BRIGHTNESS), 255
+	bool shadow; //only count the faces the gate would skip and still landmark them (GATE_SHADOW), 0
+	
+	QualityGate();
+};
+
+//Settings read from detector.cfg, one "KEY value" pair per line
+struct DetectorConfig{
+	string type;
+	string cascade;
+	string haarcascade;
+	string intradetect;
+	string intratrack;
+	int threads; //landmarking threads for multi-face detection, 0 for one per CPU
+	ScanParams scan; //always complete, the defaults above for missing keys
+	QualityGate gate;
+	
+	DetectorConfig();
+};
+
+//returns false if the file cannot be opened, invalid scan values are
+//reported and leave the default
+bool LoadDetectorConfig(const char* filename, DetectorConfig& config);
+
+//sets the ScanParams value named by a detector.cfg key, false for other keys
+bool SetScanParam(ScanParams& scan, const char* key, const char* value);
+//key of the first value of a complete ScanParams the scan cannot use (a
+//SCALE_FACTOR that does not grow, a face size below 1), NULL if all are valid
+const char* InvalidScanParam(const ScanParams& scan);
+//configured, with every value the request sets replaced
+ScanParams MergeScanParams(const ScanParams& configured, const ScanParams& request);
+//rewrites the scan keys of filename (appending missing ones), other lines are kept
+bool SaveScanParams(const char* filename, const ScanParams& scan);
+
+#endif
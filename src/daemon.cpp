@@ -0,0 +1,553 @@
+#include "detector.h"
+#include "model-registry.h"
+#include "bounded-queue.h"
+#include "protocol.h"
+#include "shm-ring.h"
+#include "metrics.h"
+#include "trace.h"
+#include "result-cache.h"
+#include <iostream>
+#include <sstream>
+#include <new>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <cerrno>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+using namespace std;
+
+//Detection daemon: models are loaded once at startup, then requests
+//framed as in protocol.h are served on a Unix domain socket. Each
+//connection is handled by one worker thread with its own Detector.
+//With -w the workers are processes forked from a parent that loaded
+//the models, for isolation without a copy of the models per process.
+
+struct DaemonWorker{
+	Detector* detector;
+	BoundedQueue<int>* connections;
+	pthread_t thread;
+};
+
+static volatile sig_atomic_t stopping = 0;
+
+static void onSignal(int){
+	stopping = 1;
+}
+
+static void appendLandmarks(const Mat& landmarks, vector<float>& out){
+	for (int r = 0; r < 2 && !landmarks.empty(); r++){
+		for (int i = 0; i < landmarks.cols; i++)
+			out.push_back(landmarks.at<float>(r, i));
+	}
+}
+
+static int channelsOf(int format){
+	if (format == PIX_BGR || format == PIX_RGB)
+		return 3;
+	if (format == PIX_BGRA || format == PIX_RGBA)
+		return 4;
+	return 1;
+}
+
+//a view on client pixels, data is NULL if they do not fit in size bytes
+static ImageView makeView(const uchar* data, int width, int height, int stride, int format, size_t size){
+	ImageView view = {NULL, width, height, 0, PIX_GRAY};
+	if (format < PIX_GRAY || format > PIX_RGBA || width <= 0 || height <= 0)
+		return view;
+	size_t row = (size_t)width*channelsOf(format);
+	view.stride = stride > 0 ? (size_t)stride : row;
+	view.format = (PIXEL_FORMAT)format;
+	if (view.stride < row || view.stride*(height - 1) + row > size)
+		return view;
+	view.data = data;
+	return view;
+}
+
+//the connection has handed over a ring, it now carries slot numbers
+static void serveRing(int fd, Detector* detector, ShmRing* ring){
+	uint32_t index;
+	while (ReadFull(fd, &index, sizeof(index)) && index < (uint32_t)ring->slots()){
+		ShmSlot* slot = ring->slot(index);
+		//read once, the client can still write the slot
+		ShmSlot request = *slot;
+		DetectOptions options(request.stages & (SBOX|SLANDMARKS|SPOSE));
+		DetectResult result;
+		ImageView view = makeView(ring->pixels(index), request.width, request.height, request.stride, request.format, ring->pixelBytes());
+		if (view.data != NULL)
+			detector->detect(view, options, result);
+		
+		slot->found = result.found;
+		slot->face[0] = result.face.x;
+		slot->face[1] = result.face.y;
+		slot->face[2] = result.face.width;
+		slot->face[3] = result.face.height;
+		slot->score = result.score;
+		for (int i = 0; i < 3; i++)
+			slot->pose[i] = result.pose[i];
+		int n = MIN(result.landmarks.cols, SHM_MAX_LANDMARKS);
+		slot->landmarks = n;
+		for (int i = 0; i < n; i++){
+			slot->points[i] = result.landmarks.at<float>(0, i);
+			slot->points[n + i] = result.landmarks.at<float>(1, i);
+		}
+		if (!WriteFull(fd, &index, sizeof(index)))
+			break;
+	}
+}
+
+//largest aligned face a request may ask for
+#define MAX_ALIGNED_SIZE 4096
+
+//the aligned face settings come from the client, out of range ones would make
+//the warp fail to allocate or assert. Written so that NaN fails too
+static bool validAlignment(const DetectRequestHeader& request){
+	return request.patchSize > 0 && request.patchSize < request.width && request.patchSize < request.height &&
+		request.width <= MAX_ALIGNED_SIZE && request.height <= MAX_ALIGNED_SIZE &&
+		(request.numLandmarks == 5 || request.numLandmarks == 49);
+}
+
+static bool answer(int fd, Detector* detector, const DetectRequestHeader& request, const vector<uchar>& payload){
+	DetectOptions options(request.stages);
+	options.width = request.width;
+	options.height = request.height;
+	options.patchSize = request.patchSize;
+	options.numLandmarks = request.numLandmarks;
+	options.budget = request.budget/1000000.0;
+	
+	DetectResponseHeader response;
+	memset(&response, 0, sizeof(response));
+	response.magic = DETECT_RESPONSE_MAGIC;
+	if (request.source == SOURCE_METRICS){
+		ostringstream text;
+		Metrics::scrape(text);
+		string scraped = text.str();
+		response.found = 1;
+		response.annotatedLength = scraped.size();
+		return WriteFull(fd, &response, sizeof(response)) && WriteFull(fd, scraped.data(), scraped.size());
+	}
+	
+	DetectResult result;
+	if (!validAlignment(request)){
+		//answered as not found, the connection stays usable
+	}
+	else if (request.source == SOURCE_PATH){
+		detector->detect(string(payload.begin(), payload.end()), options, result);
+	}
+	else if (request.source == SOURCE_PIXELS){
+		DetectPixelHeader pixels;
+		ImageView view = {NULL, 0, 0, 0, PIX_GRAY};
+		if (payload.size() >= sizeof(pixels)){
+			memcpy(&pixels, &payload[0], sizeof(pixels));
+			view = makeView(&payload[0] + sizeof(pixels), pixels.width, pixels.height, 0, pixels.format, payload.size() - sizeof(pixels));
+		}
+		if (view.data != NULL)
+			detector->detect(view, options, result);
+	}
+	else{
+		detector->detect(&payload[0], payload.size(), options, result);
+	}
+	
+	response.found = result.found;
+	response.truncated = result.truncated;
+	response.face[0] = result.face.x;
+	response.face[1] = result.face.y;
+	response.face[2] = result.face.width;
+	response.face[3] = result.face.height;
+	response.score = result.score;
+	for (int i = 0; i < 3; i++)
+		response.pose[i] = result.pose[i];
+	
+	vector<float> landmarks;
+	appendLandmarks(result.landmarks, landmarks);
+	appendLandmarks(result.alignedLandmarks, landmarks);
+	response.landmarks = result.landmarks.cols;
+	response.alignedLandmarks = result.alignedLandmarks.cols;
+	vector<uchar> aligned, annotated;
+	if (!result.aligned.empty())
+		imencode(".png", result.aligned, aligned);
+	if (!result.annotated.empty())
+		imencode(".jpg", result.annotated, annotated);
+	response.alignedLength = aligned.size();
+	response.annotatedLength = annotated.size();
+	
+	return WriteFull(fd, &response, sizeof(response)) &&
+		(landmarks.empty() || WriteFull(fd, &landmarks[0], landmarks.size()*sizeof(float))) &&
+		(aligned.empty() || WriteFull(fd, &aligned[0], aligned.size())) &&
+		(annotated.empty() || WriteFull(fd, &annotated[0], annotated.size()));
+}
+
+//answers the requests of one connection until it is closed
+static void serveConnection(int fd, Detector* detector, DetectRequestHeader& request, vector<uchar>& payload){
+	int passedFd;
+	while (ReadDetectRequest(fd, request, payload, &passedFd)){
+		if (request.source == SOURCE_SHM){
+			ShmRing* ring = passedFd >= 0 ? ShmRing::attach(passedFd) : NULL;
+			DetectResponseHeader response;
+			memset(&response, 0, sizeof(response));
+			response.magic = DETECT_RESPONSE_MAGIC;
+			response.found = ring != NULL;
+			try{
+				if (WriteFull(fd, &response, sizeof(response)) && ring != NULL)
+					serveRing(fd, detector, ring);
+			}
+			catch (...){
+				delete ring;
+				throw;
+			}
+			delete ring;
+			return;
+		}
+		if (passedFd >= 0)
+			close(passedFd);
+		if (!answer(fd, detector, request, payload))
+			return;
+	}
+}
+
+static void* serve(void* arg){
+	DaemonWorker* worker = (DaemonWorker*)arg;
+	int fd;
+	DetectRequestHeader request;
+	vector<uchar> payload;
+	while (worker->connections->pop(fd)){
+		//a request that fails only closes its own connection, the other
+		//connections of the process keep being served
+		try{
+			serveConnection(fd, worker->detector, request, payload);
+		}
+		catch (const cv::Exception& e){
+			cerr<<"Request failed, connection closed: "<<e.what()<<endl;
+		}
+		catch (const std::bad_alloc&){
+			cerr<<"Out of memory, connection closed"<<endl;
+		}
+		close(fd);
+	}
+	return NULL;
+}
+
+//runs every model once on synthetic pixels, so that their pages are resident
+//and lazy initialization is done before workers are forked off
+static void warmUp(Detector& detector){
+	Mat noise(480, 640, CV_8UC1);
+	randu(noise, 0, 256);
+	ImageView view = {noise.data, noise.cols, noise.rows, noise.step, PIX_GRAY};
+	DetectResult result;
+	detector.detect(view, DetectOptions(SBOX), result);
+	//IntraFace runs on the whole image as the face, whether it finds one or not
+	Mat face(200, 200, CV_8UC3, Scalar(128, 128, 128));
+	Mat landmarks;
+	int pose[3];
+	detector.detect(face, landmarks, pose);
+	Metrics::reset();
+}
+
+//kB of resident and proportional set, the latter splitting shared pages
+//between the processes sharing them
+static bool processMemory(pid_t pid, size_t& rss, size_t& pss){
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", (int)pid);
+	FILE* file = fopen(path, "r");
+	bool rollup = file != NULL;
+	if (!rollup){
+		snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+		file = fopen(path, "r");
+	}
+	if (file == NULL)
+		return false;
+	rss = pss = 0;
+	char line[256];
+	unsigned long kb;
+	while (fgets(line, sizeof(line), file) != NULL){
+		if (sscanf(line, rollup ? "Rss: %lu" : "VmRSS: %lu", &kb) == 1)
+			rss = kb;
+		else if (rollup && sscanf(line, "Pss: %lu", &kb) == 1)
+			pss = kb;
+	}
+	fclose(file);
+	//without smaps_rollup nothing is known to be shared
+	if (!rollup)
+		pss = rss;
+	return true;
+}
+
+static void reportMemory(pid_t parent, const vector<pid_t>& children){
+	size_t rss, pss, totalRss = 0, totalPss = 0;
+	if (processMemory(parent, rss, pss)){
+		totalRss += rss;
+		totalPss += pss;
+	}
+	for (size_t i = 0; i < children.size(); i++){
+		if (!processMemory(children[i], rss, pss))
+			continue;
+		cout<<"Worker "<<children[i]<<": RSS "<<rss/1024.0<<" MB, PSS "<<pss/1024.0<<" MB"<<endl;
+		totalRss += rss;
+		totalPss += pss;
+	}
+	cout<<"Memory of the parent and "<<children.size()<<" workers: RSS "<<totalRss/1024.0
+		<<" MB summed, PSS "<<totalPss/1024.0<<" MB (shared pages counted once)"<<endl;
+}
+
+//serves connections accepted on server until asked to stop, with one thread
+//and Detector per concurrent client. ready, if not negative, gets a byte once
+//the detectors are constructed
+static void serveSocket(int server, const char* cfgname, int threads, ResultCache* cache, int ready, bool report){
+	vector<DaemonWorker> workers(threads);
+	BoundedQueue<int> connections(threads*4);
+	for (int i = 0; i < threads; i++){
+		workers[i].detector = new Detector(cfgname);
+		workers[i].detector->setCache(cache);
+		workers[i].connections = &connections;
+	}
+	if (report)
+		ModelRegistry::report(cout);
+	for (int i = 0; i < threads; i++){
+		if (pthread_create(&workers[i].thread, NULL, serve, &workers[i]) != 0){
+			cerr<<"Cannot start worker thread"<<endl;
+			exit(1);
+		}
+	}
+	if (ready >= 0){
+		char byte = 1;
+		if (write(ready, &byte, 1) != 1)
+			cerr<<"Cannot report the worker ready"<<endl;
+		close(ready);
+	}
+	
+	while (!stopping){
+		int client = accept(server, NULL, NULL);
+		if (client < 0){
+			if (errno != EINTR)
+				cerr<<"accept failed: "<<strerror(errno)<<endl;
+			continue;
+		}
+		//waits while every worker is busy and the backlog is full
+		connections.push(client);
+	}
+	//workers may be blocked on idle clients, leave them to the exit
+}
+
+//one worker process, serving the listening socket it shares with the others;
+//the kernel hands each new connection to one of the processes waiting in accept
+static pid_t startWorker(int index, int server, const char* cfgname, int threads, int cacheEntries, const char* cacheDir,
+		const char* traceFile, bool independent, int ready){
+	pid_t pid = fork();
+	if (pid != 0){
+		if (pid < 0)
+			cerr<<"Cannot fork worker "<<index<<": "<<strerror(errno)<<endl;
+		return pid;
+	}
+	
+	//memory tiers are per process, the disk tier is shared
+	ResultCache* cache = NULL;
+	if (cacheEntries > 0 || cacheDir != NULL)
+		cache = new ResultCache(cacheEntries > 0 ? cacheEntries : 65536, cacheDir != NULL ? cacheDir : "");
+	//the baseline to compare with: the worker loads its own models, and keeps
+	//them loaded for its detectors as the parent does in shared mode
+	Detector* models = NULL;
+	if (independent){
+		//the warm-up stays out of the totals of all workers
+		Metrics::unshare();
+		models = new Detector(cfgname);
+		warmUp(*models);
+		Metrics::share();
+	}
+	if (traceFile != NULL)
+		Trace::start();
+	serveSocket(server, cfgname, threads, cache, ready, false);
+	if (traceFile != NULL){
+		ostringstream name;
+		name<<traceFile<<"."<<index;
+		Trace::stop();
+		Trace::write(name.str().data());
+	}
+	delete models;
+	exit(0);
+}
+
+//pre-fork mode: the parent loads and warms up the models, forks the workers,
+//which share the model pages copy-on-write, and restarts any that dies
+static int serveProcesses(int server, const char* cfgname, int processes, int threads, int cacheEntries, const char* cacheDir,
+		const char* traceFile, bool independent){
+	uint64_t begin = Metrics::now();
+	//kept until exit, so that the registry holds on to the models. nothing before
+	//the fork may start a thread, the children would not inherit it
+	Detector* models = NULL;
+	if (!independent){
+		models = new Detector(cfgname);
+		warmUp(*models);
+		ModelRegistry::report(cout);
+	}
+	//the workers add into the same metrics, so whichever worker takes a
+	//SOURCE_METRICS request answers with the totals of all of them
+	if (!Metrics::share())
+		cerr<<"Cannot share the metrics between workers, each reports its own"<<endl;
+	
+	int ready[2];
+	if (pipe(ready) != 0){
+		cerr<<"Cannot create a pipe: "<<strerror(errno)<<endl;
+		return 1;
+	}
+	vector<pid_t> children(processes);
+	vector<uint64_t> started(processes);
+	for (int i = 0; i < processes; i++){
+		children[i] = startWorker(i, server, cfgname, threads, cacheEntries, cacheDir, traceFile, independent, ready[1]);
+		started[i] = Metrics::now();
+		if (children[i] < 0)
+			return 1;
+	}
+	close(ready[1]);
+	int count = 0;
+	char byte;
+	while (count < processes){
+		ssize_t n = read(ready[0], &byte, 1);
+		if (n == 1)
+			count++;
+		else if (n == 0 || errno != EINTR)
+			break;
+	}
+	close(ready[0]);
+	int status = 0;
+	if (count < processes){
+		cerr<<"Only "<<count<<" of "<<processes<<" workers started"<<endl;
+		stopping = 1;
+		status = 1;
+	}
+	else{
+		cout<<"Started "<<processes<<" worker processes with "<<threads<<" threads each in "
+			<<(Metrics::now() - begin)/1e9<<" seconds, models "<<(independent ? "loaded by each worker" : "shared")<<endl;
+		reportMemory(getpid(), children);
+	}
+	
+	while (!stopping){
+		int wstatus;
+		pid_t pid = waitpid(-1, &wstatus, 0);
+		if (pid < 0){
+			if (errno != EINTR)
+				break;
+			continue;
+		}
+		for (int i = 0; i < processes && !stopping; i++){
+			if (children[i] != pid)
+				continue;
+			children[i] = 0;
+			//one that dies right away would only die again
+			if (Metrics::now() - started[i] < 1000000000ULL){
+				cerr<<"Worker "<<pid<<" failed at startup, stopping"<<endl;
+				stopping = 1;
+				status = 1;
+				break;
+			}
+			cerr<<"Worker "<<pid<<" exited, restarting it"<<endl;
+			children[i] = startWorker(i, server, cfgname, threads, cacheEntries, cacheDir, traceFile, independent, -1);
+			started[i] = Metrics::now();
+		}
+	}
+	
+	for (int i = 0; i < processes; i++){
+		if (children[i] > 0)
+			kill(children[i], SIGTERM);
+	}
+	for (int i = 0; i < processes; i++){
+		if (children[i] > 0)
+			waitpid(children[i], NULL, 0);
+	}
+	delete models;
+	return status;
+}
+
+static void usage(const char* name){
+	cerr<<"Usage: "<<name<<" [-c detector.cfg] [-s socket] [-t threads] [-w processes [-I]] [-T trace.json] [-C entries] [-D directory]"<<endl;
+	cerr<<"  -c  detector configuration, default detector.cfg"<<endl;
+	cerr<<"  -s  socket path, default /tmp/kbdetect.sock"<<endl;
+	cerr<<"  -t  worker threads (concurrent clients), default one per CPU, or one per process with -w"<<endl;
+	cerr<<"  -w  fork this many worker processes sharing the models loaded by the parent"<<endl;
+	cerr<<"  -I  with -w, every worker loads its own models instead, to compare startup and memory"<<endl;
+	cerr<<"  -T  trace the latest requests and write them as a Chrome trace on exit, one per worker with -w"<<endl;
+	cerr<<"  -C  cache the results of this many distinct images, shared by all workers (of a process with -w)"<<endl;
+	cerr<<"  -D  directory keeping cached results across restarts, implies -C 65536 if not given"<<endl;
+}
+
+int main(int argc, char** argv){
+	const char* cfgname = "detector.cfg";
+	const char* socketPath = "/tmp/kbdetect.sock";
+	int threads = 0;
+	int processes = 0;
+	bool independent = false;
+	const char* traceFile = NULL;
+	int cacheEntries = 0;
+	const char* cacheDir = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:s:t:w:IT:C:D:h")) != -1){
+		switch (opt){
+			case 'c': cfgname = optarg; break;
+			case 's': socketPath = optarg; break;
+			case 't': threads = atoi(optarg); break;
+			case 'w': processes = atoi(optarg); break;
+			case 'I': independent = true; break;
+			case 'T': traceFile = optarg; break;
+			case 'C': cacheEntries = atoi(optarg); break;
+			case 'D': cacheDir = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (threads <= 0)
+		threads = processes > 0 ? 1 : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(socketPath) >= sizeof(addr.sun_path)){
+		cerr<<"Socket path too long: "<<socketPath<<endl;
+		return 1;
+	}
+	strcpy(addr.sun_path, socketPath);
+	
+	int server = socket(AF_UNIX, SOCK_STREAM, 0);
+	unlink(socketPath);
+	if (server < 0 || bind(server, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(server, 64) != 0){
+		cerr<<"Cannot listen on "<<socketPath<<": "<<strerror(errno)<<endl;
+		return 1;
+	}
+	
+	//no SA_RESTART, so accept and waitpid return when asked to stop
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	int status = 0;
+	if (processes > 0){
+		cout<<"Serving on "<<socketPath<<" with "<<processes<<" worker processes"<<endl;
+		status = serveProcesses(server, cfgname, processes, threads, cacheEntries, cacheDir, traceFile, independent);
+	}
+	else{
+		//models are loaded here, once, and shared by all workers
+		ResultCache* cache = NULL;
+		if (cacheEntries > 0 || cacheDir != NULL)
+			cache = new ResultCache(cacheEntries > 0 ? cacheEntries : 65536, cacheDir != NULL ? cacheDir : "");
+		if (traceFile != NULL)
+			Trace::start();
+		cout<<"Serving on "<<socketPath<<" with "<<threads<<" workers"<<endl;
+		serveSocket(server, cfgname, threads, cache, -1, true);
+		if (traceFile != NULL){
+			Trace::stop();
+			Trace::write(traceFile);
+		}
+	}
+	
+	close(server);
+	unlink(socketPath);
+	cout<<"Stopped"<<endl;
+	return status;
+}
@@ -1,289 +1,774 @@
 #include "detector.h"
-#include <ctime>
-#include <sys/time.h>
+#include "haar-binary.h"
+#include "model-registry.h"
+#include "jpeg-decode.h"
+#include "metrics.h"
+#include "trace.h"
+#include "result-cache.h"
+#include "renderer.h"
+#include "quality.h"
+#include "face-tensor.h"
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <algorithm>
 
-Detector::Detector(){
-	struct timeval begin, end;
-	gettimeofday(&begin, NULL);
-	ifstream fin;
-	fin.open("detector.cfg");
-	if (fin.fail()){
-		cout<<"Cannot open detector configuration file"<<endl;
+Detector::Detector(const char* cfgname){
+	this->cfgname = cfgname;
+	config = ModelRegistry::acquireConfig(cfgname);
+	if (config == NULL){
+		cerr<<"Cannot open detector configuration file"<<endl;
 		exit(1);
 	}
 	
-	string cascade;
-	string intradetect;
-	string intratrack;
 	dtype = UNKNOWN;
-	//parse parameters
-	char line[1024];
-	fin.getline(line,1024);
-	string dt;
-	while(!fin.eof()){
-		char *tok;
-		tok = strtok(line, " ");
-		if (strcmp(tok,"TYPE")==0){
-			dt = strtok(NULL, " ");
-		}		
-		if (strcmp(tok,"CASCADE")==0){
-			cascade = strtok(NULL, " ");
-		}
-		else if (strcmp(tok,"INTRADETECT")==0){
-			intradetect = strtok(NULL, " ");
-		}
-		else if (strcmp(tok,"INTRATRACK")==0){
-			intratrack = strtok(NULL, " ");
-		}		
-		fin.getline(line,1024);
-	}
-	if (strcmp(dt.data(),"SZU")==0){
-		faceCascade = LoadMBLBPCascade(cascade.data());
+	faceCascade = NULL;
+	sharedHaarCascade = NULL;
+	HaarCascade = NULL;
+	string cascade = config->cascade;
+	string haarcascade = config->haarcascade;
+	if (config->type == "SZU"){
+		faceCascade = ModelRegistry::acquireMBLBP(cascade);
 		dtype = DSZU;
 	}
-	else if (strcmp(dt.data(),"OPENCV")==0){
-		HaarCascade = (CvHaarClassifierCascade*)cvLoad(cascade.data(), 0, 0, 0);
+	else if (config->type == "OPENCV"){
+		sharedHaarCascade = ModelRegistry::acquireHaar(cascade);
 		dtype = DOPENCV;
 	}
+	else if (config->type == "SZU+OPENCV"){
+		//MB-LBP proposes candidates, the Haar cascade only verifies them
+		faceCascade = ModelRegistry::acquireMBLBP(cascade);
+		sharedHaarCascade = ModelRegistry::acquireHaar(haarcascade);
+		dtype = DSZU_OPENCV;
+	}
 	else{
-		cout<<"Unknown detector cascade type"<<dtype<<endl;
+		cerr<<"Unknown detector cascade type "<<config->type<<endl;
 		exit(1);
 	}
-	if(faceCascade == NULL)
+	if((dtype != DOPENCV && faceCascade == NULL) || (dtype != DSZU && sharedHaarCascade == NULL))
     {
-        printf("Couldn't load Face detector '%s'\n", cascade.data());
+        printf("Couldn't load Face detector '%s'\n", faceCascade == NULL ? cascade.data() : haarcascade.data());
         exit(1);
     }
+	//scan state is per detector, the models themselves are shared
+	if (faceCascade != NULL)
+		workspace.lbp = CreateMBLBPWorkspace(faceCascade);
+	if (sharedHaarCascade != NULL)
+		HaarCascade = CloneHaarCascade(sharedHaarCascade);
 	
-	xxd = new XXDescriptor(4);
-	faceLandmark = new FaceAlignment(intradetect.data(), intratrack.data(), xxd);
-	if (!faceLandmark->Initialized()) {
+	sharedLandmark = ModelRegistry::acquireAlignment(config->intradetect, config->intratrack);
+	if (sharedLandmark == NULL) {
 		cerr << "FaceAlignment cannot be initialized." << endl;
 		exit(1);
 	}
-	gettimeofday(&end, NULL);
-	double elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Detection initialized in "<<elapsed<<" seconds"<<endl;
+	faceLandmark = new FaceAlignment(*sharedLandmark);
+	pool = NULL;
+	poolSize = config->threads;
+	cache = NULL;
+	configHash = ResultCache::configHash(*config);
+	started = 0;
 }
 
-Mat Detector::detect(const string imgname, int numLandmarks){
-	Mat resized;
-	struct timeval begin, end;
-	gettimeofday(&begin, NULL);
-	
-	IplImage *frame = cvLoadImage(imgname.data(), 2|4);
-	if (frame == NULL)
+Detector::~Detector(){
+	delete pool;
+	for (size_t i = 0; i < batchWorkers.size(); i++){
+		if (batchWorkers[i] != this)
+			delete batchWorkers[i];
+	}
+	for (size_t i = 0; i < workerLandmarks.size(); i++){
+		if (workerLandmarks[i] != faceLandmark)
+			delete workerLandmarks[i];
+	}
+	delete faceLandmark;
+	if (HaarCascade != NULL)
+		cvReleaseHaarClassifierCascade(&HaarCascade);
+	ReleaseMBLBPWorkspace(&workspace.lbp);
+	if (workspace.storage != NULL)
+		cvReleaseMemStorage(&workspace.storage);
+	if (workspace.verifyStorage != NULL)
+		cvReleaseMemStorage(&workspace.verifyStorage);
+	ModelRegistry::release(sharedLandmark);
+	ModelRegistry::release(sharedHaarCascade);
+	ModelRegistry::release(faceCascade);
+	ModelRegistry::release(config);
+}
+
+bool Detector::loadImage(const string& imgname, Mat& frame){
+	uint64_t begin = Metrics::now();
+	frame = imread(imgname, CV_LOAD_IMAGE_ANYDEPTH|CV_LOAD_IMAGE_ANYCOLOR);
+	Metrics::observe(MDECODE, begin);
+	if (frame.empty())
     {
+      Metrics::count(EDECODE_FAILED);
       fprintf(stderr, "Cannot open image %s.Returning empty Mat...\n", imgname.data());
-      return resized;
+      return false;
     }
-	
-	else if (frame->width < 50 || frame->height < 50)
+	return checkImage(frame, imgname.data());
+}
+
+bool Detector::readFile(const string& filename, vector<uchar>& buffer){
+	ifstream fin(filename.data(), ios::binary);
+	fin.seekg(0, ios::end);
+	streamoff length = fin ? (streamoff)fin.tellg() : 0;
+	if (length <= 0){
+		Metrics::count(EDECODE_FAILED);
+		fprintf(stderr, "Cannot open image %s.\n", filename.data());
+		return false;
+	}
+	//resize keeps the capacity, the buffer is reused for the next file
+	buffer.resize((size_t)length);
+	fin.seekg(0, ios::beg);
+	fin.read((char*)&buffer[0], length);
+	return true;
+}
+
+bool Detector::decodeImage(const uchar* data, size_t size, Mat& frame){
+	if (data == NULL || size == 0){
+		fprintf(stderr, "Empty image buffer.Returning empty Mat...\n");
+		return false;
+	}
+	//wraps the bytes, imdecode reads them in place and reuses frame's pixels when they fit
+	Mat buffer(1, (int)size, CV_8UC1, (void*)data);
+	uint64_t begin = Metrics::now();
+	imdecode(buffer, CV_LOAD_IMAGE_ANYDEPTH|CV_LOAD_IMAGE_ANYCOLOR, &frame);
+	Metrics::observe(MDECODE, begin);
+	if (frame.empty())
     {
-      fprintf(stderr, "image %s too small.Returning empty Mat...\n", imgname.data());
-      cvReleaseImage(&frame);
-	  return resized;
+      Metrics::count(EDECODE_FAILED);
+      fprintf(stderr, "Cannot decode image buffer.Returning empty Mat...\n");
+      return false;
+    }
+	return checkImage(frame, "buffer");
+}
+
+bool Detector::checkImage(Mat& frame, const char* name){
+	if (frame.cols < 50 || frame.rows < 50)
+    {
+      fprintf(stderr, "image %s too small.Returning empty Mat...\n", name);
+	  return false;
     }	
-	else if (frame->width > 100000 || frame->height > 100000)
+	else if (frame.cols > 100000 || frame.rows > 100000)
     {
-      fprintf(stderr, "image %s too large.Returning empty Mat...\n", imgname.data());
-      cvReleaseImage(&frame);
-	  return resized;
+      fprintf(stderr, "image %s too large.Returning empty Mat...\n", name);
+	  return false;
     }
-	
-	// convert image to grayscale
-    IplImage *frame_bw = cvCreateImage(cvSize(frame->width, frame->height), IPL_DEPTH_8U, 1);
-    cvConvertImage(frame, frame_bw);
-	Mat frame_mat(frame, 1);
-	// Smallest face size.
-    CvSize minFeatureSize = cvSize(100, 100);
-    int flags =  CV_HAAR_DO_CANNY_PRUNING;
-    // How detailed should the search be.
-    float search_scale_factor = 1.1f;
-    CvMemStorage* storage;
+	//16 bit images are scaled down like cvConvertImage does
+	if (frame.depth() != CV_8U){
+		Mat frame8;
+		frame.convertTo(frame8, CV_8U, frame.depth() == CV_16U ? 1.0/256 : 1.0);
+		frame = frame8;
+	}
+	return true;
+}
+
+Mat Detector::wrapImage(const ImageView& image){
+	int channels = 1;
+	if (image.format == PIX_BGR || image.format == PIX_RGB)
+		channels = 3;
+	else if (image.format == PIX_BGRA || image.format == PIX_RGBA)
+		channels = 4;
+	if (image.data == NULL || image.width <= 0 || image.height <= 0 || image.stride < (size_t)image.width*channels){
+		fprintf(stderr, "Invalid image view.Returning empty Mat...\n");
+		return Mat();
+	}
+	//header only, the pixels stay in the caller's buffer
+	Mat frame(image.height, image.width, CV_8UC(channels), (void*)image.data, image.stride);
+	if (!checkImage(frame, "view"))
+		return Mat();
+	return frame;
+}
+
+void Detector::toGray(const Mat& frame, int format, Mat& gray){
+	if (frame.channels() == 1){
+		gray = frame;
+		return;
+	}
+	uint64_t begin = Metrics::now();
+	if (format == PIX_RGB){
+		cvtColor(frame, gray, CV_RGB2GRAY);
+	}
+	else if (format == PIX_RGBA){
+		cvtColor(frame, gray, CV_RGBA2GRAY);
+	}
+	else if (frame.channels() == 4){
+		cvtColor(frame, gray, CV_BGRA2GRAY);
+	}
+	else{
+		cvtColor(frame, gray, CV_BGR2GRAY);
+	}
+	Metrics::observe(MGRAY, begin);
+}
+
+void Detector::findFaces(const Mat& gray, vector<Rect>& faces, const ScanParams& scan, uint64_t deadline, bool* truncated){
+	IplImage frame_bw = gray;
     CvSeq* rects;
-    int nFaces;
 	
-    storage = cvCreateMemStorage(0);
+	faces.clear();
+	if (workspace.storage == NULL)
+		workspace.storage = cvCreateMemStorage(0);
+	//the blocks stay allocated for the next image
+	CvMemStorage* storage = workspace.storage;
     cvClearMemStorage(storage);
 
     // Detect all the faces in the greyscale image.
-	if (dtype == DSZU){
-		rects = MBLBPDetectMultiScale(frame_bw, faceCascade, storage, 1229, 1, 50, 500);
+	rects = detectFaces(&frame_bw, storage, scan, deadline, truncated);
+	if (rects == NULL){
+		fprintf(stderr, "Unknown detector type: %d\n", dtype);
+		return;
 	}
-	else if (dtype == DOPENCV){
-		rects = cvHaarDetectObjects(frame_bw, HaarCascade, storage, search_scale_factor, 2, flags, minFeatureSize);
-	}
-	else{
-		cout<<"Unknown detector type: "<<dtype<<endl;
-		return resized;
+
+	//every detector returns CvAvgComp
+	workspace.neighbors.clear();
+	for (int i = 0; i < rects->total; i++){
+		CvAvgComp *r = (CvAvgComp*)cvGetSeqElem(rects, i);
+		faces.push_back(Rect(r->rect.x, r->rect.y, r->rect.width, r->rect.height));
+		workspace.neighbors.push_back(r->neighbors);
 	}
-	gettimeofday(&end, NULL);	
-    double elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Face detected in "<<elapsed<<" seconds"<<endl;	
-	gettimeofday(&begin, NULL);
-	nFaces = rects->total;
-
-	if (nFaces != 1){
-		//storage = cvCreateMemStorage(0);
-		cvReleaseMemStorage(&storage);
-		cvReleaseImage(&frame_bw);
-		cvReleaseImage(&frame);	
-		return resized;
+}
+
+bool Detector::findFace(const Mat& gray, Rect& face, const ScanParams& scan, uint64_t deadline, bool* truncated, int* neighbors){
+	vector<Rect>& faces = workspace.faces;
+	findFaces(gray, faces, scan, deadline, truncated);
+	if (faces.size() != 1){
+		Metrics::count(faces.empty() ? ENO_FACE : EMULTIPLE_FACES);
+		return false;
 	}
-		
-	int iface = 0;
-	CvRect *r = (CvRect*)cvGetSeqElem(rects, iface);
-	
+	face = faces[0];
+	if (neighbors != NULL)
+		*neighbors = workspace.neighbors[0];
+	return true;
+}
+
+int Detector::gateFace(const Mat& gray, const Rect& face, int neighbors){
+	const QualityGate& gate = config->gate;
+	if (!GateEnabled(gate))
+		return GATE_PASS;
+	uint64_t begin = Metrics::now();
+	FaceQuality quality;
+	MeasureFaceQuality(gray, face, neighbors, quality);
+	int result = CheckFaceQuality(quality, gate);
+	Metrics::observe(MGATE, begin);
+	if (result != GATE_PASS)
+		Metrics::count(GateEvent(result));
+	return result;
+}
+
+bool Detector::markFace(const Mat& frame, const Rect& face, float notFace, Mat& landmarks, INTRAFACE::HeadPose& hp, float* score, bool estimatePose){
 	//Face landmark detection
-	float score, notFace = 0.5;
-	Mat X;
-	Rect rect(r->x, r->y, r->width, r->height);
-	INTRAFACE::HeadPose hp;
+	float confidence;
 
-	gettimeofday(&begin, NULL);
-	if (faceLandmark->Detect(frame_mat, rect, X, score) == INTRAFACE::IF_OK)
+	uint64_t begin = Metrics::now();
+	if (faceLandmark->Detect(frame, face, landmarks, confidence) == INTRAFACE::IF_OK)
 	{
-		faceLandmark->EstimateHeadPose(X,hp);
-		// only draw valid faces
-		if (score >= notFace) {
-			for (int i = 0 ; i < X.cols ; i++)
-				cv::circle(frame_mat,cv::Point((int)X.at<float>(0,i), (int)X.at<float>(1,i)), 2, cv::Scalar(0,255,0), -1);
+		Metrics::observe(MLANDMARK, begin);
+		if (score != NULL)
+			*score = confidence;
+		if (confidence < notFace) {
+			Metrics::count(EFALSE_POSITIVE);
+			return false;
 		}
-		else{
-			cout<<"False positive face"<<endl;
-			return resized;
+		if (estimatePose){
+			begin = Metrics::now();
+			faceLandmark->EstimateHeadPose(landmarks,hp);
+			Metrics::observe(MPOSE, begin);
 		}
 	}
 	else
 	{
-		cout<<"Landmark detection failed"<<endl;
-		return resized;
+		Metrics::count(ELANDMARK_FAILED);
+		return false;
 	}
-	gettimeofday(&end, NULL);	
-    elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Landmarks detected in "<<elapsed<<" seconds"<<endl;
-	cvReleaseMemStorage(&storage);
-	cvReleaseImage(&frame_bw);
-	cvReleaseImage(&frame);
-	return frame_mat;
+	return true;
 }
 
-Mat Detector::detect(const string imgname, Mat& landmarks, int* pose, int numLandmarks){
-	Mat resized;
-	struct timeval begin, end;
-	gettimeofday(&begin, NULL);
-	
-	IplImage *frame = cvLoadImage(imgname.data(), 2|4);
-	if (frame == NULL)
-    {
-      fprintf(stderr, "Cannot open image %s.Returning empty Mat...\n", imgname.data());
-      return resized;
-    }
-	
-	else if (frame->width < 50 || frame->height < 50)
-    {
-      fprintf(stderr, "image %s too small.Returning empty Mat...\n", imgname.data());
-      cvReleaseImage(&frame);
-	  return resized;
-    }	
-	else if (frame->width > 100000 || frame->height > 100000)
-    {
-      fprintf(stderr, "image %s too large.Returning empty Mat...\n", imgname.data());
-      cvReleaseImage(&frame);
-	  return resized;
-    }
+static bool largerFace(const Rect& a, const Rect& b){
+	return a.area() > b.area();
+}
+
+struct MarkFacesTask{
+	const Mat* frame;
+	const vector<Rect>* rects;
+	const vector<FaceAlignment*>* aligners;
+	vector<FaceResult>* results;
+	vector<char>* found;
+	float notFace;
+};
+
+//runs on the pool, each worker has its own FaceAlignment
+static void markFacesTask(void* arg, int index, int worker){
+	MarkFacesTask* task = (MarkFacesTask*)arg;
+	FaceAlignment* aligner = (*task->aligners)[worker];
+	FaceResult& result = (*task->results)[index];
+	INTRAFACE::HeadPose hp;
 	
-	// convert image to grayscale
-    IplImage *frame_bw = cvCreateImage(cvSize(frame->width, frame->height), IPL_DEPTH_8U, 1);
-    cvConvertImage(frame, frame_bw);
-	Mat frame_mat(frame, 1);
-	// Smallest face size.
-    CvSize minFeatureSize = cvSize(100, 100);
-    int flags =  CV_HAAR_DO_CANNY_PRUNING;
-    // How detailed should the search be.
-    float search_scale_factor = 1.1f;
-    CvMemStorage* storage;
-    CvSeq* rects;
-    int nFaces;
+	result.face = (*task->rects)[index];
+	(*task->found)[index] = 0;
+	uint64_t begin = Metrics::now();
+	if (aligner->Detect(*task->frame, result.face, result.landmarks, result.score) != INTRAFACE::IF_OK){
+		Metrics::count(ELANDMARK_FAILED);
+		return;
+	}
+	Metrics::observe(MLANDMARK, begin);
+	if (result.score < task->notFace){
+		Metrics::count(EFALSE_POSITIVE);
+		return;
+	}
+	begin = Metrics::now();
+	aligner->EstimateHeadPose(result.landmarks, hp);
+	Metrics::observe(MPOSE, begin);
+	for (int i = 0; i < 3; i++){
+		result.pose[i] = hp.angles[i];
+	}
+	(*task->found)[index] = 1;
+}
+
+bool Detector::setThreads(int threads){
+	if (pool != NULL)
+		return false;
+	poolSize = threads;
+	return true;
+}
+
+void Detector::startPool(){
+	if (pool != NULL)
+		return;
+	pool = new ThreadPool(poolSize);
+	workerLandmarks.push_back(faceLandmark);
+	for (int i = 1; i < pool->size(); i++)
+		workerLandmarks.push_back(new FaceAlignment(*sharedLandmark));
+}
+
+int Detector::markFaces(const Mat& frame, const Mat& gray, vector<Rect>& rects, int maxFaces, vector<FaceResult>& faces){
+	faces.clear();
+	if (rects.empty()){
+		Metrics::count(ENO_FACE);
+		return 0;
+	}
+	//gated while rects are still in findFaces' order, the neighbors are in that order
+	vector<Rect> kept, gated;
+	for (size_t i = 0; i < rects.size(); i++){
+		int neighbors = i < workspace.neighbors.size() ? workspace.neighbors[i] : 0;
+		bool pass = gateFace(gray, rects[i], neighbors) == GATE_PASS;
+		if (pass || config->gate.shadow)
+			kept.push_back(rects[i]);
+		if (!pass)
+			gated.push_back(rects[i]);
+	}
+	rects.swap(kept);
+	stable_sort(rects.begin(), rects.end(), largerFace);
+	if (maxFaces > 0 && (int)rects.size() > maxFaces)
+		rects.resize(maxFaces);
+	if (rects.empty())
+		return 0;
 	
-    storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
+	startPool();
+	vector<FaceResult> results(rects.size());
+	vector<char> found(rects.size());
+	MarkFacesTask task = {&frame, &rects, &workerLandmarks, &results, &found, config->scan.notFace};
+	pool->parallelFor((int)rects.size(), markFacesTask, &task);
+	for (size_t i = 0; i < results.size(); i++){
+		if (found[i])
+			faces.push_back(results[i]);
+		//shadow mode, what IntraFace made of a face the gate would have skipped
+		if (!gated.empty() && find(gated.begin(), gated.end(), rects[i]) != gated.end())
+			Metrics::count(found[i] ? EGATE_MISSED : EGATE_CONFIRMED);
+	}
+	return (int)faces.size();
+}
 
-    // Detect all the faces in the greyscale image.
-	if (dtype == DSZU){
-		rects = MBLBPDetectMultiScale(frame_bw, faceCascade, storage, 1229, 1, 50, 500);
+int Detector::detectAll(const string imgname, vector<FaceResult>& faces, int maxFaces, int numLandmarks){
+	Mat frame, gray;
+	faces.clear();
+	if (!loadImage(imgname, frame))
+		return 0;
+	Metrics::count(EIMAGES);
+	toGray(frame, PIX_BGR, gray);
+	vector<Rect> rects;
+	findFaces(gray, rects, config->scan);
+	return markFaces(frame, gray, rects, maxFaces, faces);
+}
+
+int Detector::detectAll(const uchar* data, size_t size, vector<FaceResult>& faces, int maxFaces, int numLandmarks){
+	Mat frame, gray;
+	faces.clear();
+	if (!decodeImage(data, size, frame))
+		return 0;
+	Metrics::count(EIMAGES);
+	toGray(frame, PIX_BGR, gray);
+	vector<Rect> rects;
+	findFaces(gray, rects, config->scan);
+	return markFaces(frame, gray, rects, maxFaces, faces);
+}
+
+int Detector::detectAll(const ImageView& image, vector<FaceResult>& faces, int maxFaces, int numLandmarks){
+	faces.clear();
+	Mat frame = wrapImage(image);
+	if (frame.empty())
+		return 0;
+	Metrics::count(EIMAGES);
+	Mat gray;
+	toGray(frame, image.format, gray);
+	vector<Rect> rects;
+	findFaces(gray, rects, config->scan);
+	//IntraFace takes BGR or gray, so other layouts are landmarked on gray
+	return markFaces(image.format == PIX_BGR ? frame : gray, gray, rects, maxFaces, faces);
+}
+
+Mat Detector::detect(const string imgname, int numLandmarks){
+	Mat landmarks;
+	int pose[3];
+	return detect(imgname, landmarks, pose, numLandmarks);
+}
+
+Mat Detector::detect(const uchar* data, size_t size, int numLandmarks){
+	Mat landmarks;
+	int pose[3];
+	return detect(data, size, landmarks, pose, numLandmarks);
+}
+
+Mat Detector::detect(const string imgname, Mat& landmarks, int* pose, int numLandmarks){
+	DetectResult result;
+	if (!detect(imgname, DetectOptions(SLANDMARKS|SPOSE|SANNOTATED), result))
+		return Mat();
+	landmarks = result.landmarks;
+	for (int i = 0; i < 3; i++){
+		pose[i] = result.pose[i];
 	}
-	else if (dtype == DOPENCV){
-		rects = cvHaarDetectObjects(frame_bw, HaarCascade, storage, search_scale_factor, 2, flags, minFeatureSize);
+	return result.annotated;
+}
+
+Mat Detector::detect(const uchar* data, size_t size, Mat& landmarks, int* pose, int numLandmarks){
+	DetectResult result;
+	if (!detect(data, size, DetectOptions(SLANDMARKS|SPOSE|SANNOTATED), result))
+		return Mat();
+	landmarks = result.landmarks;
+	for (int i = 0; i < 3; i++){
+		pose[i] = result.pose[i];
 	}
-	else{
-		cout<<"Unknown detector type: "<<dtype<<endl;
-		return resized;
+	return result.annotated;
+}
+
+bool Detector::detect(const ImageView& image, Mat& landmarks, int* pose, int numLandmarks){
+	DetectResult result;
+	if (!detect(image, DetectOptions(SLANDMARKS|SPOSE), result))
+		return false;
+	landmarks = result.landmarks;
+	for (int i = 0; i < 3; i++){
+		pose[i] = result.pose[i];
 	}
-	gettimeofday(&end, NULL);	
-    double elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Face detected in "<<elapsed<<" seconds"<<endl;	
-	gettimeofday(&begin, NULL);
-	nFaces = rects->total;
-
-	if (nFaces != 1){
-		cvReleaseMemStorage(&storage);
-		cvReleaseImage(&frame_bw);
-		cvReleaseImage(&frame);	
-		return resized;
+	return true;
+}
+
+DetectOptions::DetectOptions(int stages){
+	this->stages = stages;
+	numLandmarks = 49;
+	width = 100;
+	height = 100;
+	patchSize = 30;
+	showLandmark = false;
+	budget = 0;
+}
+
+DetectorWorkspace::DetectorWorkspace(){
+	storage = NULL;
+	verifyStorage = NULL;
+	lbp = NULL;
+}
+
+DetectResult::DetectResult(){
+	found = false;
+	score = 0;
+	seconds = 0;
+	truncated = false;
+	neighbors = 0;
+	pose[0] = pose[1] = pose[2] = 0;
+}
+
+bool Detector::detect(const string imgname, const DetectOptions& options, DetectResult& result){
+	result = DetectResult();
+	started = Metrics::now();
+	//read and decoded into the workspace, the cache is keyed by the file content
+	if (!readFile(imgname, workspace.buffer))
+		return false;
+	return detectBuffer(&workspace.buffer[0], workspace.buffer.size(), options, result);
+}
+
+bool Detector::detect(const uchar* data, size_t size, const DetectOptions& options, DetectResult& result){
+	result = DetectResult();
+	started = Metrics::now();
+	return detectBuffer(data, size, options, result);
+}
+
+bool Detector::detectBuffer(const uchar* data, size_t size, const DetectOptions& options, DetectResult& result){
+	detectEncoded(data, size, workspace.frame, options, result);
+	//the annotated image is the frame itself, the next image must not be decoded over it
+	if (options.stages & SANNOTATED)
+		workspace.frame.release();
+	return result.found;
+}
+
+bool Detector::detectEncoded(const uchar* data, size_t size, Mat& frame, const DetectOptions& options, DetectResult& result){
+	CacheKey key;
+	bool cached = cache != NULL && data != NULL && ResultCache::cacheable(options);
+	if (cached){
+		key = ResultCache::key(data, size, options, *config, configHash);
+		if (cache->lookup(key, result))
+			return result.found;
 	}
-		
-	int iface = 0;
-	CvRect *r = (CvRect*)cvGetSeqElem(rects, iface);
+	if (!decodeImage(data, size, frame))
+		return false;
+	result.found = process(frame, PIX_BGR, true, options, result);
+	//undecodable images are not cached, they may be truncated uploads,
+	//and neither are scans cut short by the budget
+	if (cached && !result.truncated)
+		cache->insert(key, result);
+	return result.found;
+}
+
+void Detector::setCache(ResultCache* cache){
+	this->cache = cache;
+	for (size_t i = 1; i < batchWorkers.size(); i++)
+		batchWorkers[i]->setCache(cache);
+}
+
+const DetectorConfig& Detector::configuration() const{
+	return *config;
+}
+
+bool Detector::detect(const ImageView& image, const DetectOptions& options, DetectResult& result){
+	result = DetectResult();
+	started = Metrics::now();
+	Mat frame = wrapImage(image);
+	if (frame.empty())
+		return false;
+	result.found = process(frame, image.format, false, options, result);
+	return result.found;
+}
+
+BatchInput::BatchInput(const string& filename){
+	this->filename = filename;
+	data = NULL;
+	size = 0;
+}
+
+BatchInput::BatchInput(const uchar* data, size_t size){
+	this->data = data;
+	this->size = size;
+}
+
+struct BatchTask{
+	const vector<BatchInput>* inputs;
+	vector<DetectResult>* results;
+	const DetectOptions* options;
+	const vector<Detector*>* workers;
+	int firstImage; //trace number of input 0
+	int next;
+	int found;
+};
+
+//one lane per thread, lanes take the next image until none are left
+static void batchTask(void* arg, int lane, int worker){
+	BatchTask* task = (BatchTask*)arg;
+	Detector* detector = (*task->workers)[worker];
+	int count = (int)task->inputs->size();
+	int i;
+	while ((i = __sync_fetch_and_add(&task->next, 1)) < count){
+		uint64_t begin = Metrics::now();
+		Trace::setImage(task->firstImage + i);
+		if (detector->detectInput((*task->inputs)[i], *task->options, (*task->results)[i]))
+			__sync_fetch_and_add(&task->found, 1);
+		if (Trace::enabled())
+			Trace::span("image", begin, Metrics::now());
+	}
+	Trace::setImage(-1);
+}
+
+int Detector::detectBatch(const vector<BatchInput>& inputs, vector<DetectResult>& results, const DetectOptions& options, int threads, int firstImage){
+	results.assign(inputs.size(), DetectResult());
+	if (inputs.empty())
+		return 0;
 	
-	//Face landmark detection
-	float score, notFace = 0.5;
-	Rect rect(r->x, r->y, r->width, r->height);
-	INTRAFACE::HeadPose hp;
+	startPool();
+	//every thread gets a detector of its own, the models behind them are shared through the registry
+	if (batchWorkers.empty()){
+		batchWorkers.push_back(this);
+		for (int i = 1; i < pool->size(); i++){
+			batchWorkers.push_back(new Detector(cfgname.data()));
+			batchWorkers.back()->cache = cache;
+		}
+	}
+	if (threads <= 0 || threads > pool->size())
+		threads = pool->size();
+	
+	uint64_t begin = Metrics::now();
+	BatchTask task = {&inputs, &results, &options, &batchWorkers, firstImage, 0, 0};
+	pool->parallelFor(threads, batchTask, &task);
+	if (Trace::enabled())
+		Trace::span("batch", begin, Metrics::now(), (int)inputs.size());
+	return task.found;
+}
 
-	gettimeofday(&begin, NULL);
-	if (faceLandmark->Detect(frame_mat, rect, landmarks, score) == INTRAFACE::IF_OK)
-	{
-		faceLandmark->EstimateHeadPose(landmarks,hp);
+int Detector::detectAligned(const vector<BatchInput>& inputs, vector<DetectResult>& results, FaceTensor& tensor, const DetectOptions& options, int threads, int firstImage){
+	DetectOptions alignedOptions = options;
+	alignedOptions.stages |= SALIGNED;
+	detectBatch(inputs, results, alignedOptions, threads, firstImage);
+	//packed here rather than by the batch threads, a conversion is a few
+	//microseconds per face and this keeps the faces in input order
+	tensor.reset(inputs.size(), options.width, options.height, options.numLandmarks);
+	for (size_t i = 0; i < results.size(); i++){
+		if (!results[i].found || results[i].aligned.empty())
+			continue;
+		if (tensor.append(results[i].aligned, results[i].alignedLandmarks, i))
+			results[i].aligned.release();
+	}
+	return tensor.count;
+}
+
+bool Detector::detectInput(const BatchInput& input, const DetectOptions& options, DetectResult& result){
+	uint64_t begin = Metrics::now();
+	if (input.data != NULL)
+		detect(input.data, input.size, options, result);
+	else
+		detect(input.filename, options, result);
+	result.seconds = (Metrics::now() - begin)/1e9;
+	return result.found;
+}
+
+bool Detector::process(Mat& frame, int format, bool writable, const DetectOptions& options, DetectResult& result){
+	Metrics::count(EIMAGES);
+	//a gray frame is used as it is, and never becomes the workspace buffer,
+	//which would then be converted into
+	Mat gray = frame;
+	if (frame.channels() != 1){
+		toGray(frame, format, workspace.gray);
+		gray = workspace.gray;
+	}
+	uint64_t deadline = options.budget > 0 ? started + (uint64_t)(options.budget*1e9) : 0;
+	bool found = findFace(gray, result.face, MergeScanParams(config->scan, options.scan), deadline, &result.truncated, &result.neighbors);
+	if (result.truncated)
+		Metrics::count(ETRUNCATED);
+	if (!found)
+		return false;
+	return finishFace(frame, gray, format, writable, options, result);
+}
+
+bool Detector::finishFace(Mat& frame, const Mat& gray, int format, bool writable, const DetectOptions& options, DetectResult& result){
+	int stages = options.stages;
+	//the box is all that was asked for, IntraFace does not get to reject it
+	if (!(stages & (SLANDMARKS|SPOSE|SALIGNED|SANNOTATED)))
+		return true;
+	
+	INTRAFACE::HeadPose hp;
+	//IntraFace takes BGR or gray, so other layouts are landmarked on gray
+	const Mat& source = (frame.channels() == 1 || format == PIX_BGR) ? frame : gray;
+	//alignment needs the roll
+	//in shadow mode gated faces are landmarked anyway, to see what the gate would lose
+	int gated = gateFace(gray, result.face, result.neighbors);
+	if (gated != GATE_PASS && !config->gate.shadow)
+		return false;
+	float notFace = MergeScanParams(config->scan, options.scan).notFace;
+	bool marked = markFace(source, result.face, notFace, result.landmarks, hp, &result.score, (stages & (SPOSE|SALIGNED)) != 0);
+	if (gated != GATE_PASS)
+		Metrics::count(marked ? EGATE_MISSED : EGATE_CONFIRMED);
+	if (!marked)
+		return false;
+	if (stages & (SPOSE|SALIGNED)){
 		for (int i = 0; i < 3; i++){
-			pose[i] = hp.angles[i];
+			result.pose[i] = hp.angles[i];
 		}
-		// only draw valid faces
-		if (score >= notFace) {
-			for (int i = 0 ; i < landmarks.cols ; i++)
-				cv::circle(frame_mat,cv::Point((int)landmarks.at<float>(0,i), (int)landmarks.at<float>(1,i)), 2, cv::Scalar(0,255,0), -1);
+	}
+	
+	//aligned from the clean frame, before anything is drawn into it
+	if (stages & SALIGNED){
+		if (!alignFace(frame, hp.angles[0], options, result.landmarks, result.aligned, result.alignedLandmarks))
+			return false;
+	}
+	//only on request, and never into a caller's pixel buffer
+	if (stages & SANNOTATED){
+		if (writable){
+			result.annotated = frame;
+			DrawResult(result.annotated, result);
 		}
 		else{
-			cout<<"False positive face"<<endl;
-			return resized;
+			result.annotated = RenderResult(frame, result);
 		}
 	}
-	else
-	{
-		cout<<"Landmark detection failed"<<endl;
-		return resized;
-	}
-	gettimeofday(&end, NULL);	
-    elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Landmarks detected in "<<elapsed<<" seconds"<<endl;
-	cvReleaseMemStorage(&storage);
-	cvReleaseImage(&frame_bw);
-	cvReleaseImage(&frame); 
+	return true;
+}
 
-	return frame_mat;
+bool Detector::detectReduced(const string imgname, Mat& landmarks, int* pose, int minFace, int numLandmarks){
+	if (!readFile(imgname, workspace.buffer))
+		return false;
+	return detectReduced(&workspace.buffer[0], workspace.buffer.size(), landmarks, pose, minFace, numLandmarks);
+}
+
+bool Detector::detectReduced(const uchar* data, size_t size, Mat& landmarks, int* pose, int minFace, int numLandmarks){
+	Rect face;
+	INTRAFACE::HeadPose hp;
+	if (!IsJpeg(data, size)){
+		//only JPEG can be decoded at reduced size
+		DetectResult result;
+		if (!detect(data, size, DetectOptions(SLANDMARKS|SPOSE), result))
+			return false;
+		landmarks = result.landmarks;
+		for (int i = 0; i < 3; i++){
+			pose[i] = result.pose[i];
+		}
+		return true;
+	}
+	
+	uint64_t begin = Metrics::now();
+	//the cascade looks for faces from 50 pixels up, use the smallest image that still shows minFace that large
+	int denom = 8;
+	while (denom > 1 && minFace/denom < 50)
+		denom /= 2;
+	Mat gray;
+	Size full;
+	if (!DecodeJpegScaled(data, size, denom, gray, full)){
+		Metrics::count(EDECODE_FAILED);
+		fprintf(stderr, "Cannot decode image buffer.\n");
+		return false;
+	}
+	if (full.width < 50 || full.height < 50 || full.width > 100000 || full.height > 100000){
+		fprintf(stderr, "image buffer too small or too large.\n");
+		return false;
+	}
+	Metrics::observe(MDECODE, begin);
+	Metrics::count(EIMAGES);
+	
+	Rect small;
+	if (!findFace(gray, small, config->scan))
+		return false;
+	double sx = full.width/(double)gray.cols;
+	double sy = full.height/(double)gray.rows;
+	face = Rect(cvRound(small.x*sx), cvRound(small.y*sy), cvRound(small.width*sx), cvRound(small.height*sy));
+	
+	//landmarking needs the face at full resolution plus some context around it
+	begin = Metrics::now();
+	Rect region(face.x - face.width/2, face.y - face.height/2, face.width*2, face.height*2);
+	Mat frame;
+	if (!DecodeJpegRegion(data, size, region, frame)){
+		Metrics::count(EDECODE_FAILED);
+		fprintf(stderr, "Cannot decode face region.\n");
+		return false;
+	}
+	Metrics::observe(MDECODE, begin);
+	
+	Rect local(face.x - region.x, face.y - region.y, face.width, face.height);
+	if (!markFace(frame, local, config->scan.notFace, landmarks, hp))
+		return false;
+	//back to full image coordinates
+	landmarks.row(0) += region.x;
+	landmarks.row(1) += region.y;
+	for (int i = 0; i < 3; i++){
+		pose[i] = hp.angles[i];
+	}
+	return true;
 }
 
 bool Detector::detect(const Mat& face, Mat& landmarks, int* pose, int numLandmarks){
 	//Face landmark detection
-	float score, notFace = 0.5;
+	float score, notFace = config->scan.notFace;
 	Rect rect(0, 0, face.cols, face.rows);
 	INTRAFACE::HeadPose hp;
 
@@ -311,112 +796,38 @@ bool Detector::detect(const Mat& face, Mat& landmarks, int* pose, int numLandmar
 }
 
 Mat Detector::detectNorm(string imgname){
-	Mat resized;
-	struct timeval begin, end;
-	gettimeofday(&begin, NULL);
-	
-	IplImage *frame = cvLoadImage(imgname.data(), 2|4);
-	if (frame == NULL)
-    {
-      fprintf(stderr, "Cannot open image %s.Returning empty Mat...\n", imgname.data());
-      return resized;
-    }
-	
-	else if (frame->width < 50 || frame->height < 50)
-    {
-      fprintf(stderr, "image %s too small.Returning empty Mat...\n", imgname.data());
-      cvReleaseImage(&frame);
-	  return resized;
-    }	
-	else if (frame->width > 100000 || frame->height > 100000)
-    {
-      fprintf(stderr, "image %s too large.Returning empty Mat...\n", imgname.data());
-      cvReleaseImage(&frame);
-	  return resized;
-    }
-	
-	// convert image to grayscale
-    IplImage *frame_bw = cvCreateImage(cvSize(frame->width, frame->height), IPL_DEPTH_8U, 1);
-    cvConvertImage(frame, frame_bw);
-	Mat frame_mat(frame, 1);
-	// Smallest face size.
-    CvSize minFeatureSize = cvSize(100, 100);
-    int flags =  CV_HAAR_DO_CANNY_PRUNING;
-    // How detailed should the search be.
-    float search_scale_factor = 1.1f;
-    CvMemStorage* storage;
-    CvSeq* rects;
-    int nFaces;
-	
-    storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
+	Mat frame;
+	if (!loadImage(imgname, frame))
+		return Mat();
+	return normalize(frame);
+}
 
-    // Detect all the faces in the greyscale image.
-	if (dtype == DSZU){
-		rects = MBLBPDetectMultiScale(frame_bw, faceCascade, storage, 1229, 1, 50, 500);
-	}
-	else if (dtype == DOPENCV){
-		rects = cvHaarDetectObjects(frame_bw, HaarCascade, storage, search_scale_factor, 2, flags, minFeatureSize);
-	}
-	else{
-		cout<<"Unknown detector type: "<<dtype<<endl;
-		return resized;
-	}
-	gettimeofday(&end, NULL);	
-    double elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Face detected in "<<elapsed<<" seconds"<<endl;	
-	gettimeofday(&begin, NULL);
-	nFaces = rects->total;
-
-	if (nFaces != 1){
-		//storage = cvCreateMemStorage(0);
-		cvReleaseMemStorage(&storage);
-		cvReleaseImage(&frame_bw);
-		cvReleaseImage(&frame);	
-		return resized;
-	}
-		
-	int iface = 0;
-	CvRect *r = (CvRect*)cvGetSeqElem(rects, iface);
+Mat Detector::detectNorm(const uchar* data, size_t size){
+	Mat frame;
+	if (!decodeImage(data, size, frame))
+		return Mat();
+	return normalize(frame);
+}
+
+Mat Detector::normalize(Mat& frame_mat){
+	Mat resized;
+	Mat gray;
+	Metrics::count(EIMAGES);
+	toGray(frame_mat, PIX_BGR, gray);
 	
-	//Face landmark detection
-	float score, notFace = 0.5;
+	Rect rect;
 	Mat X;
-	Rect rect(r->x, r->y, r->width, r->height);
 	INTRAFACE::HeadPose hp;
-
-	gettimeofday(&begin, NULL);
-	if (faceLandmark->Detect(frame_mat, rect, X, score) == INTRAFACE::IF_OK)
-	{
-		faceLandmark->EstimateHeadPose(X,hp);
-		// only draw valid faces
-		if (score >= notFace) {
-			for (int i = 0 ; i < X.cols ; i++)
-				cv::circle(frame_mat,cv::Point((int)X.at<float>(0,i), (int)X.at<float>(1,i)), 1, cv::Scalar(0,255,0), -1);
-		}
-		else{
-			cout<<"False positive face"<<endl;
-			return resized;
-		}
-	}
-	else
-	{
-		cout<<"Landmark detection failed"<<endl;
+	if (!findFace(gray, rect, config->scan) || !markFace(frame_mat, rect, config->scan.notFace, X, hp))
 		return resized;
-	}
-	gettimeofday(&end, NULL);	
-    elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Landmarks detected in "<<elapsed<<" seconds"<<endl;
-	gettimeofday(&begin, NULL);
+	
+	uint64_t begin = Metrics::now();
 	//imwrite( "./tmp/face.jpg" , frame_mat );
 	//Face alignment
 	int normSize = 100;
 	int patchSize = 30;
 	//calculate bounding box
 	double angle = hp.angles[0];
-	Mat rotated = rotateImage(frame_mat, -angle);
 	
 	//rotate landmarks
 	float minx = 10000;
@@ -424,13 +835,12 @@ Mat Detector::detectNorm(string imgname){
 	float miny = 10000;
 	float maxy = 0;
 	
-	for (unsigned int i = 0; i < X.cols; i++){
+	for (int i = 0; i < X.cols; i++){
 		//cout<<X.at<float>(0,i)<<" "<<X.at<float>(1,i)<<endl;
 		//rotatePoint(frame_mat, angle, X.at<float>(0,i), X.at<float>(1,i), X.at<float>(0,i), X.at<float>(1,i));
 		//cout<<X.at<float>(0,i)<<" "<<X.at<float>(1,i)<<endl;
 		//cout<<"bbox: "<<minx<<" "<<miny<<" "<<maxx<<" "<<maxy<<endl;
 		//cout<<landmarks[i]<<" "<<landmarks[i+1]<<endl;
-		circle(rotated, Point(X.at<float>(0,i), X.at<float>(1,i)), 2, Scalar(255,0,0));
 		if (X.at<float>(0,i)  < minx ){
 			minx = X.at<float>(0,i) ;
 		}
@@ -461,174 +871,105 @@ Mat Detector::detectNorm(string imgname){
 	//cout<<"bbox: "<<minx<<" "<<miny<<" "<<maxx<<" "<<maxy<<endl;
 	//extend patch region
 	int region = (((double)patchSize)/2 + 1)/(normSize - patchSize - 2)*(maxx - minx);
-	cout<<"region: "<<region<<endl;
 	minx = minx - region - 1;
 	maxx = maxx + region + 1;
 	miny = miny - region - 1;
 	maxy = maxy + region + 1;
 	//cout<<"bounds: "<<minx<<" "<<miny<<" "<<maxx<<" "<<maxy<<endl;
 	if (minx < 0 || miny < 0 || maxx > frame_mat.cols || maxy > frame_mat.rows){
-		cout<<"Bounding box out of bound: "<<minx<<" "<<miny<<" "<<maxx<<" "<<maxy<<endl;
+		Metrics::count(EOUT_OF_BOUND);
 		return resized;
 	}
-	//resize
-	Mat roi(rotated, Rect(minx,miny,maxx-minx,maxy-miny));
-	resize(roi, resized, Size(normSize, normSize));
-	for (unsigned int i = 0; i < X.cols; i++){
-		X.at<float>(0,i) = (X.at<float>(0,i) - minx)/(maxx-minx)*normSize;
-		X.at<float>(1,i) = (X.at<float>(1,i)- miny)/(maxy-miny)*normSize;
-		circle(resized, Point(X.at<float>(0,i), X.at<float>(1,i)), 2, Scalar(255,0,0));
-	}
-	//return resized;
-	
-	//storage = cvCreateMemStorage(0);
-	cvReleaseMemStorage(&storage);
-	cvReleaseImage(&frame_bw);
-	cvReleaseImage(&frame);
-	
-	gettimeofday(&end, NULL);	
-    elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Face aligned in "<<elapsed<<" seconds"<<endl;	
+	//rotate, crop and resize in one warp
+	warpFace(frame_mat, -angle, Rect(minx,miny,maxx-minx,maxy-miny), Size(normSize, normSize), resized);
+	Metrics::observe(MALIGN, begin);
 	return resized;
 }
 
+Mat Detector::detectNorm(const string filename, const float faceWidth, const float faceHeight, const float patchSize, Mat& landmarks, int numLandmarks, bool showLandmark){
+	Mat frame;
+	if (!loadImage(filename, frame))
+		return Mat();
+	return normalize(frame, PIX_BGR, true, faceWidth, faceHeight, patchSize, landmarks, numLandmarks, showLandmark);
+}
 
+Mat Detector::detectNorm(const uchar* data, size_t size, const float faceWidth, const float faceHeight, const float patchSize, Mat& landmarks, int numLandmarks, bool showLandmark){
+	Mat frame;
+	if (!decodeImage(data, size, frame))
+		return Mat();
+	return normalize(frame, PIX_BGR, true, faceWidth, faceHeight, patchSize, landmarks, numLandmarks, showLandmark);
+}
 
-Mat Detector::detectNorm(const string filename, const float faceWidth, const float faceHeight, const float patchSize, Mat& landmarks, int numLandmarks, bool showLandmark){
-	Mat resized;
-	struct timeval begin, end;
-	gettimeofday(&begin, NULL);
-	
-	IplImage *frame = cvLoadImage(filename.data(), 2|4);
-	if (frame == NULL)
-    {
-      fprintf(stderr, "Cannot open image %s.Returning empty Mat...\n", filename.data());
-      return resized;
-    }
-	
-	else if (frame->width < 50 || frame->height < 50)
-    {
-      fprintf(stderr, "image %s too small.Returning empty Mat...\n", filename.data());
-      cvReleaseImage(&frame);
-	  return resized;
-    }	
-	else if (frame->width > 100000 || frame->height > 100000)
-    {
-      fprintf(stderr, "image %s too large.Returning empty Mat...\n", filename.data());
-      cvReleaseImage(&frame);
-	  return resized;
-    }
-	
-	// convert image to grayscale
-    IplImage *frame_bw = cvCreateImage(cvSize(frame->width, frame->height), IPL_DEPTH_8U, 1);
-    cvConvertImage(frame, frame_bw);
-	Mat frame_mat(frame, 1);
-	// Smallest face size.
-    CvSize minFeatureSize = cvSize(100, 100);
-    int flags =  CV_HAAR_DO_CANNY_PRUNING;
-    // How detailed should the search be.
-    float search_scale_factor = 1.1f;
-    CvMemStorage* storage;
-    CvSeq* rects;
-    int nFaces;
-	
-    storage = cvCreateMemStorage(0);
-    cvClearMemStorage(storage);
+Mat Detector::detectNorm(const ImageView& image, const float faceWidth, const float faceHeight, const float patchSize, Mat& landmarks, int numLandmarks, bool showLandmark){
+	Mat frame = wrapImage(image);
+	if (frame.empty())
+		return Mat();
+	return normalize(frame, image.format, false, faceWidth, faceHeight, patchSize, landmarks, numLandmarks, showLandmark);
+}
 
-    // Detect all the faces in the greyscale image.
-	if (dtype == DSZU){
-		rects = MBLBPDetectMultiScale(frame_bw, faceCascade, storage, 1229, 1, 50, 500);
-	}
-	else if (dtype == DOPENCV){
-		rects = cvHaarDetectObjects(frame_bw, HaarCascade, storage, search_scale_factor, 2, flags, minFeatureSize);
-	}
-	else{
-		cout<<"Unknown detector type: "<<dtype<<endl;
-		return resized;
-	}
-	gettimeofday(&end, NULL);	
-    double elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Face detected in "<<elapsed<<" seconds"<<endl;
-	gettimeofday(&begin, NULL);
-	nFaces = rects->total;
-
-	if (nFaces != 1){
-		//storage = cvCreateMemStorage(0);
-		cvReleaseMemStorage(&storage);
-		cvReleaseImage(&frame_bw);
-		cvReleaseImage(&frame);	
-		return resized;
-	}
-		
-	int iface = 0;
-	CvRect *r = (CvRect*)cvGetSeqElem(rects, iface);
-	
-	//Face landmark detection
-	float score, notFace = 0.5;
-	Rect rect(r->x, r->y, r->width, r->height);
-	INTRAFACE::HeadPose hp;
+Mat Detector::normalize(Mat& frame_mat, int format, bool writable, const float faceWidth, const float faceHeight, const float patchSize, Mat& landmarks, int numLandmarks, bool showLandmark){
+	DetectOptions options(SALIGNED);
+	options.width = faceWidth;
+	options.height = faceHeight;
+	options.patchSize = patchSize;
+	options.numLandmarks = numLandmarks;
+	options.showLandmark = showLandmark;
+	DetectResult result;
+	if (!process(frame_mat, format, writable, options, result))
+		return Mat();
+	landmarks = result.alignedLandmarks;
+	return result.aligned;
+}
 
-	gettimeofday(&begin, NULL);
-	if (faceLandmark->Detect(frame_mat, rect, landmarks, score) == INTRAFACE::IF_OK)
-	{
-		faceLandmark->EstimateHeadPose(landmarks,hp);
-		// only draw valid faces
-		if (score >= notFace) {
-			if (showLandmark){
-				for (int i = 0 ; i < landmarks.cols ; i++)
-					cv::circle(frame_mat,cv::Point((int)landmarks.at<float>(0,i), (int)landmarks.at<float>(1,i)), 2, cv::Scalar(0,255,0), -1);
-			}
-		}
-		else{
-			cout<<"False positive face"<<endl;
-			return resized;
-		}
-	}
-	else
-	{
-		cout<<"Landmark detection failed"<<endl;
-		return resized;
-	}
-	gettimeofday(&end, NULL);	
-    elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Landmarks detected in "<<elapsed<<" seconds"<<endl;
-	gettimeofday(&begin, NULL);
+//an output Mat is written in place only when nothing else refers to its pixels
+static void releaseShared(Mat& output){
+	if (output.refcount != NULL && *output.refcount > 1)
+		output.release();
+}
+
+bool Detector::alignFace(const Mat& frame_mat, double angle, const DetectOptions& options, const Mat& faceLandmarks, Mat& resized, Mat& landmarks){
+	const float faceWidth = options.width;
+	const float faceHeight = options.height;
+	const float patchSize = options.patchSize;
+	const int numLandmarks = options.numLandmarks;
+	const bool showLandmark = options.showLandmark;
+	uint64_t begin = Metrics::now();
+	//the outputs are written in place from face to face, unless the caller still holds them
+	releaseShared(resized);
+	releaseShared(landmarks);
+	//the five point layout is made from all 49, which the workspace keeps
+	Mat& points = numLandmarks == 5 ? workspace.alignPoints : landmarks;
+	faceLandmarks.copyTo(points);
+	
 	//imwrite( "./tmp/face.jpg" , frame_mat );
 	//Face alignment
-	int normSize = 100;
 	//calculate bounding box
-	double angle = hp.angles[0];
-	Mat rotated = rotateImage(frame_mat, -angle);
-	
 	//rotate landmarks
 	float minx = 10000;
 	float maxx = 0;
 	float miny = 10000;
 	float maxy = 0;
 	
-	for (unsigned int i = 0; i < landmarks.cols; i++){
+	for (int i = 0; i < points.cols; i++){
 		//cout<<X.at<float>(0,i)<<" "<<X.at<float>(1,i)<<endl;
-		rotatePoint(frame_mat, angle, (double)landmarks.at<float>(0,i), (double)landmarks.at<float>(1,i), landmarks.at<float>(0,i), landmarks.at<float>(1,i));
+		rotatePoint(frame_mat, angle, (double)points.at<float>(0,i), (double)points.at<float>(1,i), points.at<float>(0,i), points.at<float>(1,i));
 		//cout<<X.at<float>(0,i)<<" "<<X.at<float>(1,i)<<endl;
 		//cout<<"bbox: "<<minx<<" "<<miny<<" "<<maxx<<" "<<maxy<<endl;
 		//cout<<landmarks[i]<<" "<<landmarks[i+1]<<endl;
 		//circle(rotated, Point(landmarks.at<float>(0,i), landmarks.at<float>(1,i)), 2, Scalar(255,0,0));
-		if (landmarks.at<float>(0,i)  < minx ){
-			minx = landmarks.at<float>(0,i) ;
+		if (points.at<float>(0,i)  < minx ){
+			minx = points.at<float>(0,i) ;
 		}
-		if (landmarks.at<float>(0,i) > maxx){
-			maxx = landmarks.at<float>(0,i) ;
+		if (points.at<float>(0,i) > maxx){
+			maxx = points.at<float>(0,i) ;
 		}
 		
-		if (landmarks.at<float>(1,i)  < miny){
-			miny = landmarks.at<float>(1,i) ;
+		if (points.at<float>(1,i)  < miny){
+			miny = points.at<float>(1,i) ;
 		}
 		
-		if (landmarks.at<float>(1,i) > maxy){
-			maxy = landmarks.at<float>(1,i);
+		if (points.at<float>(1,i) > maxy){
+			maxy = points.at<float>(1,i);
 		}
 	}
 
@@ -657,69 +998,192 @@ Mat Detector::detectNorm(const string filename, const float faceWidth, const flo
 	maxy += py + 2;
 	miny -= py + 2;	
 	if (minx < 0 || miny < 0 || maxx > frame_mat.cols || maxy > frame_mat.rows){
-		cout<<"Bounding box out of bound: "<<minx<<" "<<miny<<" "<<maxx<<" "<<maxy<<endl;
-		return resized;
+		Metrics::count(EOUT_OF_BOUND);
+		return false;
 	}
 	
-	//resize
-	Mat roi(rotated, Rect(minx,miny,maxx-minx,maxy-miny));
-	resize(roi, resized, Size(faceWidth, faceHeight));
-	cout<<"Num of landmarks: "<<landmarks.cols<<" type: "<<landmarks.type()<<endl;
-	for (unsigned int i = 0; i < landmarks.cols; i++){
-		landmarks.at<float>(0,i) = (landmarks.at<float>(0,i) - minx)/(maxx-minx)*faceWidth;
-		landmarks.at<float>(1,i) = (landmarks.at<float>(1,i)- miny)/(maxy-miny)*faceHeight;
+	//rotate, crop and resize in one warp
+	warpFace(frame_mat, -angle, Rect(minx,miny,maxx-minx,maxy-miny), Size(faceWidth, faceHeight), resized);
+	for (int i = 0; i < points.cols; i++){
+		points.at<float>(0,i) = (points.at<float>(0,i) - minx)/(maxx-minx)*faceWidth;
+		points.at<float>(1,i) = (points.at<float>(1,i)- miny)/(maxy-miny)*faceHeight;
 	}
 	
 	
 	if (numLandmarks == 5){
-		Mat newLandmarks(2, 5, CV_64F);
+		landmarks.create(2, 5, CV_32F);
 		//left eye
 		for (int i = 0; i < 2; i++)
-			newLandmarks.at<float>(i,0) = (landmarks.at<float>(i,19) + landmarks.at<float>(i,22))/2;
+			landmarks.at<float>(i,0) = (points.at<float>(i,19) + points.at<float>(i,22))/2;
 			
 		//right eye
 		for (int i = 0; i < 2; i++)
-			newLandmarks.at<float>(i,1) = (landmarks.at<float>(i,25) + landmarks.at<float>(i,28))/2;		
+			landmarks.at<float>(i,1) = (points.at<float>(i,25) + points.at<float>(i,28))/2;		
 		
 		//nose
 		for (int i = 0; i < 2; i++)
-			newLandmarks.at<float>(i,2) = landmarks.at<float>(i,13) ;
+			landmarks.at<float>(i,2) = points.at<float>(i,13) ;
 			
 		//mouth left
 		for (int i = 0; i < 2; i++)
-			newLandmarks.at<float>(i,3) = landmarks.at<float>(i,31) ;		
+			landmarks.at<float>(i,3) = points.at<float>(i,31) ;		
 		
 		//mouth right
 		for (int i = 0; i < 2; i++)
-			newLandmarks.at<float>(i,4) = landmarks.at<float>(i,37) ;
-			
-		landmarks = newLandmarks;
+			landmarks.at<float>(i,4) = points.at<float>(i,37) ;
 	}
-	if (showLandmark){
-		for (unsigned int i = 0; i < landmarks.cols; i++){
-			circle(resized, Point(landmarks.at<float>(0,i), landmarks.at<float>(1,i)), 3, Scalar(255,0,0));
-		}
+	//the aligned face is small, drawing into it is cheap
+	if (showLandmark)
+		DrawLandmarks(resized, landmarks, Scalar(255,0,0), 3, 1);
+	Metrics::observe(MALIGN, begin);
+	return true;
+}
+
+CvSeq* Detector::detectFaces(IplImage* frame_bw, CvMemStorage* storage, const ScanParams& scan, uint64_t deadline, bool* truncated){
+	// Smallest face size.
+    CvSize minFeatureSize = cvSize(scan.haarMinFace, scan.haarMinFace);
+    int flags =  CV_HAAR_DO_CANNY_PRUNING;
+    // How detailed should the search be.
+    float search_scale_factor = 1.1f;
+
+	if (dtype == DOPENCV){
+		//OpenCV does pyramid, scan and grouping in one call, which cannot be stopped at a deadline
+		uint64_t begin = Metrics::now();
+		CvSeq* faces = cvHaarDetectObjects(frame_bw, HaarCascade, storage, search_scale_factor, 2, flags, minFeatureSize);
+		Metrics::observe(MSCAN, begin);
+		return faces;
+	}
+	else if (dtype != DSZU && dtype != DSZU_OPENCV){
+		return NULL;
 	}
-	//clear stuff
-	//storage = cvCreateMemStorage(0);
-	cvReleaseMemStorage(&storage);
-	cvReleaseImage(&frame_bw);
-	cvReleaseImage(&frame);
 	
-	gettimeofday(&end, NULL);	
-    elapsed = (end.tv_sec - begin.tv_sec) + 
-              ((end.tv_usec - begin.tv_usec)/1000000.0);
-	cout<<"Face aligned in "<<elapsed<<" seconds"<<endl;	
-	return resized;
+	int stopped = 0;
+	int scale1024x = cvRound(scan.scaleFactor*1024);
+	CvSeq* candidates = MBLBPDetectMultiScale(frame_bw, faceCascade, storage, scale1024x, scan.minNeighbors, scan.minFace, scan.maxFace, workspace.lbp, deadline, &stopped);
+	if (truncated != NULL)
+		*truncated = stopped != 0;
+	//image smaller than the scan window
+	if (candidates == NULL)
+		return cvCreateSeq(0, sizeof(CvSeq), sizeof(CvAvgComp), storage);
+	if (dtype == DSZU_OPENCV)
+		return verifyFaces(frame_bw, candidates, storage);
+	return candidates;
 }
 
-Mat Detector::rotateImage(const Mat& source, double angle)
+CvSeq* Detector::verifyFaces(IplImage* frame_bw, CvSeq* candidates, CvMemStorage* storage){
+	uint64_t begin = Metrics::now();
+	CvSeq* faces = cvCreateSeq(0, sizeof(CvSeq), sizeof(CvAvgComp), storage);
+	if (workspace.verifyStorage == NULL)
+		workspace.verifyStorage = cvCreateMemStorage(0);
+	CvMemStorage* roiStorage = workspace.verifyStorage;
+	
+	for (int i = 0; i < candidates->total; i++){
+		CvAvgComp c = *(CvAvgComp*)cvGetSeqElem(candidates, i);
+		//search a quarter of the face size around the candidate, at scales close to it
+		int margin = c.rect.width/4;
+		int x0 = MAX(c.rect.x - margin, 0);
+		int y0 = MAX(c.rect.y - margin, 0);
+		int x1 = MIN(c.rect.x + c.rect.width + margin, frame_bw->width);
+		int y1 = MIN(c.rect.y + c.rect.height + margin, frame_bw->height);
+		int minSize = MAX(c.rect.width*7/10, HaarCascade->orig_window_size.width);
+		if (x1 - x0 < minSize || y1 - y0 < minSize)
+			continue;
+		
+		cvClearMemStorage(roiStorage);
+		cvSetImageROI(frame_bw, cvRect(x0, y0, x1 - x0, y1 - y0));
+		CvSeq* hits = cvHaarDetectObjects(frame_bw, HaarCascade, roiStorage, 1.1, 2, 0, cvSize(minSize, minSize), cvSize(x1 - x0, y1 - y0));
+		cvResetImageROI(frame_bw);
+		if (hits != NULL && hits->total > 0)
+			cvSeqPush(faces, &c);
+	}
+	//the MB-LBP candidates the Haar cascade did not confirm
+	Metrics::count(EVERIFY_REJECTED, candidates->total - faces->total);
+	Metrics::observe(MVERIFY, begin);
+	return faces;
+}
+
+//warpAffine(source, dst, M, dst.size()) with INTER_LINEAR and a black border, in the
+//same fixed point steps (source positions in 1/32 pixel, weights summing to 1 << 15),
+//so the result is identical. warpAffine allocates its blocks on every call, this only
+//grows offsets
+static void warpLinear(const Mat& source, Mat& dst, const double* M, vector<int>& offsets){
+	const int bits = 5, tab = 1 << bits, abBits = 10, abScale = 1 << abBits;
+	const int roundDelta = abScale/tab/2;
+	//warpAffine inverts the matrix to map dst pixels to source positions
+	double inverse[6];
+	double D = M[0]*M[4] - M[1]*M[3];
+	D = D != 0 ? 1./D : 0;
+	inverse[0] = M[4]*D;
+	inverse[1] = M[1]*-D;
+	inverse[3] = M[3]*-D;
+	inverse[4] = M[0]*D;
+	inverse[2] = -inverse[0]*M[2] - inverse[1]*M[5];
+	inverse[5] = -inverse[3]*M[2] - inverse[4]*M[5];
+	
+	int cn = source.channels();
+	offsets.resize(dst.cols*2);
+	int* adelta = &offsets[0];
+	int* bdelta = adelta + dst.cols;
+	for (int x = 0; x < dst.cols; x++){
+		adelta[x] = saturate_cast<int>(inverse[0]*x*abScale);
+		bdelta[x] = saturate_cast<int>(inverse[3]*x*abScale);
+	}
+	for (int y = 0; y < dst.rows; y++){
+		int X0 = saturate_cast<int>((inverse[1]*y + inverse[2])*abScale) + roundDelta;
+		int Y0 = saturate_cast<int>((inverse[4]*y + inverse[5])*abScale) + roundDelta;
+		uchar* out = dst.ptr<uchar>(y);
+		for (int x = 0; x < dst.cols; x++, out += cn){
+			int X = (X0 + adelta[x]) >> (abBits - bits);
+			int Y = (Y0 + bdelta[x]) >> (abBits - bits);
+			int sx = X >> bits, sy = Y >> bits;
+			int fx = X & (tab - 1), fy = Y & (tab - 1);
+			int w[4] = {(tab - fy)*(tab - fx)*tab, (tab - fy)*fx*tab, fy*(tab - fx)*tab, fy*fx*tab};
+			if ((unsigned)sx < (unsigned)(source.cols - 1) && (unsigned)sy < (unsigned)(source.rows - 1)){
+				const uchar* p0 = source.data + sy*source.step + sx*cn;
+				const uchar* p1 = p0 + source.step;
+				for (int c = 0; c < cn; c++)
+					out[c] = (uchar)((p0[c]*w[0] + p0[c + cn]*w[1] + p1[c]*w[2] + p1[c + cn]*w[3] + (1 << 14)) >> 15);
+				continue;
+			}
+			//at the border, pixels outside the source are black
+			const uchar* p[4] = {NULL, NULL, NULL, NULL};
+			for (int k = 0; k < 4; k++){
+				int px = sx + (k & 1), py = sy + (k >> 1);
+				if (px >= 0 && py >= 0 && px < source.cols && py < source.rows)
+					p[k] = source.ptr<uchar>(py) + px*cn;
+			}
+			for (int c = 0; c < cn; c++){
+				int v = 1 << 14;
+				for (int k = 0; k < 4; k++){
+					if (p[k] != NULL)
+						v += p[k][c]*w[k];
+				}
+				out[c] = saturate_cast<uchar>(v >> 15);
+			}
+		}
+	}
+}
+
+void Detector::warpFace(const Mat& source, double angle, const Rect& roi, const Size& size, Mat& dst)
 {
-    Point2f src_center(source.cols/2.0F, source.rows/2.0F);
-    Mat rot_mat = getRotationMatrix2D(src_center, angle, 1.0);
-    Mat dst;
-    warpAffine(source, dst, rot_mat, source.size());
-    return dst;
+    //rotation about the image center, as a full frame warpAffine would do
+    //(same matrix as getRotationMatrix2D, built on the stack)
+    double cx = source.cols/2.0F, cy = source.rows/2.0F;
+    double alpha = cos(angle*CV_PI/180), beta = sin(angle*CV_PI/180);
+    //then the crop and the bilinear resize, which samples the roi at
+    //(u + 0.5)*sx - 0.5 for output pixel u
+    double sx = (double)roi.width/size.width;
+    double sy = (double)roi.height/size.height;
+    double warp[] = {alpha/sx, beta/sx, ((1 - alpha)*cx - beta*cy + 0.5 - roi.x)/sx - 0.5,
+                     -beta/sy, alpha/sy, (beta*cx + (1 - alpha)*cy + 0.5 - roi.y)/sy - 0.5};
+    dst.create(size, source.type());
+    if (source.depth() == CV_8U){
+        warpLinear(source, dst, warp, workspace.warpOffsets);
+    }
+    else{
+        Mat warp_mat(2, 3, CV_64F, warp);
+        warpAffine(source, dst, warp_mat, size);
+    }
 }
 
 void Detector::rotatePoint(const Mat& source, double angle, const double& x1, const double& y1, float& x, float& y){
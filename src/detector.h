@@ -8,40 +8,241 @@
 #include <FaceAlignment.h>
 #include <string>
 #include "mblbp-detect.h"
+#include "config.h"
+#include "thread-pool.h"
 
 using namespace std;
 using namespace cv;
 using namespace INTRAFACE;
 
-enum DETECTOR_TYPE {DSZU, DOPENCV, UNKNOWN};
+class ResultCache;
+class FaceTensor;
+
+enum DETECTOR_TYPE {DSZU, DOPENCV, DSZU_OPENCV, UNKNOWN};
+
+enum PIXEL_FORMAT {PIX_GRAY, PIX_BGR, PIX_RGB, PIX_BGRA, PIX_RGBA};
+
+//Raw 8-bit pixels owned by the caller, read in place without copying
+struct ImageView{
+	const uchar* data;
+	int width;
+	int height;
+	size_t stride; //bytes per row
+	PIXEL_FORMAT format;
+};
+
+//Pipeline stages, SBOX alone only runs the face detector, the other
+//stages need landmarks and drop faces IntraFace rejects
+enum DETECT_STAGE {SBOX = 1, SLANDMARKS = 2, SPOSE = 4, SALIGNED = 8, SANNOTATED = 16};
+
+//What detect should produce, stages is a mask of DETECT_STAGE
+struct DetectOptions{
+	int stages;
+	int numLandmarks; //5 or 49, for the aligned landmarks
+	float width; //aligned face size
+	float height;
+	float patchSize;
+	bool showLandmark; //draw the aligned landmarks into the aligned face
+	//seconds the face search may take, counted from the start of detect (decoding included),
+	//0 for no limit. MB-LBP scans mid to large face sizes first and stops at the deadline
+	double budget;
+	ScanParams scan; //negative values keep the detector.cfg settings
+	
+	DetectOptions(int stages = SBOX|SLANDMARKS|SPOSE);
+};
+
+//Only the requested outputs are filled in
+struct DetectResult{
+	bool found;
+	Rect face;
+	Mat landmarks; //in image coordinates
+	float score;
+	int pose[3]; //roll, yaw, pitch
+	Mat aligned;
+	Mat alignedLandmarks; //in aligned face coordinates
+	Mat annotated; //the image with landmarks drawn (renderer.h), the decoded frame itself unless it is a view
+	double seconds; //decode and detection time of a batch image
+	bool truncated; //the budget ran out, face is the best found on the sizes scanned
+	int neighbors; //cascade windows grouped into the face, its detection confidence
+	
+	DetectResult();
+};
+
+//One image of a batch, a file name or encoded bytes when data is not NULL
+struct BatchInput{
+	string filename;
+	const uchar* data;
+	size_t size;
+	
+	BatchInput(const string& filename);
+	BatchInput(const uchar* data, size_t size);
+};
+
+//Buffers one Detector reuses from image to image, grown to the largest image
+//seen, so that once warmed up the detector itself only allocates its outputs
+//(decoding and IntraFace still allocate internally)
+struct DetectorWorkspace{
+	vector<uchar> buffer; //encoded file
+	Mat frame; //decoded image
+	Mat gray;
+	vector<Rect> faces;
+	vector<int> neighbors; //of the faces last found by findFaces, in the same order
+	CvMemStorage* storage; //face sequences
+	CvMemStorage* verifyStorage; //Haar verification of MB-LBP candidates
+	MBLBPWorkspace* lbp; //pyramid, integral image and grouping
+	Mat alignPoints; //the 49 landmarks as alignFace moves them
+	vector<int> warpOffsets; //per column source offsets of warpFace
+	
+	DetectorWorkspace();
+};
+
+//One face found by detectAll
+struct FaceResult{
+	Rect face;
+	Mat landmarks;
+	float score; //IntraFace confidence
+	int pose[3]; //roll, yaw, pitch
+};
 
 class Detector{
+	//runs the private stages on its own threads
+	friend class DetectPipeline;
+	//detects on keyframes and tracks with faceLandmark in between
+	friend class FaceTracker;
+	//counts the allocations of findFace and alignFace (alloc-test.cpp)
+	friend class AllocationTest;
 	public:
-		Detector();
+		//models are shared with every other Detector using the same files, see ModelRegistry
+		Detector(const char* cfgname = "detector.cfg");
+		~Detector();
+		
+		//runs only the stages in options, return false if no face detected
+		bool detect(const string imgname, const DetectOptions& options, DetectResult& result);
+		bool detect(const uchar* data, size_t size, const DetectOptions& options, DetectResult& result);
+		bool detect(const ImageView& image, const DetectOptions& options, DetectResult& result);
+		
+		//detects every input on the thread pool, results are in input order.
+		//threads limits how many of the THREADS pool threads are used, 0 for all.
+		//each thread has its own Detector (models shared), so the first call costs a 
+		//Detector construction per thread. returns the number of inputs with a face.
+		//trace spans carry firstImage + the input's index, so that a run split into
+		//batches numbers its images once
+		int detectBatch(const vector<BatchInput>& inputs, vector<DetectResult>& results, const DetectOptions& options = DetectOptions(), int threads = 0, int firstImage = 0);
+		//detectBatch with the aligned faces packed into tensor (face-tensor.h) in input order instead
+		//of left in results, for recognition models. SALIGNED is added to the stages, the tensor
+		//is reset to the faces of this batch. returns the number of faces in the tensor
+		int detectAligned(const vector<BatchInput>& inputs, vector<DetectResult>& results, FaceTensor& tensor, const DetectOptions& options = DetectOptions(), int threads = 0, int firstImage = 0);
+		//thread pool size for detectAll and detectBatch instead of THREADS, 0 for one per CPU.
+		//false once the pool is running
+		bool setThreads(int threads);
+		//one batch image, reusing this detector's decode buffers
+		bool detectInput(const BatchInput& input, const DetectOptions& options, DetectResult& result);
+		//answers repeated encoded images (files, buffers, batch inputs) from cache, NULL to stop.
+		//the cache is not owned, it may be shared with other detectors and is used by the batch threads
+		void setCache(ResultCache* cache);
+		//as read from detector.cfg
+		const DetectorConfig& configuration() const;
 		
 		//numLandmarks can be 5 or 49 
 		Mat detect(const string imgname, int numLandmarks = 49);
+		Mat detect(const uchar* data, size_t size, int numLandmarks = 49);
 
 		//numLandmarks can be 5 or 49, landmark positions and poses (in the order of roll, yaw, pitch) are returned
 		Mat detect(const string imgname, Mat& landmarks, int* pose, int numLandmarks = 49);
+		Mat detect(const uchar* data, size_t size, Mat& landmarks, int* pose, int numLandmarks = 49);
+		
+		//same on raw pixels, nothing is drawn or copied, return false if no face detected
+		bool detect(const ImageView& image, Mat& landmarks, int* pose, int numLandmarks = 49);
+		
+		//for large JPEGs: the face is searched on a gray image decoded at 1/2, 1/4 or 1/8 size, 
+		//then only the face region is decoded at full resolution for landmarking.
+		//minFace is the smallest face size (in full resolution pixels) that must still be found.
+		//landmarks are in full resolution coordinates, other formats are decoded in full
+		bool detectReduced(const string imgname, Mat& landmarks, int* pose, int minFace = 200, int numLandmarks = 49);
+		bool detectReduced(const uchar* data, size_t size, Mat& landmarks, int* pose, int minFace = 200, int numLandmarks = 49);
+		
+		//every face in the image, largest first, at most maxFaces of them (0 for all).
+		//faces are landmarked in parallel, THREADS in detector.cfg sets the number of threads.
+		//returns the number of faces, false positives rejected by IntraFace are left out
+		int detectAll(const string imgname, vector<FaceResult>& faces, int maxFaces = 0, int numLandmarks = 49);
+		int detectAll(const uchar* data, size_t size, vector<FaceResult>& faces, int maxFaces = 0, int numLandmarks = 49);
+		int detectAll(const ImageView& image, vector<FaceResult>& faces, int maxFaces = 0, int numLandmarks = 49);
 		
 		//marks an already detected face, return false if no face detected
 		bool detect(const Mat& face, Mat& landmarks, int* pose, int numLandmarks = 49);
 		
-		//align and normalize face to 100x100
+		//align and normalize face to 100x100, nothing is drawn
 		Mat detectNorm(const string imgname); 
+		Mat detectNorm(const uchar* data, size_t size); 
 	
-		//align and normalize face to width x height, output landmarks, no. of landmarks can be 5, 49
-		Mat detectNorm(const string imgname, const float width, const float height, const float patchSize, Mat& landmarks, int numLandmarks = 49, bool showLandmark = true);
+		//align and normalize face to width x height, output landmarks, no. of landmarks can be 5, 49.
+		//showLandmark draws the output landmarks into the returned face, never into the image
+		Mat detectNorm(const string imgname, const float width, const float height, const float patchSize, Mat& landmarks, int numLandmarks = 49, bool showLandmark = false);
+		Mat detectNorm(const uchar* data, size_t size, const float width, const float height, const float patchSize, Mat& landmarks, int numLandmarks = 49, bool showLandmark = false);
+		Mat detectNorm(const ImageView& image, const float width, const float height, const float patchSize, Mat& landmarks, int numLandmarks = 49, bool showLandmark = false);
 		
 		Mat detect();
 	private:
-		MBLBPCascade * faceCascade;
+		string cfgname;
+		const DetectorConfig* config;
+		const MBLBPCascade * faceCascade;
+		const CvHaarClassifierCascade* sharedHaarCascade;
+		//private copy, OpenCV writes scan state into the cascade
 		CvHaarClassifierCascade* HaarCascade;
+		const FaceAlignment *sharedLandmark;
+		//copy of the shared one, matrices are shared but alignment state is not
 		FaceAlignment *faceLandmark;
-		XXDescriptor *xxd;
 		DETECTOR_TYPE dtype;
-		Mat rotateImage(const Mat& source, double angle);
+		//started by the first detectAll, worker 0 is the calling thread and uses faceLandmark
+		ThreadPool* pool;
+		int poolSize;
+		vector<FaceAlignment*> workerLandmarks;
+		//batch threads, worker 0 is this detector
+		vector<Detector*> batchWorkers;
+		//one per detector, so one per thread
+		DetectorWorkspace workspace;
+		ResultCache* cache;
+		//ResultCache::configHash of config
+		uint64_t configHash;
+		//when the running detect call began, options.budget counts from there
+		uint64_t started;
+		//decodes into the workspace frame
+		bool detectBuffer(const uchar* data, size_t size, const DetectOptions& options, DetectResult& result);
+		//decode and process through the cache
+		bool detectEncoded(const uchar* data, size_t size, Mat& frame, const DetectOptions& options, DetectResult& result);
+		void startPool();
+		Detector(const Detector&);
+		Detector& operator=(const Detector&);
+		//data and encoded images are copied (decoded), views are not
+		bool loadImage(const string& imgname, Mat& frame);
+		bool readFile(const string& filename, vector<uchar>& buffer);
+		bool decodeImage(const uchar* data, size_t size, Mat& frame);
+		bool checkImage(Mat& frame, const char* name);
+		Mat wrapImage(const ImageView& image);
+		void toGray(const Mat& frame, int format, Mat& gray);
+		//the single face in the image, false if there is none or several.
+		//deadline is a Metrics::now() time, truncated is set if the scan stopped there
+		bool findFace(const Mat& gray, Rect& face, const ScanParams& scan, uint64_t deadline = 0, bool* truncated = NULL, int* neighbors = NULL);
+		void findFaces(const Mat& gray, vector<Rect>& faces, const ScanParams& scan, uint64_t deadline = 0, bool* truncated = NULL);
+		//rects as findFaces left them, gray is what they were found on
+		int markFaces(const Mat& frame, const Mat& gray, vector<Rect>& rects, int maxFaces, vector<FaceResult>& faces);
+		//GATE_RESULT of the quality gate in front of IntraFace (quality.h), counted in Metrics
+		int gateFace(const Mat& gray, const Rect& face, int neighbors);
+		//false if IntraFace fails or scores the face below notFace
+		bool markFace(const Mat& frame, const Rect& face, float notFace, Mat& landmarks, INTRAFACE::HeadPose& hp, float* score = NULL, bool estimatePose = true);
+		//the shared pipeline behind every single face entry point
+		bool process(Mat& frame, int format, bool writable, const DetectOptions& options, DetectResult& result);
+		//the stages after face detection
+		bool finishFace(Mat& frame, const Mat& gray, int format, bool writable, const DetectOptions& options, DetectResult& result);
+		bool alignFace(const Mat& frame, double angle, const DetectOptions& options, const Mat& faceLandmarks, Mat& aligned, Mat& landmarks);
+		Mat normalize(Mat& frame);
+		Mat normalize(Mat& frame, int format, bool writable, const float width, const float height, const float patchSize, Mat& landmarks, int numLandmarks, bool showLandmark);
+		CvSeq* detectFaces(IplImage* frame_bw, CvMemStorage* storage, const ScanParams& scan, uint64_t deadline = 0, bool* truncated = NULL);
+		//keep only the candidates confirmed by the Haar cascade around them
+		CvSeq* verifyFaces(IplImage* frame_bw, CvSeq* candidates, CvMemStorage* storage);
+		//rotates source by angle about its center, crops roi out of the rotated image and
+		//scales it to size, all in a single warp. dst is reused if it has that size
+		void warpFace(const Mat& source, double angle, const Rect& roi, const Size& size, Mat& dst);
 		void rotatePoint(const Mat& source, double angle, const double& x1, const double& y1, float& x, float& y);
 };
 
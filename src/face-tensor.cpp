@@ -0,0 +1,138 @@
+#include "face-tensor.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+TensorOptions::TensorOptions(){
+	channels = 3;
+	type = TENSOR_U8;
+	mean = 127.5;
+	scale = 1/128.0;
+	planar = false;
+}
+
+FaceTensor::FaceTensor(const TensorOptions& options){
+	this->options = options;
+	count = 0;
+	height = 0;
+	width = 0;
+	numLandmarks = 0;
+	data = NULL;
+	landmarks = NULL;
+	dataCapacity = 0;
+	landmarkCapacity = 0;
+}
+
+FaceTensor::~FaceTensor(){
+	free(data);
+	free(landmarks);
+}
+
+//grows an aligned buffer, the old contents are dropped
+static bool reserve(void** buffer, size_t& capacity, size_t bytes){
+	if (bytes <= capacity)
+		return true;
+	free(*buffer);
+	*buffer = NULL;
+	capacity = 0;
+	if (posix_memalign(buffer, TENSOR_ALIGNMENT, bytes) != 0){
+		*buffer = NULL;
+		return false;
+	}
+	capacity = bytes;
+	return true;
+}
+
+void FaceTensor::reset(int capacity, int width, int height, int numLandmarks){
+	count = 0;
+	inputs.clear();
+	this->width = width;
+	this->height = height;
+	this->numLandmarks = numLandmarks;
+	if (!reserve((void**)&data, dataCapacity, MAX(capacity, 1)*faceBytes()) ||
+		!reserve((void**)&landmarks, landmarkCapacity, MAX(capacity, 1)*numLandmarks*2*sizeof(float))){
+		fprintf(stderr, "Cannot allocate a tensor of %d faces\n", capacity);
+	}
+}
+
+size_t FaceTensor::faceBytes() const{
+	return (size_t)height*width*options.channels*(options.type == TENSOR_F32 ? sizeof(float) : 1);
+}
+
+Mat FaceTensor::face(int i){
+	if (i < 0 || i >= count || options.planar)
+		return Mat();
+	int depth = options.type == TENSOR_F32 ? CV_32F : CV_8U;
+	return Mat(height, width, CV_MAKETYPE(depth, options.channels), data + i*faceBytes());
+}
+
+static int colorConversion(int from, int to){
+	if (to == 1)
+		return from == 4 ? CV_BGRA2GRAY : CV_BGR2GRAY;
+	return from == 1 ? CV_GRAY2BGR : CV_BGRA2BGR;
+}
+
+bool FaceTensor::append(const Mat& aligned, const Mat& alignedLandmarks, int input){
+	if (aligned.rows != height || aligned.cols != width || aligned.depth() != CV_8U)
+		return false;
+	if ((count + 1)*faceBytes() > dataCapacity || (size_t)(count + 1)*numLandmarks*2*sizeof(float) > landmarkCapacity)
+		return false;
+
+	//written into the tensor in place, the OpenCV calls get headers that
+	//already have the size and type they would create
+	int depth = options.type == TENSOR_F32 ? CV_32F : CV_8U;
+	uchar* slot = data + count*faceBytes();
+	double alpha = options.scale, beta = -options.mean*options.scale;
+	int conversion = colorConversion(aligned.channels(), options.channels);
+	if (!options.planar){
+		Mat dst(height, width, CV_MAKETYPE(depth, options.channels), slot);
+		if (aligned.channels() == options.channels){
+			if (depth == CV_8U)
+				aligned.copyTo(dst);
+			else
+				aligned.convertTo(dst, CV_32F, alpha, beta);
+		}
+		else if (depth == CV_8U){
+			cvtColor(aligned, dst, conversion);
+		}
+		else{
+			Mat converted;
+			cvtColor(aligned, converted, conversion);
+			converted.convertTo(dst, CV_32F, alpha, beta);
+		}
+	}
+	else{
+		Mat source = aligned;
+		if (aligned.channels() != options.channels)
+			cvtColor(aligned, source, conversion);
+		//one plane per channel, scaled on the way for float tensors
+		int channels = options.channels, plane = height*width;
+		for (int y = 0; y < height; y++){
+			const uchar* row = source.ptr<uchar>(y);
+			for (int c = 0; c < channels; c++){
+				if (depth == CV_8U){
+					uchar* out = slot + c*plane + y*width;
+					for (int x = 0; x < width; x++)
+						out[x] = row[x*channels + c];
+				}
+				else{
+					float* out = (float*)slot + c*plane + y*width;
+					for (int x = 0; x < width; x++)
+						out[x] = (row[x*channels + c] - options.mean)*options.scale;
+				}
+			}
+		}
+	}
+
+	//x and y of each landmark side by side
+	float* points = landmarks + count*numLandmarks*2;
+	memset(points, 0, numLandmarks*2*sizeof(float));
+	for (int i = 0; i < MIN(numLandmarks, alignedLandmarks.cols); i++){
+		points[2*i] = alignedLandmarks.at<float>(0, i);
+		points[2*i + 1] = alignedLandmarks.at<float>(1, i);
+	}
+	inputs.push_back(input);
+	count++;
+	return true;
+}
@@ -0,0 +1,65 @@
+#ifndef __FACE_TENSOR_H__
+#define __FACE_TENSOR_H__
+
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+using namespace std;
+using namespace cv;
+
+enum TENSOR_TYPE {TENSOR_U8, TENSOR_F32};
+
+//start of the face and landmark buffers
+#define TENSOR_ALIGNMENT 64
+
+//How a FaceTensor lays out the aligned faces
+struct TensorOptions{
+	int channels; //1 for gray, 3 for BGR
+	TENSOR_TYPE type;
+	//float faces hold (pixel - mean)*scale
+	float mean;
+	float scale;
+	bool planar; //N x C x H x W instead of N x H x W x C
+
+	TensorOptions();
+};
+
+//The aligned faces of a batch in one contiguous buffer, as recognition models
+//take them, with their aligned landmarks beside them. Faces are stored
+//converted to the tensor layout straight from the aligned crop, so they never
+//go through an encoded image. The buffers grow to the largest batch and are
+//reused by the next one.
+class FaceTensor{
+	public:
+		TensorOptions options;
+		int count;
+		int height;
+		int width;
+		int numLandmarks;
+		//count faces of faceBytes() each, TENSOR_ALIGNMENT aligned
+		uchar* data;
+		//count x numLandmarks x 2, x and y in aligned face coordinates
+		float* landmarks;
+		//batch input of every face
+		vector<int> inputs;
+
+		FaceTensor(const TensorOptions& options = TensorOptions());
+		~FaceTensor();
+
+		//empties the tensor for up to capacity faces of width x height
+		void reset(int capacity, int width, int height, int numLandmarks);
+		//appends an aligned face (gray, BGR or BGRA) and its 2 x numLandmarks
+		//landmarks, false if it does not have the tensor size
+		bool append(const Mat& aligned, const Mat& alignedLandmarks, int input);
+		size_t faceBytes() const;
+		//face i as an image, interleaved tensors only
+		Mat face(int i);
+	private:
+		size_t dataCapacity;
+		size_t landmarkCapacity;
+
+		FaceTensor(const FaceTensor&);
+		FaceTensor& operator=(const FaceTensor&);
+};
+
+#endif
@@ -0,0 +1,84 @@
+#include "face-tracker.h"
+#include "metrics.h"
+
+TrackResult::TrackResult(){
+	found = false;
+	detected = false;
+	score = 0;
+	pose[0] = pose[1] = pose[2] = 0;
+}
+
+FaceTracker::FaceTracker(const char* cfgname, int keyframeInterval, float minScore) : detector(cfgname){
+	this->keyframeInterval = keyframeInterval;
+	this->minScore = minScore;
+	tracking = false;
+	sinceKeyframe = 0;
+}
+
+void FaceTracker::reset(){
+	tracking = false;
+	sinceKeyframe = 0;
+	previous.release();
+}
+
+bool FaceTracker::track(const Mat& frame, TrackResult& result){
+	return track(frame, frame.channels() == 1 ? PIX_GRAY : PIX_BGR, result);
+}
+
+bool FaceTracker::track(const ImageView& frame, TrackResult& result){
+	Mat pixels = detector.wrapImage(frame);
+	if (pixels.empty()){
+		result = TrackResult();
+		return false;
+	}
+	return track(pixels, frame.format, result);
+}
+
+bool FaceTracker::track(const Mat& frame, int format, TrackResult& result){
+	result = TrackResult();
+	Mat gray;
+	detector.toGray(frame, format, gray);
+	//IntraFace takes BGR or gray, so other layouts are tracked on gray
+	const Mat& source = (frame.channels() == 1 || format == PIX_BGR) ? frame : gray;
+	
+	if (!tracking || (keyframeInterval > 0 && sinceKeyframe >= keyframeInterval))
+		return redetect(source, gray, result);
+	
+	if (detector.faceLandmark->Track(source, previous, result.landmarks, result.score) != INTRAFACE::IF_OK
+		|| result.score < minScore){
+		Metrics::count(ETRACK_LOST);
+		return redetect(source, gray, result);
+	}
+	sinceKeyframe++;
+	previous = result.landmarks.clone();
+	
+	INTRAFACE::HeadPose hp;
+	detector.faceLandmark->EstimateHeadPose(result.landmarks, hp);
+	for (int i = 0; i < 3; i++){
+		result.pose[i] = hp.angles[i];
+	}
+	double minx, maxx, miny, maxy;
+	minMaxLoc(result.landmarks.row(0), &minx, &maxx);
+	minMaxLoc(result.landmarks.row(1), &miny, &maxy);
+	result.face = Rect((int)minx, (int)miny, (int)(maxx - minx), (int)(maxy - miny));
+	result.found = true;
+	return true;
+}
+
+bool FaceTracker::redetect(const Mat& frame, const Mat& gray, TrackResult& result){
+	INTRAFACE::HeadPose hp;
+	result = TrackResult();
+	result.detected = true;
+	if (!detector.findFace(gray, result.face, detector.config->scan) || !detector.markFace(frame, result.face, detector.config->scan.notFace, result.landmarks, hp, &result.score)){
+		tracking = false;
+		return false;
+	}
+	for (int i = 0; i < 3; i++){
+		result.pose[i] = hp.angles[i];
+	}
+	tracking = true;
+	sinceKeyframe = 0;
+	previous = result.landmarks.clone();
+	result.found = true;
+	return true;
+}
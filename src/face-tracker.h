@@ -0,0 +1,45 @@
+#ifndef __FACE_TRACKER_H__
+#define __FACE_TRACKER_H__
+
+#include "detector.h"
+
+//One video frame
+struct TrackResult{
+	bool found;
+	bool detected; //the cascade ran on this frame instead of tracking
+	Rect face; //detected box, or the landmarks' bounding box when tracked
+	Mat landmarks;
+	float score;
+	int pose[3]; //roll, yaw, pitch
+	
+	TrackResult();
+};
+
+//Follows one face through consecutive frames of a video. The face is
+//detected on keyframes only; in between, IntraFace tracks the landmarks
+//from the previous frame, which skips the cascade scan and the detection
+//model. A tracking score below minScore, or a lost face, detects again
+//on the same frame.
+class FaceTracker{
+	public:
+		//keyframeInterval is the number of frames between forced detections, 0 for never
+		FaceTracker(const char* cfgname = "detector.cfg", int keyframeInterval = 30, float minScore = 0.3);
+		
+		//frames are BGR or gray, false if there is no face in the frame
+		bool track(const Mat& frame, TrackResult& result);
+		bool track(const ImageView& frame, TrackResult& result);
+		//forget the face, the next frame is a keyframe
+		void reset();
+	private:
+		Detector detector;
+		int keyframeInterval;
+		float minScore;
+		bool tracking;
+		int sinceKeyframe;
+		Mat previous;
+		
+		bool track(const Mat& frame, int format, TrackResult& result);
+		bool redetect(const Mat& frame, const Mat& gray, TrackResult& result);
+};
+
+#endif
@@ -0,0 +1,287 @@
+#include "haar-binary.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool IsHaarCascadeBinary(const char * filename)
+{
+    char magic[8];
+    FILE *pFile = fopen(filename, "rb");
+    if (pFile == NULL)
+        return false;
+    bool ok = fread(magic, 1, sizeof(magic), pFile) == sizeof(magic) &&
+              memcmp(magic, HAAR_BINARY_MAGIC, sizeof(magic)) == 0;
+    fclose(pFile);
+    return ok;
+}
+
+bool SaveHaarCascadeBinary(const CvHaarClassifierCascade * pCascade, const char * filename)
+{
+    if (!CV_IS_HAAR_CLASSIFIER(pCascade))
+        return false;
+
+    HaarBinaryHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HAAR_BINARY_MAGIC, sizeof(header.magic));
+    header.stage_count = pCascade->count;
+    header.win_width = pCascade->orig_window_size.width;
+    header.win_height = pCascade->orig_window_size.height;
+    for (int i = 0; i < pCascade->count; i++)
+    {
+        const CvHaarStageClassifier * stage = pCascade->stage_classifier + i;
+        header.classifier_count += stage->count;
+        for (int j = 0; j < stage->count; j++)
+            header.node_count += stage->classifier[j].count;
+    }
+
+    FILE *pFile = fopen(filename, "wb");
+    if (pFile == NULL) {
+        fprintf(stderr, "Can not write cascade to file %s\n", filename);
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, pFile) == 1;
+
+    for (int i = 0; ok && i < pCascade->count; i++)
+    {
+        const CvHaarStageClassifier * stage = pCascade->stage_classifier + i;
+        HaarBinaryStage bs;
+        bs.count = stage->count;
+        bs.threshold = stage->threshold;
+        bs.next = stage->next;
+        bs.child = stage->child;
+        bs.parent = stage->parent;
+        ok = fwrite(&bs, sizeof(bs), 1, pFile) == 1;
+    }
+
+    for (int i = 0; ok && i < pCascade->count; i++)
+        for (int j = 0; ok && j < pCascade->stage_classifier[i].count; j++)
+            ok = fwrite(&(pCascade->stage_classifier[i].classifier[j].count), sizeof(int), 1, pFile) == 1;
+
+    for (int i = 0; ok && i < pCascade->count; i++)
+    {
+        for (int j = 0; ok && j < pCascade->stage_classifier[i].count; j++)
+        {
+            const CvHaarClassifier * tree = pCascade->stage_classifier[i].classifier + j;
+            for (int k = 0; ok && k < tree->count; k++)
+            {
+                HaarBinaryNode node;
+                memset(&node, 0, sizeof(node));
+                node.tilted = tree->haar_feature[k].tilted;
+                for (int r = 0; r < CV_HAAR_FEATURE_MAX; r++)
+                {
+                    CvRect rect = tree->haar_feature[k].rect[r].r;
+                    node.rect[r][0] = rect.x;
+                    node.rect[r][1] = rect.y;
+                    node.rect[r][2] = rect.width;
+                    node.rect[r][3] = rect.height;
+                    node.weight[r] = tree->haar_feature[k].rect[r].weight;
+                }
+                node.threshold = tree->threshold[k];
+                node.left = tree->left[k];
+                node.right = tree->right[k];
+                ok = fwrite(&node, sizeof(node), 1, pFile) == 1;
+            }
+        }
+    }
+
+    for (int i = 0; ok && i < pCascade->count; i++)
+    {
+        for (int j = 0; ok && j < pCascade->stage_classifier[i].count; j++)
+        {
+            const CvHaarClassifier * tree = pCascade->stage_classifier[i].classifier + j;
+            ok = fwrite(tree->alpha, sizeof(float), tree->count + 1, pFile) == (size_t)(tree->count + 1);
+        }
+    }
+
+    fclose(pFile);
+    if (!ok)
+        fprintf(stderr, "Error writing cascade file %s\n", filename);
+    return ok;
+}
+
+CvHaarClassifierCascade * LoadHaarCascadeBinary(const char * filename)
+{
+    CvHaarClassifierCascade * pCascade = NULL;
+    const HaarBinaryHeader * header;
+    const HaarBinaryStage * stages;
+    const int * counts;
+    const HaarBinaryNode * nodes;
+    const float * alphas;
+    size_t expected;
+    int block_size, n, a;
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can not load cascade from file %s\n", filename);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(HaarBinaryHeader)) {
+        close(fd);
+        fprintf(stderr, "Invalid cascade file %s\n", filename);
+        return NULL;
+    }
+    size_t length = st.st_size;
+    void * data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Can not map cascade file %s\n", filename);
+        return NULL;
+    }
+
+    header = (const HaarBinaryHeader*)data;
+    if (memcmp(header->magic, HAAR_BINARY_MAGIC, sizeof(header->magic)) != 0 ||
+        header->stage_count <= 0 || header->classifier_count <= 0 || header->node_count <= 0)
+        goto EXIT_TAG;
+
+    expected = sizeof(HaarBinaryHeader) +
+               sizeof(HaarBinaryStage) * header->stage_count +
+               sizeof(int) * header->classifier_count +
+               sizeof(HaarBinaryNode) * header->node_count +
+               sizeof(float) * (header->node_count + header->classifier_count);
+    if (expected != length)
+        goto EXIT_TAG;
+
+    stages = (const HaarBinaryStage*)(header + 1);
+    counts = (const int*)(stages + header->stage_count);
+    nodes = (const HaarBinaryNode*)(counts + header->classifier_count);
+    alphas = (const float*)(nodes + header->node_count);
+
+    //same memory layout as OpenCV's own loader, so that
+    //cvReleaseHaarClassifierCascade can free it
+    block_size = sizeof(CvHaarClassifierCascade) + header->stage_count * sizeof(CvHaarStageClassifier);
+    pCascade = (CvHaarClassifierCascade*)cvAlloc(block_size);
+    memset(pCascade, 0, block_size);
+    pCascade->stage_classifier = (CvHaarStageClassifier*)(pCascade + 1);
+    pCascade->flags = CV_HAAR_MAGIC_VAL;
+    pCascade->count = header->stage_count;
+    pCascade->orig_window_size = cvSize(header->win_width, header->win_height);
+
+    n = 0;
+    a = 0;
+    for (int i = 0, c = 0; i < header->stage_count; i++)
+    {
+        CvHaarStageClassifier * stage = pCascade->stage_classifier + i;
+        if (stages[i].count <= 0 || c + stages[i].count > header->classifier_count)
+            goto EXIT_TAG;
+        stage->count = stages[i].count;
+        stage->threshold = stages[i].threshold;
+        stage->next = stages[i].next;
+        stage->child = stages[i].child;
+        stage->parent = stages[i].parent;
+        stage->classifier = (CvHaarClassifier*)cvAlloc(stage->count * sizeof(CvHaarClassifier));
+        memset(stage->classifier, 0, stage->count * sizeof(CvHaarClassifier));
+
+        for (int j = 0; j < stage->count; j++, c++)
+        {
+            CvHaarClassifier * tree = stage->classifier + j;
+            tree->count = counts[c];
+            if (tree->count <= 0 || n + tree->count > header->node_count)
+                goto EXIT_TAG;
+            tree->haar_feature = (CvHaarFeature*)cvAlloc(tree->count * (sizeof(CvHaarFeature) +
+                sizeof(float) + sizeof(int) + sizeof(int)) + (tree->count + 1) * sizeof(float));
+            tree->threshold = (float*)(tree->haar_feature + tree->count);
+            tree->left = (int*)(tree->threshold + tree->count);
+            tree->right = (int*)(tree->left + tree->count);
+            tree->alpha = (float*)(tree->right + tree->count);
+
+            for (int k = 0; k < tree->count; k++, n++)
+            {
+                CvHaarFeature * feature = tree->haar_feature + k;
+                feature->tilted = nodes[n].tilted;
+                for (int r = 0; r < CV_HAAR_FEATURE_MAX; r++)
+                {
+                    feature->rect[r].r = cvRect(nodes[n].rect[r][0], nodes[n].rect[r][1],
+                                                nodes[n].rect[r][2], nodes[n].rect[r][3]);
+                    feature->rect[r].weight = nodes[n].weight[r];
+                }
+                tree->threshold[k] = nodes[n].threshold;
+                tree->left[k] = nodes[n].left;
+                tree->right[k] = nodes[n].right;
+            }
+            memcpy(tree->alpha, alphas + a, (tree->count + 1) * sizeof(float));
+            a += tree->count + 1;
+        }
+    }
+
+    munmap(data, length);
+    return pCascade;
+
+ EXIT_TAG:
+
+    fprintf(stderr, "Invalid cascade file %s\n", filename);
+    munmap(data, length);
+    if (pCascade)
+        cvReleaseHaarClassifierCascade(&pCascade);
+    return NULL;
+}
+
+CvHaarClassifierCascade * LoadHaarCascade(const char * filename)
+{
+    if (IsHaarCascadeBinary(filename))
+        return LoadHaarCascadeBinary(filename);
+    return (CvHaarClassifierCascade*)cvLoad(filename, 0, 0, 0);
+}
+
+CvHaarClassifierCascade * CloneHaarCascade(const CvHaarClassifierCascade * pCascade)
+{
+    if (!CV_IS_HAAR_CLASSIFIER(pCascade))
+        return NULL;
+
+    int block_size = sizeof(CvHaarClassifierCascade) + pCascade->count * sizeof(CvHaarStageClassifier);
+    CvHaarClassifierCascade * pClone = (CvHaarClassifierCascade*)cvAlloc(block_size);
+    memset(pClone, 0, block_size);
+    pClone->stage_classifier = (CvHaarStageClassifier*)(pClone + 1);
+    pClone->flags = CV_HAAR_MAGIC_VAL;
+    pClone->count = pCascade->count;
+    pClone->orig_window_size = pCascade->orig_window_size;
+
+    for (int i = 0; i < pCascade->count; i++)
+    {
+        const CvHaarStageClassifier * src = pCascade->stage_classifier + i;
+        CvHaarStageClassifier * stage = pClone->stage_classifier + i;
+        *stage = *src;
+        stage->classifier = (CvHaarClassifier*)cvAlloc(src->count * sizeof(CvHaarClassifier));
+
+        for (int j = 0; j < src->count; j++)
+        {
+            const CvHaarClassifier * from = src->classifier + j;
+            CvHaarClassifier * tree = stage->classifier + j;
+            tree->count = from->count;
+            tree->haar_feature = (CvHaarFeature*)cvAlloc(tree->count * (sizeof(CvHaarFeature) +
+                sizeof(float) + sizeof(int) + sizeof(int)) + (tree->count + 1) * sizeof(float));
+            tree->threshold = (float*)(tree->haar_feature + tree->count);
+            tree->left = (int*)(tree->threshold + tree->count);
+            tree->right = (int*)(tree->left + tree->count);
+            tree->alpha = (float*)(tree->right + tree->count);
+            memcpy(tree->haar_feature, from->haar_feature, tree->count * sizeof(CvHaarFeature));
+            memcpy(tree->threshold, from->threshold, tree->count * sizeof(float));
+            memcpy(tree->left, from->left, tree->count * sizeof(int));
+            memcpy(tree->right, from->right, tree->count * sizeof(int));
+            memcpy(tree->alpha, from->alpha, (tree->count + 1) * sizeof(float));
+        }
+    }
+    return pClone;
+}
+
+size_t HaarCascadeSize(const CvHaarClassifierCascade * pCascade)
+{
+    if (!CV_IS_HAAR_CLASSIFIER(pCascade))
+        return 0;
+
+    size_t size = sizeof(CvHaarClassifierCascade) + pCascade->count * sizeof(CvHaarStageClassifier);
+    for (int i = 0; i < pCascade->count; i++)
+    {
+        const CvHaarStageClassifier * stage = pCascade->stage_classifier + i;
+        size += stage->count * sizeof(CvHaarClassifier);
+        for (int j = 0; j < stage->count; j++)
+            size += stage->classifier[j].count * (sizeof(CvHaarFeature) + sizeof(float) + 2 * sizeof(int)) +
+                    (stage->classifier[j].count + 1) * sizeof(float);
+    }
+    return size;
+}
@@ -0,0 +1,62 @@
+#ifndef __HAAR_BINARY__
+#define __HAAR_BINARY__
+
+#include <opencv/cv.h>
+#include <opencv2/objdetect/objdetect.hpp>
+
+//Precompiled Haar cascade. The file is a flat, native-endian dump of the
+//cascade produced by bin/haar2bin from an OpenCV XML cascade:
+//
+//  header      HaarBinaryHeader
+//  stages      HaarBinaryStage[stage_count]
+//  classifiers int[classifier_count]            (number of nodes per tree)
+//  nodes       HaarBinaryNode[node_count]
+//  alphas      float[node_count + classifier_count]
+//
+//It is mapped read-only and turned into a regular CvHaarClassifierCascade,
+//which can be released with cvReleaseHaarClassifierCascade.
+
+#define HAAR_BINARY_MAGIC "KBHAAR01"
+
+typedef struct HaarBinaryHeader_
+{
+    char magic[8];
+    int stage_count;
+    int win_width;
+    int win_height;
+    int classifier_count;
+    int node_count;
+} HaarBinaryHeader;
+
+typedef struct HaarBinaryStage_
+{
+    int count;
+    float threshold;
+    int next;
+    int child;
+    int parent;
+} HaarBinaryStage;
+
+typedef struct HaarBinaryNode_
+{
+    int tilted;
+    int rect[CV_HAAR_FEATURE_MAX][4];
+    float weight[CV_HAAR_FEATURE_MAX];
+    float threshold;
+    int left;
+    int right;
+} HaarBinaryNode;
+
+bool IsHaarCascadeBinary(const char * filename);
+bool SaveHaarCascadeBinary(const CvHaarClassifierCascade * pCascade, const char * filename);
+CvHaarClassifierCascade * LoadHaarCascadeBinary(const char * filename);
+
+//loads either form, picking the binary loader when the file has the magic
+CvHaarClassifierCascade * LoadHaarCascade(const char * filename);
+
+//OpenCV keeps per-scan state inside the cascade, so every concurrent user
+//needs its own copy of a shared one
+CvHaarClassifierCascade * CloneHaarCascade(const CvHaarClassifierCascade * pCascade);
+size_t HaarCascadeSize(const CvHaarClassifierCascade * pCascade);
+
+#endif
@@ -0,0 +1,44 @@
+#include "haar-binary.h"
+#include <iostream>
+#include <sys/time.h>
+using namespace std;
+
+//Converts an OpenCV XML Haar cascade into the precompiled binary form
+//loaded by Detector when CASCADE/HAARCASCADE points at it.
+static double seconds(const struct timeval& begin, const struct timeval& end){
+	return (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+}
+
+int main(int argc, char** argv){
+	if (argc != 3){
+		cerr<<"Usage: "<<argv[0]<<" <cascade.xml> <cascade.bin>"<<endl;
+		return 1;
+	}
+	struct timeval begin, end;
+	gettimeofday(&begin, NULL);
+	CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)cvLoad(argv[1], 0, 0, 0);
+	gettimeofday(&end, NULL);
+	if (cascade == NULL || !CV_IS_HAAR_CLASSIFIER(cascade)){
+		cerr<<"Cannot load Haar cascade "<<argv[1]<<endl;
+		return 1;
+	}
+	cout<<"XML cascade loaded in "<<seconds(begin, end)<<" seconds"<<endl;
+	
+	if (!SaveHaarCascadeBinary(cascade, argv[2])){
+		cvReleaseHaarClassifierCascade(&cascade);
+		return 1;
+	}
+	cvReleaseHaarClassifierCascade(&cascade);
+	
+	gettimeofday(&begin, NULL);
+	cascade = LoadHaarCascadeBinary(argv[2]);
+	gettimeofday(&end, NULL);
+	if (cascade == NULL){
+		cerr<<"Cannot reload "<<argv[2]<<endl;
+		return 1;
+	}
+	cout<<"Binary cascade loaded in "<<seconds(begin, end)<<" seconds"<<endl;
+	cout<<"Cascade saved to "<<argv[2]<<endl;
+	cvReleaseHaarClassifierCascade(&cascade);
+	return 0;
+}
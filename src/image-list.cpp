@@ -0,0 +1,85 @@
+#include "image-list.h"
+#include <fstream>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <dirent.h>
+#include <sys/stat.h>
+
+bool IsImageFile(const string& name){
+	static const char* extensions[] = {".jpg", ".jpeg", ".png", ".bmp", ".tif", ".tiff", ".pgm", ".ppm"};
+	size_t dot = name.find_last_of('.');
+	if (dot == string::npos)
+		return false;
+	string ext = name.substr(dot);
+	for (size_t i = 0; i < ext.size(); i++)
+		ext[i] = tolower(ext[i]);
+	for (size_t i = 0; i < sizeof(extensions)/sizeof(extensions[0]); i++){
+		if (ext == extensions[i])
+			return true;
+	}
+	return false;
+}
+
+bool IsPackFile(const string& name){
+	return name.size() > 5 && name.compare(name.size() - 5, 5, ".pack") == 0;
+}
+
+void ListImages(const string& dir, vector<string>& files, bool packs){
+	DIR* d = opendir(dir.data());
+	if (d == NULL){
+		cerr<<"Cannot open directory "<<dir<<endl;
+		return;
+	}
+	vector<string> entries;
+	struct dirent* entry;
+	while ((entry = readdir(d)) != NULL){
+		if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+			entries.push_back(entry->d_name);
+	}
+	closedir(d);
+	sort(entries.begin(), entries.end());
+	for (size_t i = 0; i < entries.size(); i++){
+		string path = dir + "/" + entries[i];
+		struct stat st;
+		if (stat(path.data(), &st) != 0)
+			continue;
+		if (S_ISDIR(st.st_mode))
+			ListImages(path, files, packs);
+		else if (IsImageFile(entries[i]) || (packs && IsPackFile(entries[i])))
+			files.push_back(path);
+	}
+}
+
+void ReadImageList(istream& in, vector<string>& files){
+	string line;
+	while (getline(in, line)){
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (!line.empty())
+			files.push_back(line);
+	}
+}
+
+bool GatherImages(const char* listFile, int argc, char** argv, vector<string>& files, bool packs){
+	if (listFile != NULL){
+		ifstream fin(listFile);
+		if (!fin){
+			cerr<<"Cannot open list "<<listFile<<endl;
+			return false;
+		}
+		ReadImageList(fin, files);
+	}
+	for (int i = 0; i < argc; i++){
+		struct stat st;
+		if (strcmp(argv[i], "-") == 0)
+			ReadImageList(cin, files);
+		else if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode))
+			ListImages(argv[i], files, packs);
+		else
+			files.push_back(argv[i]);
+	}
+	if (listFile == NULL && argc == 0)
+		ReadImageList(cin, files);
+	return true;
+}
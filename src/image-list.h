@@ -0,0 +1,25 @@
+#ifndef __IMAGE_LIST_H__
+#define __IMAGE_LIST_H__
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//Input images of the command line tools: files, directories searched
+//recursively, list files with one path per line, and stdin
+
+//by extension
+bool IsImageFile(const string& name);
+//an image pack (image-pack.h), by extension
+bool IsPackFile(const string& name);
+//image files under dir, sorted, and image packs if packs
+void ListImages(const string& dir, vector<string>& files, bool packs = false);
+//non-empty lines
+void ReadImageList(istream& in, vector<string>& files);
+//listFile (may be NULL), then the arguments: - for stdin, directories and files.
+//stdin if there is neither. packs as for ListImages. false if the list file cannot be read
+bool GatherImages(const char* listFile, int argc, char** argv, vector<string>& files, bool packs = false);
+
+#endif
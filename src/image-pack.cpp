@@ -0,0 +1,249 @@
+#include "image-pack.h"
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool IsImagePack(const char* filename){
+	char magic[8];
+	FILE* file = fopen(filename, "rb");
+	if (file == NULL)
+		return false;
+	bool ok = fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+		memcmp(magic, IMAGE_PACK_MAGIC, sizeof(magic)) == 0;
+	fclose(file);
+	return ok;
+}
+
+ImagePack::ImagePack(){
+	base = NULL;
+	length = 0;
+	header = NULL;
+	entries = NULL;
+	names = NULL;
+}
+
+ImagePack::~ImagePack(){
+	close();
+}
+
+bool ImagePack::open(const string& filename){
+	close();
+	int fd = ::open(filename.data(), O_RDONLY);
+	if (fd < 0){
+		fprintf(stderr, "Cannot open pack %s\n", filename.data());
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ImagePackHeader)){
+		::close(fd);
+		fprintf(stderr, "Invalid pack %s\n", filename.data());
+		return false;
+	}
+	length = st.st_size;
+	void* data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED){
+		length = 0;
+		fprintf(stderr, "Cannot map pack %s\n", filename.data());
+		return false;
+	}
+	base = (unsigned char*)data;
+	header = (const ImagePackHeader*)base;
+
+	//every offset is checked once here, the accessors trust them
+	bool valid = memcmp(header->magic, IMAGE_PACK_MAGIC, sizeof(header->magic)) == 0 &&
+		header->entrySize == sizeof(ImagePackEntry) && header->indexOffset % IMAGE_PACK_ALIGNMENT == 0 &&
+		header->indexOffset <= length && (length - header->indexOffset)/sizeof(ImagePackEntry) >= header->count &&
+		header->namesOffset <= length && length - header->namesOffset >= header->namesSize;
+	if (valid){
+		entries = (const ImagePackEntry*)(base + header->indexOffset);
+		names = (const char*)(base + header->namesOffset);
+		for (uint32_t i = 0; i < header->count && valid; i++){
+			valid = entries[i].offset <= length && length - entries[i].offset >= entries[i].size &&
+				(uint64_t)entries[i].nameOffset + entries[i].nameLength <= header->namesSize;
+		}
+	}
+	if (!valid){
+		fprintf(stderr, "Invalid pack %s\n", filename.data());
+		close();
+		return false;
+	}
+	//the images are read in order, the index is needed right away
+	madvise(base, length, MADV_SEQUENTIAL);
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t indexStart = header->indexOffset/page*page;
+	madvise(base + indexStart, length - indexStart, MADV_WILLNEED);
+	return true;
+}
+
+void ImagePack::close(){
+	if (base != NULL)
+		munmap(base, length);
+	base = NULL;
+	length = 0;
+	header = NULL;
+	entries = NULL;
+	names = NULL;
+}
+
+size_t ImagePack::count() const{
+	return header != NULL ? header->count : 0;
+}
+
+const unsigned char* ImagePack::data(size_t i) const{
+	return base + entries[i].offset;
+}
+
+size_t ImagePack::size(size_t i) const{
+	return entries[i].size;
+}
+
+int64_t ImagePack::id(size_t i) const{
+	return entries[i].id;
+}
+
+string ImagePack::name(size_t i) const{
+	return string(names + entries[i].nameOffset, entries[i].nameLength);
+}
+
+void ImagePack::range(size_t first, size_t last, unsigned char*& begin, size_t& bytes){
+	begin = NULL;
+	bytes = 0;
+	last = last < count() ? last : count();
+	if (first >= last)
+		return;
+	//images are stored in index order
+	size_t page = sysconf(_SC_PAGESIZE);
+	uint64_t from = entries[first].offset/page*page;
+	uint64_t to = entries[last - 1].offset + entries[last - 1].size;
+	begin = base + from;
+	bytes = to - from;
+}
+
+void ImagePack::prefetch(size_t first, size_t last){
+	unsigned char* begin;
+	size_t bytes;
+	range(first, last, begin, bytes);
+	if (bytes > 0)
+		madvise(begin, bytes, MADV_WILLNEED);
+}
+
+void ImagePack::release(size_t first, size_t last){
+	unsigned char* begin;
+	size_t bytes;
+	range(first, last, begin, bytes);
+	//the last page may hold the start of the next image, which stays
+	size_t page = sysconf(_SC_PAGESIZE);
+	bytes = bytes/page*page;
+	if (bytes > 0)
+		madvise(begin, bytes, MADV_DONTNEED);
+}
+
+ImagePackWriter::ImagePackWriter(){
+	file = NULL;
+	ok = false;
+	offset = 0;
+}
+
+ImagePackWriter::~ImagePackWriter(){
+	close();
+}
+
+bool ImagePackWriter::open(const string& filename){
+	close();
+	this->filename = filename;
+	entries.clear();
+	names.clear();
+	//written aside and renamed by close, a pack never appears half written
+	file = fopen((filename + ".tmp").data(), "wb");
+	if (file == NULL){
+		fprintf(stderr, "Cannot write %s.tmp\n", filename.data());
+		ok = false;
+		return false;
+	}
+	//the header is rewritten by close, once the index is known
+	ImagePackHeader header;
+	memset(&header, 0, sizeof(header));
+	offset = sizeof(header);
+	ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	return ok;
+}
+
+bool ImagePackWriter::add(const string& name, const unsigned char* data, size_t size, int64_t id){
+	if (file == NULL || !ok)
+		return false;
+	if (size > 0 && fwrite(data, 1, size, file) != size){
+		ok = false;
+		return false;
+	}
+	ImagePackEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.offset = offset;
+	entry.size = size;
+	entry.id = id >= 0 ? id : (int64_t)entries.size();
+	entry.nameOffset = names.size();
+	entry.nameLength = name.size();
+	entries.push_back(entry);
+	names += name;
+	offset += size;
+	return true;
+}
+
+bool ImagePackWriter::addFile(const string& filename, int64_t id){
+	FILE* in = fopen(filename.data(), "rb");
+	if (in == NULL){
+		fprintf(stderr, "Cannot read %s, skipped\n", filename.data());
+		return false;
+	}
+	buffer.clear();
+	unsigned char chunk[65536];
+	size_t n;
+	while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+		buffer.insert(buffer.end(), chunk, chunk + n);
+	fclose(in);
+	if (buffer.empty()){
+		fprintf(stderr, "Cannot read %s, skipped\n", filename.data());
+		return false;
+	}
+	return add(filename, &buffer[0], buffer.size(), id);
+}
+
+bool ImagePackWriter::close(){
+	if (file == NULL)
+		return ok;
+	ImagePackHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, IMAGE_PACK_MAGIC, sizeof(header.magic));
+	header.count = entries.size();
+	header.entrySize = sizeof(ImagePackEntry);
+	header.indexOffset = (offset + IMAGE_PACK_ALIGNMENT - 1)/IMAGE_PACK_ALIGNMENT*IMAGE_PACK_ALIGNMENT;
+	header.namesOffset = header.indexOffset + entries.size()*sizeof(ImagePackEntry);
+	header.namesSize = names.size();
+	//the entries are read in place from the mapping
+	static const char padding[IMAGE_PACK_ALIGNMENT] = {0};
+	size_t pad = header.indexOffset - offset;
+	ok = ok && (pad == 0 || fwrite(padding, 1, pad, file) == pad) &&
+		(entries.empty() || fwrite(&entries[0], sizeof(ImagePackEntry), entries.size(), file) == entries.size()) &&
+		(names.empty() || fwrite(names.data(), 1, names.size(), file) == names.size()) &&
+		fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+	if (fclose(file) != 0)
+		ok = false;
+	file = NULL;
+	string temp = filename + ".tmp";
+	if (!ok || rename(temp.data(), filename.data()) != 0){
+		fprintf(stderr, "Cannot write %s\n", filename.data());
+		unlink(temp.data());
+		ok = false;
+	}
+	return ok;
+}
+
+size_t ImagePackWriter::count() const{
+	return entries.size();
+}
+
+uint64_t ImagePackWriter::bytes() const{
+	return offset;
+}
@@ -0,0 +1,107 @@
+#ifndef __IMAGE_PACK_H__
+#define __IMAGE_PACK_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//Many encoded images in one file, so that offline runs over millions of small
+//files read one file sequentially instead of opening and reading each. Written
+//by bin/detect-pack, native byte order:
+//
+//  ImagePackHeader
+//  encoded images, back to back, as they were in their files
+//  zero padding            up to IMAGE_PACK_ALIGNMENT
+//  ImagePackEntry[count]   the index, one fixed size entry per image
+//  char[namesSize]         image names, not terminated
+//
+//The index is written last, so images are streamed into the pack without
+//knowing their number in advance.
+
+#define IMAGE_PACK_MAGIC "KBPACK01"
+//of the index in the file, so that the mapped entries are aligned
+#define IMAGE_PACK_ALIGNMENT 64
+
+struct ImagePackHeader{
+	char magic[8];
+	uint32_t count;
+	uint32_t entrySize; //sizeof(ImagePackEntry)
+	uint64_t indexOffset;
+	uint64_t namesOffset;
+	uint64_t namesSize;
+};
+
+struct ImagePackEntry{
+	uint64_t offset; //of the encoded image in the file
+	uint64_t size;
+	int64_t id; //given to the packer, or the image's number in the pack
+	uint32_t nameOffset; //in the names
+	uint32_t nameLength;
+};
+
+bool IsImagePack(const char* filename);
+
+//Reads a pack through one read-only mapping: images are decoded straight from
+//the mapped bytes and never copied. The mapping is read sequentially, so the
+//kernel reads ahead and drops pages behind; prefetch starts reading the next
+//batch while the current one is detected, release lets go of a finished one.
+class ImagePack{
+	public:
+		ImagePack();
+		~ImagePack();
+
+		bool open(const string& filename);
+		void close();
+		size_t count() const;
+		const unsigned char* data(size_t i) const;
+		size_t size(size_t i) const;
+		int64_t id(size_t i) const;
+		string name(size_t i) const;
+		//asks for the images first to last - 1 to be read in
+		void prefetch(size_t first, size_t last);
+		//the pages of images first to last - 1 may be dropped
+		void release(size_t first, size_t last);
+	private:
+		unsigned char* base;
+		size_t length;
+		const ImagePackHeader* header;
+		const ImagePackEntry* entries;
+		const char* names;
+
+		ImagePack(const ImagePack&);
+		ImagePack& operator=(const ImagePack&);
+		//page aligned range of the images first to last - 1
+		void range(size_t first, size_t last, unsigned char*& begin, size_t& bytes);
+};
+
+//Streams images into a new pack, the index is written by close
+class ImagePackWriter{
+	public:
+		ImagePackWriter();
+		~ImagePackWriter();
+
+		bool open(const string& filename);
+		//id < 0 for the image's number in the pack
+		bool add(const string& name, const unsigned char* data, size_t size, int64_t id = -1);
+		//adds the content of a file, under its path
+		bool addFile(const string& filename, int64_t id = -1);
+		bool close();
+		size_t count() const;
+		uint64_t bytes() const;
+	private:
+		FILE* file;
+		string filename;
+		bool ok;
+		uint64_t offset;
+		vector<ImagePackEntry> entries;
+		string names;
+		vector<unsigned char> buffer;
+
+		ImagePackWriter(const ImagePackWriter&);
+		ImagePackWriter& operator=(const ImagePackWriter&);
+};
+
+#endif
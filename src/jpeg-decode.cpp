@@ -0,0 +1,160 @@
+#include "jpeg-decode.h"
+#include <opencv2/imgproc/imgproc.hpp>
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+namespace {
+
+struct ErrorManager
+{
+    struct jpeg_error_mgr pub;
+    jmp_buf jump;
+};
+
+void onError(j_common_ptr cinfo)
+{
+    ErrorManager * err = (ErrorManager*)cinfo->err;
+    char message[JMSG_LENGTH_MAX];
+    (*cinfo->err->format_message)(cinfo, message);
+    fprintf(stderr, "JPEG decode error: %s\n", message);
+    longjmp(err->jump, 1);
+}
+
+void onWarning(j_common_ptr, int)
+{
+}
+
+//in-memory source, jpeg_mem_src is not available in every libjpeg
+void initSource(j_decompress_ptr)
+{
+}
+
+boolean fillInput(j_decompress_ptr cinfo)
+{
+    //truncated data: feed an EOI marker, libjpeg warns and stops
+    static const JOCTET eoi[2] = {0xFF, JPEG_EOI};
+    cinfo->src->next_input_byte = eoi;
+    cinfo->src->bytes_in_buffer = 2;
+    return TRUE;
+}
+
+void skipInput(j_decompress_ptr cinfo, long count)
+{
+    if (count <= 0)
+        return;
+    if ((size_t)count > cinfo->src->bytes_in_buffer) {
+        fillInput(cinfo);
+        return;
+    }
+    cinfo->src->next_input_byte += count;
+    cinfo->src->bytes_in_buffer -= count;
+}
+
+void termSource(j_decompress_ptr)
+{
+}
+
+void setSource(j_decompress_ptr cinfo, struct jpeg_source_mgr * src, const uchar * data, size_t size)
+{
+    src->init_source = initSource;
+    src->fill_input_buffer = fillInput;
+    src->skip_input_data = skipInput;
+    src->resync_to_restart = jpeg_resync_to_restart;
+    src->term_source = termSource;
+    src->next_input_byte = data;
+    src->bytes_in_buffer = size;
+    cinfo->src = src;
+}
+
+}
+
+bool IsJpeg(const uchar * data, size_t size)
+{
+    return data != NULL && size > 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+bool DecodeJpegScaled(const uchar * data, size_t size, int denom, cv::Mat & gray, cv::Size & fullSize)
+{
+    if (!IsJpeg(data, size) || (denom != 1 && denom != 2 && denom != 4 && denom != 8))
+        return false;
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_source_mgr src;
+    ErrorManager err;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = onError;
+    err.pub.emit_message = onWarning;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    setSource(&cinfo, &src, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    fullSize = cv::Size(cinfo.image_width, cinfo.image_height);
+    cinfo.out_color_space = JCS_GRAYSCALE;
+    cinfo.scale_num = 1;
+    cinfo.scale_denom = denom;
+    cinfo.dct_method = JDCT_ISLOW;
+    jpeg_start_decompress(&cinfo);
+
+    gray.create(cinfo.output_height, cinfo.output_width, CV_8UC1);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        JSAMPROW row = gray.ptr<uchar>(cinfo.output_scanline);
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
+
+bool DecodeJpegRegion(const uchar * data, size_t size, cv::Rect & region, cv::Mat & bgr)
+{
+    if (!IsJpeg(data, size))
+        return false;
+
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_source_mgr src;
+    ErrorManager err;
+    //kept outside the setjmp scope so that longjmp cannot skip its destructor
+    cv::Mat row;
+    cinfo.err = jpeg_std_error(&err.pub);
+    err.pub.error_exit = onError;
+    err.pub.emit_message = onWarning;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_create_decompress(&cinfo);
+    setSource(&cinfo, &src, data, size);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = JCS_RGB;
+    cinfo.dct_method = JDCT_ISLOW;
+    region &= cv::Rect(0, 0, cinfo.image_width, cinfo.image_height);
+    if (region.width <= 0 || region.height <= 0) {
+        jpeg_destroy_decompress(&cinfo);
+        return false;
+    }
+    jpeg_start_decompress(&cinfo);
+
+    //rows above the region still have to be decoded, but only into one row
+    row.create(1, cinfo.output_width, CV_8UC3);
+    bgr.create(region.height, region.width, CV_8UC3);
+    JSAMPROW line = row.ptr<uchar>(0);
+    int last = region.y + region.height;
+    while ((int)cinfo.output_scanline < last) {
+        int y = cinfo.output_scanline;
+        jpeg_read_scanlines(&cinfo, &line, 1);
+        if (y >= region.y) {
+            cv::Mat out = bgr.row(y - region.y);
+            cv::cvtColor(row.colRange(region.x, region.x + region.width), out, CV_RGB2BGR);
+        }
+    }
+    //the rest of the image is not needed
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef __JPEG_DECODE_H__
+#define __JPEG_DECODE_H__
+
+#include <opencv2/core/core.hpp>
+#include <stddef.h>
+
+//Partial JPEG decoding straight from encoded bytes with libjpeg.
+
+bool IsJpeg(const uchar * data, size_t size);
+
+//decodes at 1/denom of the full size (denom is 1, 2, 4 or 8), scaling in the
+//DCT domain, to 8-bit gray. fullSize receives the full resolution size.
+bool DecodeJpegScaled(const uchar * data, size_t size, int denom, cv::Mat & gray, cv::Size & fullSize);
+
+//decodes only region (full resolution coordinates, clipped to the image) to
+//BGR, keeping a single full-width row besides the output. region is updated
+//to the area actually decoded.
+bool DecodeJpegRegion(const uchar * data, size_t size, cv::Rect & region, cv::Mat & bgr);
+
+#endif
@@ -1,34 +1,432 @@
-#include <opencv2/highgui/highgui.hpp>
 #include "detector.h"
-#include <vector>
-#include <ctime>
+#include "records.h"
+#include "metrics.h"
+#include "trace.h"
+#include "result-cache.h"
+#include "quality.h"
+#include "face-tensor.h"
+#include "npy-writer.h"
+#include "image-list.h"
+#include "image-pack.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
 #include <sys/time.h>
 using namespace std;
 
-int main(){
-	Detector detector;
+//Batch command line tool: detects faces in a list of images on a thread pool
+//and writes one record per image as JSON Lines or binary records (records.h).
+//Detector messages go to stderr, stdout only carries records.
+
+static void usage(const char* name){
+	cerr<<"Usage: "<<name<<" [options] [image|directory|-]..."<<endl;
+	cerr<<"Images are listed on the command line, found in directories (recursively),"<<endl;
+	cerr<<"read one per line from a list file (-i) or from stdin (- or no inputs)."<<endl;
+	cerr<<"Image packs (.pack) written by detect-pack, given or in directories, are read in place"<<endl;
+	cerr<<"of their images."<<endl;
+	cerr<<"  -c  detector configuration, default detector.cfg"<<endl;
+	cerr<<"  -i  file with one image path per line"<<endl;
+	cerr<<"  -t  threads, default THREADS from the configuration"<<endl;
+	cerr<<"  -m  comma separated outputs: box,landmarks,pose, default all three"<<endl;
+	cerr<<"  -a  directory to write aligned faces to, as <name>.png"<<endl;
+	cerr<<"  -W, -H, -P  aligned face width, height and patch size, default 100 100 30"<<endl;
+	cerr<<"  -n  aligned landmarks, 5 or 49, default 49"<<endl;
+	cerr<<"  -N  write the aligned faces as one array to <prefix>.npy and their landmarks to"<<endl;
+	cerr<<"      <prefix>-landmarks.npy, row k is the k-th image with a face"<<endl;
+	cerr<<"  -Y  layout of -N as a comma separated list: gray or bgr, u8 or f32 ((pixel - 127.5)/128),"<<endl;
+	cerr<<"      planar (N x C x H x W), raw (.raw files without a header), default bgr,u8"<<endl;
+	cerr<<"  -f  output format, jsonl or bin, default jsonl"<<endl;
+	cerr<<"  -o  output file, default stdout"<<endl;
+	cerr<<"  -b  images per batch, default 256"<<endl;
+	cerr<<"  -S  scan settings for this run, as KEY=value,... with the detector.cfg keys"<<endl;
+	cerr<<"      SCALE_FACTOR, MIN_NEIGHBORS, MIN_FACE, MAX_FACE, HAAR_MIN_FACE, NOT_FACE"<<endl;
+	cerr<<"  -d  milliseconds the face search of one image may take, the best face found by then"<<endl;
+	cerr<<"      is returned and marked truncated"<<endl;
+	cerr<<"  -M  print per-stage latencies and outcome counts at the end"<<endl;
+	cerr<<"  -T  write a Chrome trace of every thread's stages to the given file"<<endl;
+	cerr<<"  -C  cache the results of this many distinct images, box/landmarks/pose only"<<endl;
+	cerr<<"  -D  directory keeping cached results across runs, implies -C 65536 if not given"<<endl;
+}
+
+static double seconds(const struct timeval& begin, const struct timeval& end){
+	return (end.tv_sec - begin.tv_sec) + ((end.tv_usec - begin.tv_usec)/1000000.0);
+}
+
+//an image of the run, a file or an image in a pack
+struct InputImage{
+	ImagePack* pack; //NULL for files
+	size_t index; //in the pack or in the files
+};
+
+//prefetches or releases the pack images among images[first, last),
+//one run of consecutive images of a pack at a time
+static void adviseImages(const vector<InputImage>& images, size_t first, size_t last, bool prefetch){
+	size_t begin = first;
+	while (begin < last){
+		ImagePack* pack = images[begin].pack;
+		size_t end = begin + 1;
+		while (end < last && images[end].pack == pack)
+			end++;
+		if (pack != NULL){
+			if (prefetch)
+				pack->prefetch(images[begin].index, images[end - 1].index + 1);
+			else
+				pack->release(images[begin].index, images[end - 1].index + 1);
+		}
+		begin = end;
+	}
+}
+
+static int parseStages(char* list){
+	int stages = 0;
+	for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")){
+		if (strcmp(tok, "box") == 0) stages |= SBOX;
+		else if (strcmp(tok, "landmarks") == 0) stages |= SLANDMARKS;
+		else if (strcmp(tok, "pose") == 0) stages |= SPOSE;
+		else return -1;
+	}
+	return stages;
+}
+
+static bool parseTensor(char* list, TensorOptions& tensor, bool& raw){
+	for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")){
+		if (strcmp(tok, "gray") == 0) tensor.channels = 1;
+		else if (strcmp(tok, "bgr") == 0) tensor.channels = 3;
+		else if (strcmp(tok, "u8") == 0) tensor.type = TENSOR_U8;
+		else if (strcmp(tok, "f32") == 0) tensor.type = TENSOR_F32;
+		else if (strcmp(tok, "planar") == 0) tensor.planar = true;
+		else if (strcmp(tok, "raw") == 0) raw = true;
+		else return false;
+	}
+	return true;
+}
+
+//KEY=value pairs separated by commas, false on an unknown key
+static bool parseScan(char* list, ScanParams& scan){
+	for (char* tok = strtok(list, ","); tok != NULL; tok = strtok(NULL, ",")){
+		char* value = strchr(tok, '=');
+		if (value == NULL)
+			return false;
+		*value++ = '\0';
+		if (!SetScanParam(scan, tok, value))
+			return false;
+	}
+	return true;
+}
+
+static string baseName(const string& path){
+	size_t slash = path.find_last_of('/');
+	string name = slash == string::npos ? path : path.substr(slash + 1);
+	size_t dot = name.find_last_of('.');
+	return dot == string::npos ? name : name.substr(0, dot);
+}
+
+static void writeJsonString(ostream& out, const string& s){
+	out<<'"';
+	for (size_t i = 0; i < s.size(); i++){
+		unsigned char c = s[i];
+		if (c == '"' || c == '\\'){
+			out<<'\\'<<c;
+		}
+		else if (c < 0x20){
+			char escaped[8];
+			snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+			out<<escaped;
+		}
+		else{
+			out<<c;
+		}
+	}
+	out<<'"';
+}
+
+static void writeJson(ostream& out, const InputImage& image, const string& path, const DetectResult& result, int stages, const string& aligned, int row){
+	out<<"{\"file\":";
+	writeJsonString(out, path);
+	if (image.pack != NULL)
+		out<<",\"id\":"<<image.pack->id(image.index);
+	out<<",\"found\":"<<(result.found ? "true" : "false");
+	if (result.found){
+		out<<",\"face\":["<<result.face.x<<","<<result.face.y<<","<<result.face.width<<","<<result.face.height<<"]";
+		if (stages & (SLANDMARKS|SPOSE|SALIGNED))
+			out<<",\"score\":"<<result.score;
+		if (stages & SPOSE)
+			out<<",\"pose\":["<<result.pose[0]<<","<<result.pose[1]<<","<<result.pose[2]<<"]";
+		if (stages & SLANDMARKS){
+			out<<",\"landmarks\":[";
+			for (int i = 0; i < result.landmarks.cols; i++){
+				out<<(i ? ",[" : "[")<<result.landmarks.at<float>(0, i)<<","<<result.landmarks.at<float>(1, i)<<"]";
+			}
+			out<<"]";
+		}
+		if (!aligned.empty()){
+			out<<",\"aligned\":";
+			writeJsonString(out, aligned);
+		}
+		if (row >= 0)
+			out<<",\"row\":"<<row;
+	}
+	if (result.truncated)
+		out<<",\"truncated\":true";
+	out<<",\"seconds\":"<<result.seconds<<"}\n";
+}
+
+static void writeRecord(ostream& out, const string& path, const DetectResult& result){
+	DetectRecord record;
+	memset(&record, 0, sizeof(record));
+	record.pathLength = path.size();
+	record.found = result.found;
+	record.face[0] = result.face.x;
+	record.face[1] = result.face.y;
+	record.face[2] = result.face.width;
+	record.face[3] = result.face.height;
+	record.score = result.score;
+	for (int i = 0; i < 3; i++)
+		record.pose[i] = result.pose[i];
+	record.seconds = result.seconds;
+	record.landmarks = result.found ? result.landmarks.cols : 0;
+	record.truncated = result.truncated;
+	out.write((const char*)&record, sizeof(record));
+	out.write(path.data(), path.size());
+	for (int r = 0; r < 2; r++){
+		for (uint32_t i = 0; i < record.landmarks; i++){
+			float v = result.landmarks.at<float>(r, i);
+			out.write((const char*)&v, sizeof(v));
+		}
+	}
+}
+
+int main(int argc, char** argv){
+	const char* cfgname = "detector.cfg";
+	const char* listFile = NULL;
+	const char* alignedDir = NULL;
+	const char* outputFile = NULL;
+	string format = "jsonl";
+	int threads = -1;
+	int batchSize = 256;
+	bool printMetrics = false;
+	const char* traceFile = NULL;
+	int cacheEntries = 0;
+	const char* cacheDir = NULL;
+	const char* tensorPrefix = NULL;
+	TensorOptions tensorOptions;
+	bool rawTensor = false;
+	DetectOptions options(SBOX|SLANDMARKS|SPOSE);
+	int opt;
+	while ((opt = getopt(argc, argv, "c:i:t:m:a:W:H:P:n:N:Y:f:o:b:S:d:MT:C:D:h")) != -1){
+		switch (opt){
+			case 'c': cfgname = optarg; break;
+			case 'i': listFile = optarg; break;
+			case 't': threads = atoi(optarg); break;
+			case 'm':
+				options.stages = parseStages(optarg);
+				if (options.stages <= 0){
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'a': alignedDir = optarg; break;
+			case 'W': options.width = atof(optarg); break;
+			case 'H': options.height = atof(optarg); break;
+			case 'P': options.patchSize = atof(optarg); break;
+			case 'n': options.numLandmarks = atoi(optarg); break;
+			case 'N': tensorPrefix = optarg; break;
+			case 'Y':
+				if (!parseTensor(optarg, tensorOptions, rawTensor)){
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'f': format = optarg; break;
+			case 'o': outputFile = optarg; break;
+			case 'b': batchSize = atoi(optarg); break;
+			case 'S':
+				if (!parseScan(optarg, options.scan)){
+					usage(argv[0]);
+					return 1;
+				}
+				break;
+			case 'd': options.budget = atof(optarg)/1000; break;
+			case 'M': printMetrics = true; break;
+			case 'T': traceFile = optarg; break;
+			case 'C': cacheEntries = atoi(optarg); break;
+			case 'D': cacheDir = optarg; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	//the tensor takes the aligned faces out of the results
+	if ((format != "jsonl" && format != "bin") || batchSize <= 0 || (tensorPrefix != NULL && alignedDir != NULL)){
+		usage(argv[0]);
+		return 1;
+	}
+	if (alignedDir != NULL || tensorPrefix != NULL)
+		options.stages |= SALIGNED;
+	
+	vector<string> files;
+	if (!GatherImages(listFile, argc - optind, argv + optind, files, true))
+		return 1;
+	//packs stand for the images in them, which are read from the mapping
+	vector<InputImage> images;
+	vector<ImagePack*> packs;
+	for (size_t i = 0; i < files.size(); i++){
+		InputImage image = {NULL, i};
+		//only .pack files are checked, the others are not opened twice
+		const string& name = files[i];
+		bool pack = IsPackFile(name) && IsImagePack(name.data());
+		if (!pack){
+			images.push_back(image);
+			continue;
+		}
+		image.pack = new ImagePack();
+		if (!image.pack->open(files[i]))
+			return 1;
+		packs.push_back(image.pack);
+		for (image.index = 0; image.index < image.pack->count(); image.index++)
+			images.push_back(image);
+	}
+	
+	//records own stdout, detector messages go to stderr
+	streambuf* stdoutBuffer = cout.rdbuf();
+	cout.rdbuf(cerr.rdbuf());
+	ofstream fout;
+	if (outputFile != NULL){
+		fout.open(outputFile, format == "bin" ? ios::binary : ios::out);
+		if (!fout){
+			cerr<<"Cannot write "<<outputFile<<endl;
+			return 1;
+		}
+	}
+	ostream out(outputFile != NULL ? fout.rdbuf() : stdoutBuffer);
+	if (format == "bin"){
+		RecordFileHeader header;
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, RECORD_FILE_MAGIC, sizeof(header.magic));
+		header.recordSize = sizeof(DetectRecord);
+		out.write((const char*)&header, sizeof(header));
+	}
+	
+	//streamed batch by batch, the faces of a batch are all that is held in memory
+	FaceTensor tensor(tensorOptions);
+	NpyWriter faceWriter, landmarkWriter;
+	if (tensorPrefix != NULL){
+		string suffix = rawTensor ? ".raw" : ".npy";
+		int w = options.width, h = options.height, c = tensorOptions.channels;
+		vector<int> faceShape, landmarkShape;
+		if (tensorOptions.planar){
+			faceShape.push_back(c);
+			faceShape.push_back(h);
+			faceShape.push_back(w);
+		}
+		else{
+			faceShape.push_back(h);
+			faceShape.push_back(w);
+			faceShape.push_back(c);
+		}
+		landmarkShape.push_back(options.numLandmarks);
+		landmarkShape.push_back(2);
+		if (!faceWriter.open(tensorPrefix + suffix, tensorOptions.type == TENSOR_F32 ? "<f4" : "|u1", faceShape, rawTensor) ||
+			!landmarkWriter.open(tensorPrefix + string("-landmarks") + suffix, "<f4", landmarkShape, rawTensor))
+			return 1;
+	}
+	
+	Detector detector(cfgname);
+	if (threads >= 0)
+		detector.setThreads(threads);
+	ResultCache* cache = NULL;
+	if (cacheEntries > 0 || cacheDir != NULL){
+		cache = new ResultCache(cacheEntries > 0 ? cacheEntries : 65536, cacheDir != NULL ? cacheDir : "");
+		detector.setCache(cache);
+	}
+	
+	if (traceFile != NULL)
+		Trace::start();
+	struct timeval begin, end;
+	gettimeofday(&begin, NULL);
+	vector<double> latencies;
+	int nFound = 0;
+	vector<BatchInput> inputs;
+	vector<DetectResult> results;
+	for (size_t first = 0; first < images.size(); first += batchSize){
+		size_t last = MIN(first + batchSize, images.size());
+		inputs.clear();
+		for (size_t i = first; i < last; i++){
+			const InputImage& image = images[i];
+			if (image.pack != NULL)
+				inputs.push_back(BatchInput(image.pack->data(image.index), image.pack->size(image.index)));
+			else
+				inputs.push_back(BatchInput(files[image.index]));
+		}
+		//the next batch is read in while this one is detected
+		adviseImages(images, last, MIN(last + batchSize, images.size()), true);
+		if (tensorPrefix != NULL){
+			detector.detectAligned(inputs, results, tensor, options, 0, (int)first);
+			for (size_t i = 0; i < results.size(); i++)
+				nFound += results[i].found;
+			faceWriter.write(tensor.data, tensor.count);
+			landmarkWriter.write(tensor.landmarks, tensor.count);
+		}
+		else{
+			nFound += detector.detectBatch(inputs, results, options, 0, (int)first);
+		}
+		
+		int row = tensorPrefix != NULL ? (int)faceWriter.count() - tensor.count : -1;
+		for (size_t i = 0; i < results.size(); i++){
+			const InputImage& image = images[first + i];
+			string path = image.pack != NULL ? image.pack->name(image.index) : files[image.index];
+			string aligned;
+			if (alignedDir != NULL && results[i].found && !results[i].aligned.empty()){
+				aligned = string(alignedDir) + "/" + baseName(path) + ".png";
+				if (!imwrite(aligned, results[i].aligned))
+					aligned.clear();
+			}
+			if (format == "bin")
+				writeRecord(out, path, results[i]);
+			else
+				writeJson(out, image, path, results[i], options.stages, aligned, results[i].found && row >= 0 ? row++ : -1);
+			latencies.push_back(results[i].seconds);
+		}
+		out.flush();
+		adviseImages(images, first, last, false);
+	}
+	gettimeofday(&end, NULL);
 	
-	//test 1, detect landmarks, save to tmp/face1.jpg
-	cout<<"--------------test 1--------------"<<endl;
-	string img1= "./data/cat.jpg";
-	Mat face1 = detector.detect(img1);
-	imwrite( "./tmp/face1.jpg" , face1 );
-	cout<<"Image saved to ./tmp/face1.jpg"<<endl;
-	//test 2, detect landmarks, save to tmp/face2.jpg
-	cout<<endl<<"--------------test 2--------------"<<endl;
-	string img2= "./data/test1.jpg";
-	Mat landmarks;
-	int* pose = new int[3];
-	Mat face2 = detector.detect(img2, landmarks, pose);
-	imwrite( "./tmp/face2.jpg" , face2 );
-	cout<<"Roll: "<<pose[0]<<" Yaw: "<<pose[1]<<" Pitch: "<<pose[2]<<endl;
-	cout<<"Position of Nose Tip: "<<landmarks.at<float>(0, 14)<<" "<<landmarks.at<float>(1,14)<<endl;
-	cout<<"Image saved to ./tmp/face2.jpg"<<endl;
-	//test 3, detect landmarks, normalized it to 144 x 192, with 25 buffer size to the bound
-	cout<<endl<<"--------------test 3--------------"<<endl;
-	string img3= "./data/test1.jpg";
-	Mat face3 = detector.detectNorm(img3, 144, 192, 50, landmarks, 49, true);
-	imwrite( "./tmp/face3.jpg" , face3 );
-	cout<<"Image saved to ./tmp/face3.jpg"<<endl;
-	return 0;
+	double elapsed = seconds(begin, end);
+	cerr<<"Processed "<<images.size()<<" images, "<<nFound<<" with a face, in "<<elapsed<<" seconds";
+	if (!latencies.empty()){
+		sort(latencies.begin(), latencies.end());
+		double total = 0;
+		for (size_t i = 0; i < latencies.size(); i++)
+			total += latencies[i];
+		cerr<<", "<<images.size()/elapsed<<" images/sec"<<endl;
+		cerr<<"Latency per image: mean "<<total/latencies.size()<<" p50 "<<latencies[latencies.size()/2]
+			<<" p95 "<<latencies[latencies.size()*95/100]<<" max "<<latencies.back()<<" seconds";
+	}
+	cerr<<endl;
+	bool written = true;
+	if (tensorPrefix != NULL){
+		written = faceWriter.close() && landmarkWriter.close();
+		if (written)
+			cerr<<"Aligned faces: "<<faceWriter.count()<<" written to "<<tensorPrefix<<(rawTensor ? ".raw" : ".npy")<<endl;
+		else
+			cerr<<"Cannot write the aligned faces to "<<tensorPrefix<<endl;
+	}
+	if (cache != NULL)
+		cerr<<"Cache hits "<<cache->hits()<<" misses "<<cache->misses()<<endl;
+	if (printMetrics){
+		Metrics::report(cerr);
+		ReportQualityGate(cerr, detector.configuration().gate);
+	}
+	if (traceFile != NULL){
+		Trace::stop();
+		Trace::write(traceFile);
+	}
+	for (size_t i = 0; i < packs.size(); i++)
+		delete packs[i];
+	cout.rdbuf(stdoutBuffer);
+	return out.good() && written ? 0 : 1;
 }
@@ -1,4 +1,6 @@
 #include "mblbp-detect.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdio.h>
 
@@ -9,8 +11,8 @@ static omp_lock_t lock;
 
 #define MBLBP_LUTLENGTH  59
 
-#define MBLBP_CALC_SUM(p0, p1, p2, p3, offset_) \
-((p0)[offset_] - (p1)[offset_] - (p2)[offset_] + (p3)[offset_])
+#define MBLBP_CALC_SUM(s, o, i0, i1, i2, i3) \
+((s)[(o)[i0]] - (s)[(o)[i1]] - (s)[(o)[i2]] + (s)[(o)[i3]])
 
 static uchar MBLBP_LBPTABLE[256] = {1,   2,   3,   4,   5,   0,   6,   7,   8,   0,   0,   0,   9,   0,  10,  11,
 	12,   0,   0,   0,   0,   0,   0,   0,  13,   0,   0,   0,  14,   0,  15,  16,
@@ -137,6 +139,199 @@ void ReleaseMBLBPCascade(MBLBPCascade ** ppCascade)
     cvFree(ppCascade);
 }
 
+size_t MBLBPCascadeSize(const MBLBPCascade * pCascade)
+{
+    if(!pCascade)
+        return 0;
+
+    size_t size = sizeof(MBLBPCascade) + sizeof(MBLBPStage) * pCascade->count;
+    for(int i = 0; i < pCascade->count; i++)
+        size += sizeof(MBLBPWeak) * pCascade->stages[i].count;
+    return size;
+}
+
+MBLBPWorkspace * CreateMBLBPWorkspace(const MBLBPCascade * pCascade)
+{
+    if(!pCascade)
+        return NULL;
+
+    MBLBPWorkspace * pWorkspace = (MBLBPWorkspace*)cvAlloc(sizeof(MBLBPWorkspace));
+    memset(pWorkspace, 0, sizeof(MBLBPWorkspace));
+    for(int i = 0; i < pCascade->count; i++)
+        pWorkspace->count += pCascade->stages[i].count;
+    pWorkspace->offsets = (int*)cvAlloc(sizeof(int) * 16 * MAX(pWorkspace->count, 1));
+    return pWorkspace;
+}
+
+void ReleaseMBLBPWorkspace(MBLBPWorkspace ** ppWorkspace)
+{
+    if(!ppWorkspace || !*ppWorkspace)
+        return;
+
+    cvFree(&((*ppWorkspace)->offsets));
+    cvFree(&((*ppWorkspace)->small_data));
+    cvFree(&((*ppWorkspace)->resize_data));
+    cvFree(&((*ppWorkspace)->sum_data));
+    cvFree(&((*ppWorkspace)->group_data));
+    if((*ppWorkspace)->storage)
+        cvReleaseMemStorage(&((*ppWorkspace)->storage));
+    cvFree(ppWorkspace);
+}
+
+// grows a workspace buffer, the old content is not kept
+static uchar * ReserveBuffer(uchar ** buffer, size_t * capacity, size_t bytes)
+{
+    if(*capacity < bytes)
+    {
+        cvFree(buffer);
+        *buffer = (uchar*)cvAlloc(bytes);
+        *capacity = bytes;
+    }
+    return *buffer;
+}
+
+// image header over a workspace buffer
+static void InitWorkspaceImage(IplImage * header, CvSize size, int depth, uchar ** buffer, size_t * capacity)
+{
+    cvInitImageHeader(header, size, depth, 1);
+    cvSetData(header, ReserveBuffer(buffer, capacity, header->imageSize), header->widthStep);
+}
+
+// cvResize with INTER_LINEAR for a pyramid level, which is never larger than
+// the image: the same 11 bit fixed point weights and the same rounding, so the
+// levels are identical. OpenCV allocates its tables and rows on every call,
+// here they are workspace buffers.
+static void ResizeLevel(const IplImage * img, IplImage * small, MBLBPWorkspace * workspace)
+{
+    const int bits = 11, one = 1 << bits;
+    int swidth = img->width, sheight = img->height;
+    int dwidth = small->width, dheight = small->height;
+    if(swidth == dwidth && sheight == dheight)
+    {
+        cvCopy(img, small);
+        return;
+    }
+    uchar * buffer = ReserveBuffer(&workspace->resize_data, &workspace->resize_capacity,
+                                   (size_t)dwidth * (sizeof(int) + 4*sizeof(short)));
+    int * xofs = (int*)buffer;
+    short * alpha = (short*)(xofs + dwidth);
+    short * rows[2] = {alpha + 2*dwidth, alpha + 3*dwidth};
+    double scale_x = (double)swidth/dwidth, scale_y = (double)sheight/dheight;
+    // from xmax on the right neighbour is past the image
+    int xmax = dwidth;
+    for(int dx = 0; dx < dwidth; dx++)
+    {
+        float fx = (float)((dx + 0.5)*scale_x - 0.5);
+        int sx = cvFloor(fx);
+        fx -= sx;
+        if(sx < 0)
+            fx = 0, sx = 0;
+        if(sx >= swidth - 1)
+        {
+            fx = 0, sx = swidth - 1;
+            xmax = MIN(xmax, dx);
+        }
+        xofs[dx] = sx;
+        alpha[dx*2] = cv::saturate_cast<short>((1.f - fx)*one);
+        alpha[dx*2+1] = cv::saturate_cast<short>(fx*one);
+    }
+
+    int row_y[2] = {-1, -1};
+    for(int dy = 0; dy < dheight; dy++)
+    {
+        float fy = (float)((dy + 0.5)*scale_y - 0.5);
+        int sy = cvFloor(fy);
+        fy -= sy;
+        if(sy < 0)
+            fy = 0, sy = 0;
+        if(sy >= sheight - 1)
+            fy = 0, sy = sheight - 1;
+        short beta0 = cv::saturate_cast<short>((1.f - fy)*one);
+        short beta1 = cv::saturate_cast<short>(fy*one);
+        // the two source rows filtered horizontally, kept for the next output row.
+        // they are stored >> 4 in 16 bits, as OpenCV's SSE2 code blends them
+        for(int k = 0; k < 2; k++)
+        {
+            int y = MIN(sy + k, sheight - 1);
+            if(row_y[k] == y)
+                continue;
+            if(k == 0 && row_y[1] == y)
+            {
+                short * t = rows[0]; rows[0] = rows[1]; rows[1] = t;
+                row_y[1] = row_y[0];
+                row_y[0] = y;
+                continue;
+            }
+            if(k == 1 && row_y[0] == y)
+            {
+                memcpy(rows[1], rows[0], dwidth*sizeof(short));
+                row_y[1] = y;
+                continue;
+            }
+            const uchar * src = (const uchar*)(img->imageData + img->widthStep*y);
+            short * row = rows[k];
+            int dx = 0;
+            for(; dx < xmax; dx++)
+            {
+                int sx = xofs[dx];
+                row[dx] = (short)((src[sx]*alpha[dx*2] + src[sx+1]*alpha[dx*2+1]) >> 4);
+            }
+            for(; dx < dwidth; dx++)
+                row[dx] = (short)((src[xofs[dx]]*one) >> 4);
+            row_y[k] = y;
+        }
+        const short * r0 = rows[0];
+        const short * r1 = rows[1];
+        uchar * dst = (uchar*)(small->imageData + small->widthStep*dy);
+        for(int dx = 0; dx < dwidth; dx++)
+        {
+            short v = (short)((r0[dx]*beta0) >> 16) + (short)((r1[dx]*beta1) >> 16);
+            dst[dx] = cv::saturate_cast<uchar>((v + 2) >> 2);
+        }
+    }
+}
+
+static int FindRoot(int * parent, int i)
+{
+    while(parent[i] != i)
+    {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// the classes of cvSeqPartition with is_equal, numbered in the same order,
+// without its temporary storage
+static int PartitionRects(const CvRect * rects, int count, int * parent, int * labels)
+{
+    for(int i = 0; i < count; i++)
+        parent[i] = i;
+    for(int i = 0; i < count; i++)
+    {
+        for(int j = i + 1; j < count; j++)
+        {
+            if(is_equal(rects + i, rects + j, 0) || is_equal(rects + j, rects + i, 0))
+            {
+                int a = FindRoot(parent, i);
+                int b = FindRoot(parent, j);
+                if(a != b)
+                    parent[MAX(a, b)] = MIN(a, b);
+            }
+        }
+    }
+    int ncomp = 0;
+    for(int i = 0; i < count; i++)
+        labels[i] = -1;
+    for(int i = 0; i < count; i++)
+    {
+        int root = FindRoot(parent, i);
+        if(labels[root] < 0)
+            labels[root] = ncomp++;
+        labels[i] = labels[root];
+    }
+    return ncomp;
+}
 
 void myIntegral(const IplImage * image, IplImage *sumImage)
 {
@@ -207,52 +402,41 @@ void myIntegral(const IplImage * image, IplImage *sumImage)
 
 
 
-void UpdateCascade(MBLBPCascade * pCascade, IplImage *sum)
+void UpdateWorkspace(const MBLBPCascade * pCascade, MBLBPWorkspace * pWorkspace, IplImage *sum)
 {
     int step;
 
-    CV_FUNCNAME( "UpdateCascade" );
+    CV_FUNCNAME( "UpdateWorkspace" );
 
     __BEGIN__;
 
     if( !sum )
         CV_ERROR( CV_StsNullPtr, "Null integral image pointer" );
     
-    if( ! pCascade) 
+    if( ! pCascade || ! pWorkspace) 
         CV_ERROR( CV_StsNullPtr, "Invalid classifier cascade" );
     
-    step = sum->widthStep;
-    pCascade->sum_image_step = step;
+    step = sum->widthStep / sizeof(int);
+    if( pWorkspace->sum_image_step == step )
+        return;
+    pWorkspace->sum_image_step = step;
 
-    for(int i = 0; i < pCascade->count; i++)
     {
-        for(int j = 0; j < pCascade->stages[i].count; j++)
+        int * o = pWorkspace->offsets;
+        for(int i = 0; i < pCascade->count; i++)
         {
-            MBLBPWeak * pw =  pCascade->stages[i].weak_classifiers + j;
-            int x = pw->x;
-            int y = pw->y;
-            int w = pw->cellwidth;
-            int h = pw->cellheight;
-
-            pw->p[ 0] = (int*)(sum->imageData + y * step + (x      ) * sizeof(int));
-            pw->p[ 1] = (int*)(sum->imageData + y * step + (x + w  ) * sizeof(int));
-            pw->p[ 2] = (int*)(sum->imageData + y * step + (x + w*2) * sizeof(int));
-            pw->p[ 3] = (int*)(sum->imageData + y * step + (x + w*3) * sizeof(int));
-
-            pw->p[ 4] = (int*)(sum->imageData + (y+h) * step + (x      ) * sizeof(int));
-            pw->p[ 5] = (int*)(sum->imageData + (y+h) * step + (x + w  ) * sizeof(int));
-            pw->p[ 6] = (int*)(sum->imageData + (y+h) * step + (x + w*2) * sizeof(int));
-            pw->p[ 7] = (int*)(sum->imageData + (y+h) * step + (x + w*3) * sizeof(int));
-
-            pw->p[ 8] = (int*)(sum->imageData + (y+h*2) * step + (x      ) * sizeof(int));
-            pw->p[ 9] = (int*)(sum->imageData + (y+h*2) * step + (x + w  ) * sizeof(int));
-            pw->p[10] = (int*)(sum->imageData + (y+h*2) * step + (x + w*2) * sizeof(int));
-            pw->p[11] = (int*)(sum->imageData + (y+h*2) * step + (x + w*3) * sizeof(int));
-
-            pw->p[12] = (int*)(sum->imageData + (y+h*3) * step + (x      ) * sizeof(int));
-            pw->p[13] = (int*)(sum->imageData + (y+h*3) * step + (x + w  ) * sizeof(int));
-            pw->p[14] = (int*)(sum->imageData + (y+h*3) * step + (x + w*2) * sizeof(int));
-            pw->p[15] = (int*)(sum->imageData + (y+h*3) * step + (x + w*3) * sizeof(int));
+            for(int j = 0; j < pCascade->stages[i].count; j++, o += 16)
+            {
+                const MBLBPWeak * pw =  pCascade->stages[i].weak_classifiers + j;
+                int x = pw->x;
+                int y = pw->y;
+                int w = pw->cellwidth;
+                int h = pw->cellheight;
+
+                for(int r = 0; r < 4; r++)
+                    for(int c = 0; c < 4; c++)
+                        o[r*4 + c] = (y + h*r) * step + (x + w*c);
+            }
         }
     }
 
@@ -262,7 +446,7 @@ void UpdateCascade(MBLBPCascade * pCascade, IplImage *sum)
 
 
 
-inline int DetectAt(MBLBPCascade * pCascade, int offset)
+inline int DetectAt(const MBLBPCascade * pCascade, const int * offsets, const int * s)
 {
     if( !pCascade)
         return 0;
@@ -272,28 +456,28 @@ inline int DetectAt(MBLBPCascade * pCascade, int offset)
     {
         int stage_sum = 0;
         int code = 0;
-        int bit = 0;
 
-        MBLBPWeak * pw =  pCascade->stages[i].weak_classifiers;
+        const MBLBPWeak * pw =  pCascade->stages[i].weak_classifiers;
 
         for(int j = 0; j < pCascade->stages[i].count; j++)
         {
-            int ** p = pw->p;
+            const int * o = offsets;
 
-            int cval = MBLBP_CALC_SUM( p[5], p[6], p[9], p[10], offset );
+            int cval = MBLBP_CALC_SUM( s, o, 5, 6, 9, 10 );
 
-            code = ((MBLBP_CALC_SUM( p[0], p[1], p[4], p[5], offset ) >= cval ) << 7 ) |
-                ((MBLBP_CALC_SUM( p[1], p[2], p[5], p[6], offset ) >= cval ) << 6) | 
-                ((MBLBP_CALC_SUM( p[2], p[3], p[6], p[7], offset ) >= cval ) << 5) |
-                ((MBLBP_CALC_SUM( p[6], p[7], p[10], p[11], offset ) >= cval ) << 4) | 
-                ((MBLBP_CALC_SUM( p[10], p[11], p[14], p[15], offset ) >= cval ) << 3)| 
-                ((MBLBP_CALC_SUM( p[9], p[10], p[13], p[14], offset ) >= cval ) << 2)|  
-                ((MBLBP_CALC_SUM( p[8], p[9], p[12], p[13], offset ) >= cval ) << 1)|
-                ((MBLBP_CALC_SUM( p[4], p[5], p[8], p[9], offset ) >= cval )   );
+            code = ((MBLBP_CALC_SUM( s, o, 0, 1, 4, 5 ) >= cval ) << 7 ) |
+                ((MBLBP_CALC_SUM( s, o, 1, 2, 5, 6 ) >= cval ) << 6) | 
+                ((MBLBP_CALC_SUM( s, o, 2, 3, 6, 7 ) >= cval ) << 5) |
+                ((MBLBP_CALC_SUM( s, o, 6, 7, 10, 11 ) >= cval ) << 4) | 
+                ((MBLBP_CALC_SUM( s, o, 10, 11, 14, 15 ) >= cval ) << 3)| 
+                ((MBLBP_CALC_SUM( s, o, 9, 10, 13, 14 ) >= cval ) << 2)|  
+                ((MBLBP_CALC_SUM( s, o, 8, 9, 12, 13 ) >= cval ) << 1)|
+                ((MBLBP_CALC_SUM( s, o, 4, 5, 8, 9 ) >= cval )   );
 
 			stage_sum += pw->look_up_table[ MBLBP_LBPTABLE[code] ];
 
             pw++;
+            offsets += 16;
         }
 
         if(stage_sum < pCascade->stages[i].threshold)
@@ -306,13 +490,21 @@ inline int DetectAt(MBLBPCascade * pCascade, int offset)
 }
 
 
-void MBLBPDetectSingleScale( const IplImage* img,
-                             MBLBPCascade * pCascade,
+// rows scanned between two deadline checks
+#define MBLBP_DEADLINE_ROWS 8
+
+// returns 1 if the deadline stopped the scan, positions then holds the rows done so far
+int MBLBPDetectSingleScale( const IplImage* img,
+                             const MBLBPCascade * pCascade,
+                             MBLBPWorkspace * pWorkspace,
                              CvSeq * positions, 
-                             CvSize winStride)
+                             CvSize winStride,
+                             uint64_t deadline)
 {
-    IplImage * sum = 0;
+    IplImage sum_header;
+    IplImage * sum = &sum_header;
     int ystep, xstep, ymax, xmax;
+    int stopped = 0;
     
     CV_FUNCNAME( "MBLBPDetectSingleScale" );
 
@@ -330,14 +522,14 @@ void MBLBPDetectSingleScale( const IplImage* img,
 
     if(pCascade->win_width > img->width || 
        pCascade->win_height > img->height)
-        return ;
+        return 0;
 
 
 
-    CV_CALL( sum = cvCreateImage(cvSize(img->width, img->height), IPL_DEPTH_32S, 1));
+    InitWorkspaceImage(sum, cvSize(img->width, img->height), IPL_DEPTH_32S, &pWorkspace->sum_data, &pWorkspace->sum_capacity);
     myIntegral(img, sum);
     //cvIntegral(img, sum);
-    UpdateCascade(pCascade, sum);
+    UpdateWorkspace(pCascade, pWorkspace, sum);
 
     ystep = winStride.height;
     xstep = winStride.width;
@@ -350,10 +542,18 @@ void MBLBPDetectSingleScale( const IplImage* img,
 
 	for(int iy = 0; iy < ymax; iy+=ystep)
     {
+       // a racy flag under OpenMP, the remaining rows are skipped instead of broken out of
+       if( stopped )
+           continue;
+       if( deadline && (iy/ystep) % MBLBP_DEADLINE_ROWS == 0 && Metrics::now() >= deadline )
+       {
+           stopped = 1;
+           continue;
+       }
        for(int ix = 0; ix < xmax; ix+=xstep)
         {
             int w_offset = iy * sum->widthStep / sizeof(int) + ix;
-			int result = DetectAt(pCascade, w_offset);
+			int result = DetectAt(pCascade, pWorkspace->offsets, (const int*)sum->imageData + w_offset);
             if( result > 0)
             {
                 //since the integral image is different with that of OpenCV,
@@ -376,23 +576,34 @@ omp_unset_lock(&lock);
 
     __END__;
 
-    cvReleaseImage(&sum);
-    return ;
+    return stopped;
+}
+
+// the level scanned k-th when the scan has a deadline: from the middle of the
+// size range up to the largest faces, then down to the smallest, so that the
+// expensive small face levels are the ones left out
+static int LikelyLevel(int k, int levels)
+{
+    int mid = levels/2;
+    return k < levels - mid ? mid + k : levels - 1 - k;
 }
 
 CvSeq * MBLBPDetectMultiScale( const IplImage* img,
-                               MBLBPCascade * pCascade,
+                               const MBLBPCascade * pCascade,
                                CvMemStorage* storage, 
                                int scale_factor1024x,
                                int min_neighbors, 
                                int min_size,
-							   int max_size)
+							   int max_size,
+							   MBLBPWorkspace * workspace,
+							   uint64_t deadline,
+							   int * truncated)
 {
+    MBLBPWorkspace * temp_workspace = 0;
     IplImage stub;
     CvMat mat, *pmat;
     CvSeq* seq = 0;
     CvSeq* seq2 = 0;
-    CvSeq* idx_seq = 0;
     CvSeq* result_seq = 0;
     CvSeq* positions = 0;
     CvMemStorage* temp_storage = 0;
@@ -403,8 +614,14 @@ CvSeq * MBLBPDetectMultiScale( const IplImage* img,
     __BEGIN__;
 
     int factor1024x;
+    int factor1024x_min;
     int factor1024x_max;
     int coi;
+    uint64_t pyramid_ns = 0, scan_ns = 0, t0, t1;
+    int level = 0, levels = 0;
+
+    if( truncated )
+        *truncated = 0;
 
     if( ! pCascade) 
         CV_ERROR( CV_StsNullPtr, "Invalid classifier cascade" );
@@ -430,7 +647,13 @@ CvSeq * MBLBPDetectMultiScale( const IplImage* img,
 	if(max_size < min_size)
 		return NULL;
 
-	CV_CALL( temp_storage = cvCreateChildMemStorage( storage ));
+	if( !workspace )
+		workspace = temp_workspace = CreateMBLBPWorkspace(pCascade);
+
+	if( !workspace->storage )
+		CV_CALL( workspace->storage = cvCreateMemStorage( 0 ));
+	cvClearMemStorage( workspace->storage );
+	temp_storage = workspace->storage;
     seq = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvRect), temp_storage );
     seq2 = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvAvgComp), temp_storage );
     result_seq = cvCreateSeq( 0, sizeof(CvSeq), sizeof(CvAvgComp), storage );
@@ -439,32 +662,57 @@ CvSeq * MBLBPDetectMultiScale( const IplImage* img,
     if( min_neighbors == 0 )
         seq = result_seq;
 
-    factor1024x = ((min_size<<10)+(pCascade->win_width/2)) / pCascade->win_width;
+    factor1024x_min = ((min_size<<10)+(pCascade->win_width/2)) / pCascade->win_width;
 	factor1024x_max = (max_size<<10) / pCascade->win_width; //do not round it, to avoid the scan window be out of range
+    for( factor1024x = factor1024x_min; factor1024x <= factor1024x_max;
+         factor1024x = ((factor1024x*scale_factor1024x+512)>>10) )
+        levels++;
 
 #ifdef _OPENMP
 	omp_init_lock(&lock); 
 #endif
-    for( ; factor1024x <= factor1024x_max;
-         factor1024x = ((factor1024x*scale_factor1024x+512)>>10) )
+    for( int k = 0; k < levels; k++ )
     {
-        IplImage * pSmallImage = cvCreateImage( cvSize( ((img->width<<10)+factor1024x/2)/factor1024x, ((img->height<<10)+factor1024x/2)/factor1024x),
-                                                IPL_DEPTH_8U, 1);
+        // without a deadline the levels go from the smallest faces up, as they always did
+        level = deadline ? LikelyLevel(k, levels) : k;
+        if( deadline && Metrics::now() >= deadline )
+        {
+            if( truncated )
+                *truncated = 1;
+            break;
+        }
+        factor1024x = factor1024x_min;
+        for( int i = 0; i < level; i++ )
+            factor1024x = ((factor1024x*scale_factor1024x+512)>>10);
+
+        IplImage small_header;
+        IplImage * pSmallImage = &small_header;
+        InitWorkspaceImage(pSmallImage, cvSize( ((img->width<<10)+factor1024x/2)/factor1024x, ((img->height<<10)+factor1024x/2)/factor1024x),
+                           IPL_DEPTH_8U, &workspace->small_data, &workspace->small_capacity);
+        t0 = Metrics::now();
         try{
-			cvResize(img, pSmallImage);
+			ResizeLevel(img, pSmallImage, workspace);
 		}
 		catch(...)
 		{
-			cvReleaseImage(&pSmallImage);
+			ReleaseMBLBPWorkspace(&temp_workspace);
 			return NULL;
 		}
-		
+		t1 = Metrics::now();
+		pyramid_ns += t1 - t0;
+		if (Trace::enabled())
+			Trace::span("pyramid", t0, t1, level);
 		
         CvSize winStride = cvSize( (factor1024x<=2048)+1,  (factor1024x<=2048)+1 );
 
 		cvClearSeq(positions);
 
-        MBLBPDetectSingleScale( pSmallImage, pCascade, positions, winStride);
+        t0 = Metrics::now();
+        int stopped = MBLBPDetectSingleScale( pSmallImage, pCascade, workspace, positions, winStride, deadline);
+        t1 = Metrics::now();
+        scan_ns += t1 - t0;
+        if (Trace::enabled())
+            Trace::span("scan", t0, t1, level);
 
         for(int i=0; i < (positions ? positions->total : 0); i++)
         {
@@ -476,25 +724,40 @@ CvSeq * MBLBPDetectMultiScale( const IplImage* img,
 
             cvSeqPush(seq, &r);
         }
-
-        cvReleaseImage(&pSmallImage);
+        // the rows scanned so far are kept, they are grouped with the other levels
+        if( stopped )
+        {
+            if( truncated )
+                *truncated = 1;
+            break;
+        }
     }
 #ifdef _OPENMP
 	omp_destroy_lock(&lock); 
 #endif
+    Metrics::record(MPYRAMID, pyramid_ns);
+    Metrics::record(MSCAN, scan_ns);
   
     if( min_neighbors != 0 )
     {
+        t0 = Metrics::now();
         // group retrieved rectangles in order to filter out noise 
-        int ncomp = cvSeqPartition( seq, 0, &idx_seq, (CvCmpFunc)is_equal, 0 );
-        CV_CALL( comps = (CvAvgComp*)cvAlloc( (ncomp+1)*sizeof(comps[0])));
+        int total = seq->total;
+        uchar * group = ReserveBuffer(&workspace->group_data, &workspace->group_capacity, 
+                                      total*(sizeof(CvRect) + 2*sizeof(int)) + (total+1)*sizeof(CvAvgComp));
+        CvRect * rects = (CvRect*)group;
+        int * parent = (int*)(rects + total);
+        int * labels = parent + total;
+        comps = (CvAvgComp*)(labels + total);
+        cvCvtSeqToArray( seq, rects );
+        int ncomp = PartitionRects( rects, total, parent, labels );
         memset( comps, 0, (ncomp+1)*sizeof(comps[0]));
 
         // count number of neighbors
-        for(int i = 0; i < seq->total; i++ )
+        for(int i = 0; i < total; i++ )
         {
-            CvRect r1 = *(CvRect*)cvGetSeqElem( seq, i );
-            int idx = *(int*)cvGetSeqElem( idx_seq, i );
+            CvRect r1 = rects[i];
+            int idx = labels[i];
             assert( (unsigned)idx < (unsigned)ncomp );
 
             comps[idx].neighbors++;
@@ -551,13 +814,14 @@ CvSeq * MBLBPDetectMultiScale( const IplImage* img,
                 /* cvSeqPush( result_seq, &r1.rect ); */
             }
         }
+        Metrics::observe(MGROUPING, t0);
     }   
 
 
     __END__;
 
-    cvReleaseMemStorage( &temp_storage );
-    cvFree( &comps );
+    // the buffers stay with the workspace, unless it was a temporary one
+    ReleaseMBLBPWorkspace( &temp_workspace );
 
     return result_seq;
 }
@@ -2,6 +2,7 @@
 #define __MBLBP_DETECT__
 
 #include <opencv/cv.h>
+#include <stdint.h>
 
 #ifdef _OPENMP
 #include <omp.h>
@@ -13,7 +14,6 @@ typedef struct MBLBPWeak_
     int y;
     int cellwidth;
     int cellheight;
-    int* p[16]; // fast pointer
     int look_up_table[59]; // look up table
 } MBLBPWeak;
 
@@ -29,18 +29,43 @@ typedef struct MBLBPCascade_
     int count;
     int win_width;
     int win_height;
-    int sum_image_step;
     MBLBPStage * stages;
 } MBLBPCascade;
 
+// Per-caller scan state, so that a loaded cascade is never written to and
+// can be shared between detectors and threads.
+typedef struct MBLBPWorkspace_
+{
+    int count; // number of weak classifiers in the cascade
+    int sum_image_step; // integral image step the offsets were computed for
+    int * offsets; // 16 integral image offsets per weak classifier
+    // buffers kept from image to image, grown to the largest image scanned
+    uchar * small_data; // pyramid level
+    size_t small_capacity;
+    uchar * resize_data; // column offsets, weights and filtered rows of the pyramid resize
+    size_t resize_capacity;
+    uchar * sum_data; // integral image of the level
+    size_t sum_capacity;
+    CvMemStorage * storage; // candidate sequences, cleared for every image
+    uchar * group_data; // candidate rectangles, labels and components for grouping
+    size_t group_capacity;
+} MBLBPWorkspace;
+
 MBLBPCascade * LoadMBLBPCascade(const char * filename );
 void ReleaseMBLBPCascade(MBLBPCascade ** ppCascade);
+size_t MBLBPCascadeSize(const MBLBPCascade * pCascade);
+
+MBLBPWorkspace * CreateMBLBPWorkspace(const MBLBPCascade * pCascade);
+void ReleaseMBLBPWorkspace(MBLBPWorkspace ** ppWorkspace);
 
 CvSeq * MBLBPDetectMultiScale( const IplImage* img, //ͼ
-                               MBLBPCascade * pCascade, //
+                               const MBLBPCascade * pCascade, //
                                CvMemStorage* storage, //ڴ
                                int scale_factor1024x, //ɨ贰ϵǸ10241.1˴ӦΪ1024*1.1=1126
                                int min_neighbors, //С
                                int min_size, //Сɨ贰ڴСڿȣ
-							   int max_size=0); //ɨ贰ڴСڿȣ
+							   int max_size=0, //ɨ贰ڴСڿȣ
+							   MBLBPWorkspace * workspace=NULL, //ɨ蹤ΪNULLʱʱ
+							   uint64_t deadline=0, //ֹʱ䣨Metrics::now()0ΪޣнֹʱʱɨеȺʹߴ
+							   int * truncated=NULL); //ֹʱδɨг߶ʱΪ1صɨ貿ֵĽ
 #endif
@@ -0,0 +1,173 @@
+#include "metrics.h"
+#include "trace.h"
+#include <time.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+struct MetricValues{
+	StageHistogram stages[MSTAGES];
+	uint64_t counters[EEVENTS];
+};
+
+static MetricValues processValues;
+//where updates go, processValues or the mapping made by share
+static MetricValues* values = &processValues;
+static MetricValues* sharedValues = NULL;
+
+static const char* stageNames[MSTAGES] = {"decode", "gray", "pyramid", "scan", "grouping", "verify", "gate", "landmark", "pose", "align"};
+static const char* eventNames[EEVENTS] = {"images", "decode_failed", "no_face", "multiple_faces", "false_positive", "verify_rejected", "landmark_failed", "out_of_bound", "track_lost", "cache_hit", "cache_disk_hit", "cache_miss", "truncated", "gate_small", "gate_blurred", "gate_weak", "gate_exposure", "gate_missed", "gate_confirmed"};
+
+uint64_t Metrics::now(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+void Metrics::observe(int stage, uint64_t begin){
+	uint64_t end = now();
+	record(stage, end - begin);
+	if (Trace::enabled() && stage >= 0 && stage < MSTAGES)
+		Trace::span(stageNames[stage], begin, end);
+}
+
+void Metrics::record(int stage, uint64_t nanos){
+	if (stage < 0 || stage >= MSTAGES)
+		return;
+	int bucket = 0;
+	for (uint64_t us = nanos/1000; us > 0 && bucket < METRIC_BUCKETS - 1; us >>= 1)
+		bucket++;
+	StageHistogram& h = values->stages[stage];
+	__sync_fetch_and_add(&h.buckets[bucket], 1);
+	__sync_fetch_and_add(&h.nanos, nanos);
+	__sync_fetch_and_add(&h.count, 1);
+}
+
+void Metrics::count(int event, uint64_t n){
+	if (event >= 0 && event < EEVENTS)
+		__sync_fetch_and_add(&values->counters[event], n);
+}
+
+void Metrics::histogram(int stage, StageHistogram& out){
+	memset(&out, 0, sizeof(out));
+	if (stage < 0 || stage >= MSTAGES)
+		return;
+	out.count = __atomic_load_n(&values->stages[stage].count, __ATOMIC_RELAXED);
+	out.nanos = __atomic_load_n(&values->stages[stage].nanos, __ATOMIC_RELAXED);
+	for (int i = 0; i < METRIC_BUCKETS; i++)
+		out.buckets[i] = __atomic_load_n(&values->stages[stage].buckets[i], __ATOMIC_RELAXED);
+}
+
+uint64_t Metrics::events(int event){
+	if (event < 0 || event >= EEVENTS)
+		return 0;
+	return __atomic_load_n(&values->counters[event], __ATOMIC_RELAXED);
+}
+
+const char* Metrics::stageName(int stage){
+	return stage >= 0 && stage < MSTAGES ? stageNames[stage] : "unknown";
+}
+
+const char* Metrics::eventName(int event){
+	return event >= 0 && event < EEVENTS ? eventNames[event] : "unknown";
+}
+
+//upper bound of bucket i in seconds
+static double bucketBound(int i){
+	return (double)((uint64_t)1 << i)/1000000;
+}
+
+double Metrics::quantile(int stage, double q){
+	StageHistogram h;
+	histogram(stage, h);
+	uint64_t total = 0;
+	for (int i = 0; i < METRIC_BUCKETS; i++)
+		total += h.buckets[i];
+	if (total == 0)
+		return 0;
+	uint64_t rank = (uint64_t)(q*total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	uint64_t seen = 0;
+	for (int i = 0; i < METRIC_BUCKETS; i++){
+		seen += h.buckets[i];
+		if (seen >= rank)
+			return bucketBound(i);
+	}
+	return bucketBound(METRIC_BUCKETS - 1);
+}
+
+void Metrics::reset(){
+	for (int s = 0; s < MSTAGES; s++){
+		__atomic_store_n(&values->stages[s].count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&values->stages[s].nanos, 0, __ATOMIC_RELAXED);
+		for (int i = 0; i < METRIC_BUCKETS; i++)
+			__atomic_store_n(&values->stages[s].buckets[i], 0, __ATOMIC_RELAXED);
+	}
+	for (int e = 0; e < EEVENTS; e++)
+		__atomic_store_n(&values->counters[e], 0, __ATOMIC_RELAXED);
+}
+
+bool Metrics::share(){
+	if (sharedValues == NULL){
+		void* mapped = mmap(NULL, sizeof(MetricValues), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+		if (mapped == MAP_FAILED)
+			return false;
+		sharedValues = (MetricValues*)mapped;
+		memcpy(sharedValues, values, sizeof(MetricValues));
+	}
+	values = sharedValues;
+	return true;
+}
+
+void Metrics::unshare(){
+	values = &processValues;
+}
+
+void Metrics::scrape(ostream& out){
+	char line[160];
+	out<<"# TYPE kbdetect_stage_seconds histogram\n";
+	for (int s = 0; s < MSTAGES; s++){
+		StageHistogram h;
+		histogram(s, h);
+		uint64_t cumulative = 0;
+		for (int i = 0; i < METRIC_BUCKETS - 1; i++){
+			cumulative += h.buckets[i];
+			snprintf(line, sizeof(line), "kbdetect_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", 
+				stageNames[s], bucketBound(i), (unsigned long long)cumulative);
+			out<<line;
+		}
+		cumulative += h.buckets[METRIC_BUCKETS - 1];
+		snprintf(line, sizeof(line), "kbdetect_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stageNames[s], (unsigned long long)cumulative);
+		out<<line;
+		snprintf(line, sizeof(line), "kbdetect_stage_seconds_sum{stage=\"%s\"} %.9f\n", stageNames[s], h.nanos/1e9);
+		out<<line;
+		snprintf(line, sizeof(line), "kbdetect_stage_seconds_count{stage=\"%s\"} %llu\n", stageNames[s], (unsigned long long)h.count);
+		out<<line;
+	}
+	out<<"# TYPE kbdetect_events_total counter\n";
+	for (int e = 0; e < EEVENTS; e++){
+		snprintf(line, sizeof(line), "kbdetect_events_total{event=\"%s\"} %llu\n", eventNames[e], (unsigned long long)events(e));
+		out<<line;
+	}
+}
+
+void Metrics::report(ostream& out){
+	char line[160];
+	snprintf(line, sizeof(line), "%-10s %10s %12s %12s %12s %12s\n", "stage", "count", "mean(s)", "p50<=(s)", "p95<=(s)", "p99<=(s)");
+	out<<line;
+	for (int s = 0; s < MSTAGES; s++){
+		StageHistogram h;
+		histogram(s, h);
+		if (h.count == 0)
+			continue;
+		snprintf(line, sizeof(line), "%-10s %10llu %12.6f %12.6f %12.6f %12.6f\n", stageNames[s], (unsigned long long)h.count,
+			h.nanos/1e9/h.count, quantile(s, 0.5), quantile(s, 0.95), quantile(s, 0.99));
+		out<<line;
+	}
+	for (int e = 0; e < EEVENTS; e++){
+		snprintf(line, sizeof(line), "%-16s %10llu\n", eventNames[e], (unsigned long long)events(e));
+		out<<line;
+	}
+	out.flush();
+}
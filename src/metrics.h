@@ -0,0 +1,54 @@
+#ifndef __DETECT_METRICS_H__
+#define __DETECT_METRICS_H__
+
+#include <stdint.h>
+#include <iostream>
+
+using namespace std;
+
+enum METRIC_STAGE {MDECODE, MGRAY, MPYRAMID, MSCAN, MGROUPING, MVERIFY, MGATE, MLANDMARK, MPOSE, MALIGN, MSTAGES};
+enum METRIC_EVENT {EIMAGES, EDECODE_FAILED, ENO_FACE, EMULTIPLE_FACES, EFALSE_POSITIVE, EVERIFY_REJECTED, ELANDMARK_FAILED, EOUT_OF_BOUND, ETRACK_LOST, ECACHE_HIT, ECACHE_DISK_HIT, ECACHE_MISS, ETRUNCATED, EGATE_SMALL, EGATE_BLURRED, EGATE_WEAK, EGATE_EXPOSURE, EGATE_MISSED, EGATE_CONFIRMED, EEVENTS};
+
+//bucket i counts latencies below 2^i microseconds, the last one everything above
+#define METRIC_BUCKETS 25
+
+struct StageHistogram{
+	uint64_t count;
+	uint64_t nanos;
+	uint64_t buckets[METRIC_BUCKETS];
+};
+
+//Process-wide latency histograms per detection stage and outcome counters.
+//Updates are single atomic adds, so any thread may record at any time;
+//readers see each value consistently but not a snapshot across values.
+//After share, processes forked later add into the same values.
+class Metrics{
+	public:
+		//monotonic clock in nanoseconds
+		static uint64_t now();
+		//records now() - begin for stage, and a trace span when tracing
+		static void observe(int stage, uint64_t begin);
+		static void record(int stage, uint64_t nanos);
+		static void count(int event, uint64_t n = 1);
+		
+		static void histogram(int stage, StageHistogram& out);
+		static uint64_t events(int event);
+		static const char* stageName(int stage);
+		static const char* eventName(int event);
+		//upper bound of the bucket holding quantile q (0..1) of stage, in seconds
+		static double quantile(int stage, double q);
+		static void reset();
+		//moves the values into shared memory, kept by processes forked from now on, which
+		//then record and scrape the totals of them all. call before threads record.
+		//false if the memory cannot be mapped, the values stay per process
+		static bool share();
+		//back to this process' own values, for work the totals should not count
+		static void unshare();
+		
+		//Prometheus text exposition format
+		static void scrape(ostream& out);
+		//one line per stage and event, for people
+		static void report(ostream& out);
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include "model-registry.h"
+#include "haar-binary.h"
+#include <map>
+#include <pthread.h>
+
+namespace {
+
+//gives access to the model matrices to account for their size
+class SharedFaceAlignment : public FaceAlignment{
+	public:
+		SharedFaceAlignment(const char* detectionModel, const char* trackingModel, XXDescriptor* xxd)
+			: FaceAlignment(detectionModel, trackingModel, xxd), descriptor(xxd){}
+		~SharedFaceAlignment(){
+			delete descriptor;
+		}
+		size_t modelBytes() const{
+			size_t bytes = sizeof(*this) + matBytes(m_w) + matBytes(m_meanShape2D);
+			bytes += matBytes(m_DR) + matBytes(m_Db) + matBytes(m_TR) + matBytes(m_Tb);
+			return bytes;
+		}
+	private:
+		XXDescriptor* descriptor;
+		static size_t matBytes(const cv::Mat& m){
+			return m.total()*m.elemSize();
+		}
+		static size_t matBytes(const vector<cv::Mat>& v){
+			size_t bytes = 0;
+			for (unsigned int i = 0; i < v.size(); i++)
+				bytes += matBytes(v[i]);
+			return bytes;
+		}
+};
+
+struct ModelEntry{
+	ModelInfo info;
+	void* model;
+};
+
+pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+map<string, ModelEntry> registry;
+
+const char* kindName(MODEL_KIND kind){
+	switch (kind){
+		case MCONFIG: return "config";
+		case MMBLBP: return "mblbp";
+		case MHAAR: return "haar";
+		case MINTRAFACE: return "intraface";
+	}
+	return "unknown";
+}
+
+void* load(MODEL_KIND kind, const string& path, const string& extra, size_t& bytes){
+	bytes = 0;
+	if (kind == MCONFIG){
+		DetectorConfig* config = new DetectorConfig();
+		if (!LoadDetectorConfig(path.data(), *config)){
+			delete config;
+			return NULL;
+		}
+		bytes = sizeof(DetectorConfig);
+		return config;
+	}
+	else if (kind == MMBLBP){
+		MBLBPCascade* cascade = LoadMBLBPCascade(path.data());
+		bytes = MBLBPCascadeSize(cascade);
+		return cascade;
+	}
+	else if (kind == MHAAR){
+		CvHaarClassifierCascade* cascade = LoadHaarCascade(path.data());
+		bytes = HaarCascadeSize(cascade);
+		return cascade;
+	}
+	SharedFaceAlignment* alignment = new SharedFaceAlignment(path.data(), extra.data(), new XXDescriptor(4));
+	if (!alignment->Initialized()){
+		delete alignment;
+		return NULL;
+	}
+	bytes = alignment->modelBytes();
+	return alignment;
+}
+
+void unload(MODEL_KIND kind, void* model){
+	if (kind == MCONFIG){
+		delete (DetectorConfig*)model;
+	}
+	else if (kind == MMBLBP){
+		MBLBPCascade* cascade = (MBLBPCascade*)model;
+		ReleaseMBLBPCascade(&cascade);
+	}
+	else if (kind == MHAAR){
+		CvHaarClassifierCascade* cascade = (CvHaarClassifierCascade*)model;
+		cvReleaseHaarClassifierCascade(&cascade);
+	}
+	else{
+		delete (SharedFaceAlignment*)model;
+	}
+}
+
+void* acquire(MODEL_KIND kind, const string& path, const string& extra = ""){
+	string key = string(kindName(kind)) + ":" + path;
+	if (!extra.empty())
+		key += "+" + extra;
+	
+	pthread_mutex_lock(&registryLock);
+	map<string, ModelEntry>::iterator it = registry.find(key);
+	if (it != registry.end()){
+		it->second.info.refs++;
+		void* model = it->second.model;
+		pthread_mutex_unlock(&registryLock);
+		return model;
+	}
+	//loading under the lock keeps concurrent first users from loading twice
+	ModelEntry entry;
+	entry.model = load(kind, path, extra, entry.info.bytes);
+	if (entry.model != NULL){
+		entry.info.path = extra.empty() ? path : path + "+" + extra;
+		entry.info.kind = kind;
+		entry.info.refs = 1;
+		registry[key] = entry;
+	}
+	pthread_mutex_unlock(&registryLock);
+	return entry.model;
+}
+
+}
+
+const DetectorConfig* ModelRegistry::acquireConfig(const string& filename){
+	return (const DetectorConfig*)acquire(MCONFIG, filename);
+}
+
+const MBLBPCascade* ModelRegistry::acquireMBLBP(const string& filename){
+	return (const MBLBPCascade*)acquire(MMBLBP, filename);
+}
+
+const CvHaarClassifierCascade* ModelRegistry::acquireHaar(const string& filename){
+	return (const CvHaarClassifierCascade*)acquire(MHAAR, filename);
+}
+
+const FaceAlignment* ModelRegistry::acquireAlignment(const string& detectionModel, const string& trackingModel){
+	return (const FaceAlignment*)(SharedFaceAlignment*)acquire(MINTRAFACE, detectionModel, trackingModel);
+}
+
+void ModelRegistry::release(const void* model){
+	if (model == NULL)
+		return;
+	pthread_mutex_lock(&registryLock);
+	for (map<string, ModelEntry>::iterator it = registry.begin(); it != registry.end(); ++it){
+		if (it->second.model == model){
+			if (--it->second.info.refs == 0){
+				unload(it->second.info.kind, it->second.model);
+				registry.erase(it);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&registryLock);
+}
+
+void ModelRegistry::list(vector<ModelInfo>& models){
+	models.clear();
+	pthread_mutex_lock(&registryLock);
+	for (map<string, ModelEntry>::iterator it = registry.begin(); it != registry.end(); ++it){
+		models.push_back(it->second.info);
+	}
+	pthread_mutex_unlock(&registryLock);
+}
+
+size_t ModelRegistry::memoryUsage(){
+	vector<ModelInfo> models;
+	list(models);
+	size_t bytes = 0;
+	for (unsigned int i = 0; i < models.size(); i++)
+		bytes += models[i].bytes;
+	return bytes;
+}
+
+void ModelRegistry::report(ostream& out){
+	vector<ModelInfo> models;
+	list(models);
+	size_t total = 0;
+	for (unsigned int i = 0; i < models.size(); i++){
+		out<<kindName(models[i].kind)<<" "<<models[i].path<<": "<<models[i].bytes/1024<<" KB, "<<models[i].refs<<" references"<<endl;
+		total += models[i].bytes;
+	}
+	out<<"Models use "<<total/1024<<" KB"<<endl;
+}
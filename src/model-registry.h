@@ -0,0 +1,43 @@
+#ifndef __MODEL_REGISTRY_H__
+#define __MODEL_REGISTRY_H__
+
+#include <opencv2/objdetect/objdetect.hpp>
+#include <FaceAlignment.h>
+#include <string>
+#include <vector>
+#include <iostream>
+#include "config.h"
+#include "mblbp-detect.h"
+
+using namespace std;
+using namespace INTRAFACE;
+
+enum MODEL_KIND {MCONFIG, MMBLBP, MHAAR, MINTRAFACE};
+
+struct ModelInfo{
+	string path;
+	MODEL_KIND kind;
+	int refs;
+	size_t bytes;
+};
+
+//Process-wide cache of read-only models, keyed by path. Each model is loaded
+//by the first acquire, shared by every later one and freed when the last
+//reference is released. Returned models must not be modified: the Haar
+//cascade has to be cloned and the FaceAlignment copy-constructed (which
+//shares its matrices) before use.
+class ModelRegistry{
+	public:
+		static const DetectorConfig* acquireConfig(const string& filename);
+		static const MBLBPCascade* acquireMBLBP(const string& filename);
+		static const CvHaarClassifierCascade* acquireHaar(const string& filename);
+		static const FaceAlignment* acquireAlignment(const string& detectionModel, const string& trackingModel);
+		static void release(const void* model);
+		
+		static void list(vector<ModelInfo>& models);
+		//total bytes held by the registry
+		static size_t memoryUsage();
+		static void report(ostream& out);
+};
+
+#endif
@@ -0,0 +1,88 @@
+#include "npy-writer.h"
+#include <string.h>
+
+#define NPY_MAGIC "\x93NUMPY"
+//the count is written right aligned in this many characters, so that close
+//can rewrite it in place; numpy reads the shape with surrounding spaces
+#define NPY_COUNT_WIDTH 20
+
+NpyWriter::NpyWriter(){
+	file = NULL;
+	itemBytes = 0;
+	raw = false;
+	ok = false;
+	items = 0;
+}
+
+NpyWriter::~NpyWriter(){
+	close();
+}
+
+bool NpyWriter::open(const string& filename, const char* descr, const vector<int>& itemShape, bool raw){
+	close();
+	this->descr = descr;
+	this->itemShape = itemShape;
+	this->raw = raw;
+	items = 0;
+	itemBytes = strstr(descr, "f4") != NULL ? 4 : 1;
+	for (size_t i = 0; i < itemShape.size(); i++)
+		itemBytes *= itemShape[i];
+	file = fopen(filename.data(), "wb");
+	if (file == NULL){
+		fprintf(stderr, "Cannot write %s\n", filename.data());
+		return false;
+	}
+	ok = raw || writeHeader();
+	return ok;
+}
+
+//format 1.0: magic, version, little endian header length, then the header
+//dict padded with spaces and a newline so that the data starts 64 byte aligned
+bool NpyWriter::writeHeader(){
+	char count[NPY_COUNT_WIDTH + 1];
+	snprintf(count, sizeof(count), "%*lld", NPY_COUNT_WIDTH, (long long)items);
+	string dict = string("{'descr': '") + descr + "', 'fortran_order': False, 'shape': (" + count;
+	for (size_t i = 0; i < itemShape.size(); i++){
+		char dim[16];
+		snprintf(dim, sizeof(dim), ", %d", itemShape[i]);
+		dict += dim;
+	}
+	dict += itemShape.empty() ? ",), }" : "), }";
+	size_t total = 10 + dict.size() + 1;
+	dict.append((64 - total%64)%64, ' ');
+	dict += '\n';
+
+	unsigned char preamble[10];
+	memcpy(preamble, NPY_MAGIC, 6);
+	preamble[6] = 1;
+	preamble[7] = 0;
+	preamble[8] = dict.size() & 0xFF;
+	preamble[9] = dict.size() >> 8;
+	return fseek(file, 0, SEEK_SET) == 0 && fwrite(preamble, 1, sizeof(preamble), file) == sizeof(preamble) &&
+		fwrite(dict.data(), 1, dict.size(), file) == dict.size();
+}
+
+bool NpyWriter::write(const void* data, int items){
+	if (file == NULL || !ok)
+		return false;
+	if (items > 0 && fwrite(data, itemBytes, items, file) != (size_t)items)
+		ok = false;
+	else
+		this->items += items;
+	return ok;
+}
+
+bool NpyWriter::close(){
+	if (file == NULL)
+		return ok;
+	if (ok && !raw)
+		ok = writeHeader();
+	if (fclose(file) != 0)
+		ok = false;
+	file = NULL;
+	return ok;
+}
+
+int64_t NpyWriter::count(){
+	return items;
+}
@@ -0,0 +1,43 @@
+#ifndef __NPY_WRITER_H__
+#define __NPY_WRITER_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//Streams an array to disk one block of items at a time, for offline jobs that
+//write more than fits in memory. The array is count x item shape, count
+//grows with every write. As .npy (format 1.0) the header reserves room for
+//the count and close writes it, so numpy.load reads the file as it is, with
+//numpy.load(name, mmap_mode='r') it is not even read into memory. Raw files
+//are the bare bytes in the same order.
+class NpyWriter{
+	public:
+		NpyWriter();
+		~NpyWriter();
+
+		//descr is the numpy type, "|u1" or "<f4"; raw leaves out the header
+		bool open(const string& filename, const char* descr, const vector<int>& itemShape, bool raw = false);
+		//items of the item shape, contiguous
+		bool write(const void* data, int items);
+		//writes the final count into the header, false if anything failed
+		bool close();
+		int64_t count();
+	private:
+		FILE* file;
+		string descr;
+		vector<int> itemShape;
+		size_t itemBytes;
+		bool raw;
+		bool ok;
+		int64_t items;
+
+		NpyWriter(const NpyWriter&);
+		NpyWriter& operator=(const NpyWriter&);
+		bool writeHeader();
+};
+
+#endif
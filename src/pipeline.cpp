@@ -0,0 +1,172 @@
+#include "pipeline.h"
+#include "metrics.h"
+#include "trace.h"
+#include <cstdio>
+#include <cstdlib>
+
+DetectPipeline::Item::Item(long id, const BatchInput& input) : input(input){
+	this->id = id;
+	started = 0;
+	failed = false;
+}
+
+DetectPipeline::DetectPipeline(const char* cfgname, const DetectOptions& options, int decoders, int detectors, int markers, int queueSize)
+	: options(options), decodeQueue(queueSize), detectQueue(queueSize), markQueue(queueSize), resultQueue(queueSize){
+	decoders = decoders < 1 ? 1 : decoders;
+	detectors = detectors < 1 ? 1 : detectors;
+	markers = markers < 1 ? 1 : markers;
+	nextId = 0;
+	closed = false;
+	decodersLeft = decoders;
+	detectorsLeft = detectors;
+	markersLeft = markers;
+	
+	decodeWorkers.resize(decoders);
+	detectWorkers.resize(detectors);
+	markWorkers.resize(markers);
+	for (int i = 0; i < detectors; i++)
+		detectWorkers[i].detector = new Detector(cfgname);
+	for (int i = 0; i < markers; i++)
+		markWorkers[i].detector = new Detector(cfgname);
+	//readFile, decodeImage and toGray keep no state, any detector will do
+	for (int i = 0; i < decoders; i++)
+		decodeWorkers[i].detector = detectWorkers[0].detector;
+	
+	start(decodeWorkers, this, decodeStage);
+	start(detectWorkers, this, detectStage);
+	start(markWorkers, this, markStage);
+}
+
+DetectPipeline::~DetectPipeline(){
+	close();
+	//stages blocked on a full result queue need it drained before they can finish
+	PipelineResult result;
+	while (next(result))
+		;
+	for (size_t i = 0; i < decodeWorkers.size(); i++)
+		pthread_join(decodeWorkers[i].thread, NULL);
+	for (size_t i = 0; i < detectWorkers.size(); i++){
+		pthread_join(detectWorkers[i].thread, NULL);
+		delete detectWorkers[i].detector;
+	}
+	for (size_t i = 0; i < markWorkers.size(); i++){
+		pthread_join(markWorkers[i].thread, NULL);
+		delete markWorkers[i].detector;
+	}
+}
+
+void DetectPipeline::start(vector<Worker>& workers, DetectPipeline* pipeline, void* (*stage)(void*)){
+	for (size_t i = 0; i < workers.size(); i++){
+		workers[i].pipeline = pipeline;
+		if (pthread_create(&workers[i].thread, NULL, stage, &workers[i]) != 0){
+			fprintf(stderr, "Cannot start pipeline thread.\n");
+			exit(1);
+		}
+	}
+}
+
+long DetectPipeline::submit(const BatchInput& input){
+	if (closed)
+		return -1;
+	Item* item = new Item(nextId++, input);
+	decodeQueue.push(item);
+	return item->id;
+}
+
+long DetectPipeline::trySubmit(const BatchInput& input){
+	if (closed)
+		return -1;
+	Item* item = new Item(nextId, input);
+	if (!decodeQueue.tryPush(item)){
+		delete item;
+		return -1;
+	}
+	return nextId++;
+}
+
+void DetectPipeline::close(){
+	if (!closed){
+		closed = true;
+		decodeQueue.close();
+	}
+}
+
+bool DetectPipeline::next(PipelineResult& result){
+	Item* item;
+	if (!resultQueue.pop(item))
+		return false;
+	result.id = item->id;
+	result.result = item->result;
+	delete item;
+	return true;
+}
+
+void* DetectPipeline::decodeStage(void* worker){
+	Worker* self = (Worker*)worker;
+	DetectPipeline* pipeline = self->pipeline;
+	vector<uchar> buffer;
+	Item* item;
+	
+	while (pipeline->decodeQueue.pop(item)){
+		Trace::setImage((int)item->id);
+		item->started = Metrics::now();
+		const BatchInput& input = item->input;
+		bool decoded;
+		if (input.data != NULL){
+			decoded = self->detector->decodeImage(input.data, input.size, item->frame);
+		}
+		else{
+			//the read buffer is kept for the next file
+			decoded = self->detector->readFile(input.filename, buffer) &&
+				self->detector->decodeImage(&buffer[0], buffer.size(), item->frame);
+		}
+		if (decoded)
+			self->detector->toGray(item->frame, PIX_BGR, item->gray);
+		item->failed = !decoded;
+		pipeline->detectQueue.push(item);
+	}
+	if (__sync_sub_and_fetch(&pipeline->decodersLeft, 1) == 0)
+		pipeline->detectQueue.close();
+	return NULL;
+}
+
+void* DetectPipeline::detectStage(void* worker){
+	Worker* self = (Worker*)worker;
+	DetectPipeline* pipeline = self->pipeline;
+	Item* item;
+	
+	while (pipeline->detectQueue.pop(item)){
+		Trace::setImage((int)item->id);
+		if (!item->failed){
+			Metrics::count(EIMAGES);
+			const DetectOptions& options = pipeline->options;
+			uint64_t deadline = options.budget > 0 ? item->started + (uint64_t)(options.budget*1e9) : 0;
+			item->failed = !self->detector->findFace(item->gray, item->result.face, MergeScanParams(self->detector->config->scan, options.scan), deadline, &item->result.truncated, &item->result.neighbors);
+			if (item->result.truncated)
+				Metrics::count(ETRUNCATED);
+		}
+		pipeline->markQueue.push(item);
+	}
+	if (__sync_sub_and_fetch(&pipeline->detectorsLeft, 1) == 0)
+		pipeline->markQueue.close();
+	return NULL;
+}
+
+void* DetectPipeline::markStage(void* worker){
+	Worker* self = (Worker*)worker;
+	DetectPipeline* pipeline = self->pipeline;
+	Item* item;
+	
+	while (pipeline->markQueue.pop(item)){
+		Trace::setImage((int)item->id);
+		if (!item->failed)
+			item->result.found = self->detector->finishFace(item->frame, item->gray, PIX_BGR, true, pipeline->options, item->result);
+		//the result keeps what it needs
+		item->gray.release();
+		item->frame.release();
+		pipeline->resultQueue.push(item);
+	}
+	if (__sync_sub_and_fetch(&pipeline->markersLeft, 1) == 0)
+		pipeline->resultQueue.close();
+	return NULL;
+}
@@ -0,0 +1,83 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include <pthread.h>
+#include <vector>
+#include "detector.h"
+#include "bounded-queue.h"
+
+using namespace std;
+
+//A processed input, id is the one submit returned
+struct PipelineResult{
+	long id;
+	DetectResult result;
+};
+
+//Decode, face detection and landmarking/alignment run as separate stages,
+//each on its own threads, connected by bounded lock-free queues. Images in
+//different stages are processed at the same time, so file reads and decoding
+//overlap with the cascade and IntraFace, and the slow stage can be given
+//more threads. A full queue stalls the stage feeding it, down to submit.
+//Results come out in completion order, not submission order. options.budget
+//counts from when an image's decoding starts, so it includes the wait for a
+//detect thread, and the face search stops there as in Detector::detect.
+class DetectPipeline{
+	public:
+		//every detect and landmark thread gets its own Detector on cfgname, the models are shared
+		DetectPipeline(const char* cfgname, const DetectOptions& options, int decoders = 1, int detectors = 1, int markers = 1, int queueSize = 16);
+		//closes the pipeline and drops the results not collected
+		~DetectPipeline();
+		
+		//queues an image, waits while the pipeline is full. buffers given as data must
+		//stay valid until their result is out. returns the id of the result.
+		//a full pipeline only moves when results are taken, so a thread that also
+		//collects the results should use trySubmit, which returns -1 instead of waiting
+		long submit(const BatchInput& input);
+		long trySubmit(const BatchInput& input);
+		//no more inputs
+		void close();
+		//waits for the next result, false once closed and everything is out
+		bool next(PipelineResult& result);
+	private:
+		struct Item{
+			long id;
+			BatchInput input;
+			Mat frame;
+			Mat gray;
+			//Metrics::now() when decoding started, options.budget counts from there
+			uint64_t started;
+			bool failed;
+			DetectResult result;
+			
+			Item(long id, const BatchInput& input);
+		};
+		struct Worker{
+			DetectPipeline* pipeline;
+			Detector* detector;
+			pthread_t thread;
+		};
+		DetectOptions options;
+		BoundedQueue<Item*> decodeQueue;
+		BoundedQueue<Item*> detectQueue;
+		BoundedQueue<Item*> markQueue;
+		BoundedQueue<Item*> resultQueue;
+		vector<Worker> decodeWorkers;
+		vector<Worker> detectWorkers;
+		vector<Worker> markWorkers;
+		//threads still running in each stage, the last one out closes the next queue
+		int decodersLeft;
+		int detectorsLeft;
+		int markersLeft;
+		long nextId;
+		bool closed;
+		
+		DetectPipeline(const DetectPipeline&);
+		DetectPipeline& operator=(const DetectPipeline&);
+		static void start(vector<Worker>& workers, DetectPipeline* pipeline, void* (*stage)(void*));
+		static void* decodeStage(void* worker);
+		static void* detectStage(void* worker);
+		static void* markStage(void* worker);
+};
+
+#endif
@@ -0,0 +1,130 @@
+#include "protocol.h"
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+
+bool ReadFull(int fd, void* data, size_t size){
+	char* p = (char*)data;
+	while (size > 0){
+		ssize_t n = read(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool WriteFull(int fd, const void* data, size_t size){
+	const char* p = (const char*)data;
+	while (size > 0){
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool ReadDetectRequest(int fd, DetectRequestHeader& header, vector<unsigned char>& payload, int* passedFd){
+	if (passedFd != NULL){
+		if (!ReceiveWithFd(fd, &header, sizeof(header), passedFd))
+			return false;
+	}
+	else if (!ReadFull(fd, &header, sizeof(header))){
+		return false;
+	}
+	if (header.magic != DETECT_REQUEST_MAGIC || header.length > DETECT_MAX_PAYLOAD)
+		return false;
+	//only the metrics request comes without a payload
+	if (header.length == 0){
+		payload.clear();
+		return header.source == SOURCE_METRICS;
+	}
+	payload.resize(header.length);
+	return ReadFull(fd, &payload[0], header.length);
+}
+
+bool WriteDetectRequest(int fd, const DetectRequestHeader& header, const void* payload){
+	return WriteFull(fd, &header, sizeof(header)) && WriteFull(fd, payload, header.length);
+}
+
+bool SendWithFd(int socket, const void* data, size_t size, int fd){
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	iov.iov_base = (void*)data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+	
+	ssize_t n;
+	do{
+		n = sendmsg(socket, &msg, 0);
+	}while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return false;
+	return WriteFull(socket, (const char*)data + n, size - n);
+}
+
+bool ReceiveWithFd(int socket, void* data, size_t size, int* fd){
+	struct msghdr msg;
+	struct iovec iov;
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = data;
+	iov.iov_len = size;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	*fd = -1;
+	
+	ssize_t n;
+	do{
+		n = recvmsg(socket, &msg, 0);
+	}while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return false;
+	for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)){
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			memcpy(fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+	return ReadFull(socket, (char*)data + n, size - n);
+}
+
+static bool ReadBlock(int fd, size_t size, void* data){
+	return size == 0 || ReadFull(fd, data, size);
+}
+
+bool ReadDetectResponse(int fd, DetectResponseHeader& header, vector<float>& landmarks, vector<float>& alignedLandmarks, 
+	vector<unsigned char>& aligned, vector<unsigned char>& annotated){
+	if (!ReadFull(fd, &header, sizeof(header)) || header.magic != DETECT_RESPONSE_MAGIC)
+		return false;
+	if (header.landmarks > 1024 || header.alignedLandmarks > 1024 || 
+		header.alignedLength > DETECT_MAX_PAYLOAD || header.annotatedLength > DETECT_MAX_PAYLOAD)
+		return false;
+	landmarks.resize(2*header.landmarks);
+	alignedLandmarks.resize(2*header.alignedLandmarks);
+	aligned.resize(header.alignedLength);
+	annotated.resize(header.annotatedLength);
+	return ReadBlock(fd, landmarks.size()*sizeof(float), landmarks.empty() ? NULL : &landmarks[0]) &&
+		ReadBlock(fd, alignedLandmarks.size()*sizeof(float), alignedLandmarks.empty() ? NULL : &alignedLandmarks[0]) &&
+		ReadBlock(fd, aligned.size(), aligned.empty() ? NULL : &aligned[0]) &&
+		ReadBlock(fd, annotated.size(), annotated.empty() ? NULL : &annotated[0]);
+}
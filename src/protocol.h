@@ -0,0 +1,87 @@
+#ifndef __DETECT_PROTOCOL_H__
+#define __DETECT_PROTOCOL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+using namespace std;
+
+//Framing between bin/detectd and its clients on a Unix domain socket.
+//Both ends are on the same machine, so fields are in native byte order.
+//A connection carries any number of request/response pairs:
+//
+//  request   DetectRequestHeader, then length bytes: the encoded image,
+//            the path of an image the daemon reads itself, or
+//            DetectPixelHeader and the raw pixels, rows packed
+//  response  DetectResponseHeader, then
+//            float[2*landmarks]         x row then y row, image coordinates
+//            float[2*alignedLandmarks]  aligned face coordinates
+//            alignedLength bytes        aligned face as PNG
+//            annotatedLength bytes      annotated image as JPEG
+//
+//SOURCE_SHM hands a shared memory ring (see shm-ring.h) to the daemon: the
+//descriptor comes with the header, the payload is the uint32 slot count and
+//the answer a bare DetectResponseHeader, found set if the ring was accepted.
+//After that the connection only carries uint32 slot numbers both ways.
+//
+//SOURCE_METRICS has no payload. The answer is a DetectResponseHeader whose
+//annotatedLength bytes are the daemon's metrics in Prometheus text format.
+
+#define DETECT_REQUEST_MAGIC 0x5144424b  //"KBDQ"
+#define DETECT_RESPONSE_MAGIC 0x5244424b //"KBDR"
+//larger requests are refused and the connection closed
+#define DETECT_MAX_PAYLOAD (64 << 20)
+
+enum DETECT_SOURCE {SOURCE_BYTES = 0, SOURCE_PATH = 1, SOURCE_PIXELS = 2, SOURCE_SHM = 3, SOURCE_METRICS = 4};
+
+struct DetectRequestHeader{
+	uint32_t magic;
+	uint32_t stages; //DETECT_STAGE mask
+	//aligned face size, up to 4096, and margin, below both sides. A request
+	//with others, or numLandmarks other than 5 or 49, is answered not found
+	float width;
+	float height;
+	float patchSize;
+	int32_t numLandmarks;
+	uint32_t source; //DETECT_SOURCE
+	uint32_t length;
+	uint32_t budget; //microseconds the face search may take, 0 for no limit
+};
+
+struct DetectPixelHeader{
+	int32_t width;
+	int32_t height;
+	int32_t format; //PIXEL_FORMAT
+};
+
+struct DetectResponseHeader{
+	uint32_t magic;
+	int32_t found;
+	int32_t face[4]; //x, y, width, height
+	float score;
+	int32_t pose[3]; //roll, yaw, pitch
+	uint32_t landmarks;
+	uint32_t alignedLandmarks;
+	uint32_t alignedLength;
+	uint32_t annotatedLength;
+	int32_t truncated; //the budget ran out before every face size was scanned
+};
+
+//false on EOF or error, retries on EINTR and short transfers
+bool ReadFull(int fd, void* data, size_t size);
+bool WriteFull(int fd, const void* data, size_t size);
+
+//a descriptor travels with the first byte of data
+bool SendWithFd(int socket, const void* data, size_t size, int fd);
+//reads exactly size bytes, *fd is -1 unless a descriptor came with them
+bool ReceiveWithFd(int socket, void* data, size_t size, int* fd);
+
+//passedFd receives a descriptor sent with the header, if not NULL
+bool ReadDetectRequest(int fd, DetectRequestHeader& header, vector<unsigned char>& payload, int* passedFd = NULL);
+bool WriteDetectRequest(int fd, const DetectRequestHeader& header, const void* payload);
+//landmark arrays and images are read into the vectors, in the order of the response
+bool ReadDetectResponse(int fd, DetectResponseHeader& header, vector<float>& landmarks, vector<float>& alignedLandmarks, 
+	vector<unsigned char>& aligned, vector<unsigned char>& annotated);
+
+#endif
@@ -0,0 +1,101 @@
+#include "quality.h"
+#include "metrics.h"
+#include <cstdio>
+
+void MeasureFaceQuality(const Mat& gray, const Rect& face, int neighbors, FaceQuality& quality){
+	quality.size = face.width;
+	quality.neighbors = neighbors;
+	quality.sharpness = 0;
+	quality.brightness = 0;
+	Rect roi = face & Rect(0, 0, gray.cols, gray.rows);
+	if (roi.width < 3 || roi.height < 3)
+		return;
+	
+	//sample the face on a fixed grid so that the sharpness threshold does not
+	//depend on the face size, each sample averaging a 2x2 quad against aliasing.
+	//the grid is on the stack, nothing is allocated
+	uchar pixels[QUALITY_SIZE*QUALITY_SIZE];
+	for (int y = 0; y < QUALITY_SIZE; y++){
+		int sy = roi.y + MIN(y*roi.height/QUALITY_SIZE, roi.height - 2);
+		const uchar* top = gray.ptr<uchar>(sy);
+		const uchar* bottom = gray.ptr<uchar>(sy + 1);
+		for (int x = 0; x < QUALITY_SIZE; x++){
+			int sx = roi.x + MIN(x*roi.width/QUALITY_SIZE, roi.width - 2);
+			pixels[y*QUALITY_SIZE + x] = (top[sx] + top[sx + 1] + bottom[sx] + bottom[sx + 1] + 2) >> 2;
+		}
+	}
+	
+	double sum = 0, lsum = 0, lsquares = 0;
+	for (int y = 0; y < QUALITY_SIZE; y++){
+		const uchar* row = pixels + y*QUALITY_SIZE;
+		for (int x = 0; x < QUALITY_SIZE; x++)
+			sum += row[x];
+	}
+	int n = (QUALITY_SIZE - 2)*(QUALITY_SIZE - 2);
+	for (int y = 1; y < QUALITY_SIZE - 1; y++){
+		const uchar* row = pixels + y*QUALITY_SIZE;
+		for (int x = 1; x < QUALITY_SIZE - 1; x++){
+			int l = row[x - 1] + row[x + 1] + row[x - QUALITY_SIZE] + row[x + QUALITY_SIZE] - 4*row[x];
+			lsum += l;
+			lsquares += l*l;
+		}
+	}
+	quality.brightness = sum/(QUALITY_SIZE*QUALITY_SIZE);
+	quality.sharpness = lsquares/n - (lsum/n)*(lsum/n);
+}
+
+int CheckFaceQuality(const FaceQuality& quality, const QualityGate& gate){
+	if (quality.size < gate.minFace)
+		return GATE_SMALL;
+	if (quality.neighbors < gate.minNeighbors)
+		return GATE_WEAK;
+	if (quality.brightness < gate.minBrightness || quality.brightness > gate.maxBrightness)
+		return GATE_EXPOSURE;
+	if (quality.sharpness < gate.minSharpness)
+		return GATE_BLURRED;
+	return GATE_PASS;
+}
+
+int GateEvent(int result){
+	switch (result){
+		case GATE_SMALL: return EGATE_SMALL;
+		case GATE_BLURRED: return EGATE_BLURRED;
+		case GATE_WEAK: return EGATE_WEAK;
+		default: return EGATE_EXPOSURE;
+	}
+}
+
+bool GateEnabled(const QualityGate& gate){
+	return gate.minFace > 0 || gate.minSharpness > 0 || gate.minNeighbors > 0 ||
+		gate.minBrightness > 0 || gate.maxBrightness < 255;
+}
+
+void ReportQualityGate(ostream& out, const QualityGate& settings){
+	uint64_t small = Metrics::events(EGATE_SMALL), blurred = Metrics::events(EGATE_BLURRED);
+	uint64_t weak = Metrics::events(EGATE_WEAK), exposure = Metrics::events(EGATE_EXPOSURE);
+	uint64_t gated = small + blurred + weak + exposure;
+	StageHistogram gate, landmark;
+	Metrics::histogram(MGATE, gate);
+	Metrics::histogram(MLANDMARK, landmark);
+	if (gate.count == 0)
+		return;
+	
+	char line[256];
+	double perFace = landmark.count > 0 ? landmark.nanos/1e9/landmark.count : 0;
+	snprintf(line, sizeof(line), "Quality gate%s: %llu of %llu faces gated (small %llu, blurred %llu, weak %llu, exposure %llu)\n",
+		settings.shadow ? " (shadow)" : "", (unsigned long long)gated, (unsigned long long)gate.count, (unsigned long long)small,
+		(unsigned long long)blurred, (unsigned long long)weak, (unsigned long long)exposure);
+	out<<line;
+	//in shadow mode nothing was skipped, the gated faces were landmarked with the others
+	snprintf(line, sizeof(line), "  %s ~%.3f s of landmarking at %.2f ms per face, checks cost %.3f s\n",
+		settings.shadow ? "projected, with the gate on it would save" : "saves", gated*perFace, perFace*1000, gate.nanos/1e9);
+	out<<line;
+	//only counted in shadow mode, where the gated faces are landmarked as well
+	uint64_t missed = Metrics::events(EGATE_MISSED), confirmed = Metrics::events(EGATE_CONFIRMED);
+	if (missed + confirmed > 0){
+		snprintf(line, sizeof(line), "  IntraFace accepted %llu of the gated faces (lost with the gate on) and rejected %llu\n",
+			(unsigned long long)missed, (unsigned long long)confirmed);
+		out<<line;
+	}
+	out.flush();
+}
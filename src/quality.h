@@ -0,0 +1,44 @@
+#ifndef __DETECT_QUALITY_H__
+#define __DETECT_QUALITY_H__
+
+#include <opencv2/core/core.hpp>
+#include <iostream>
+#include "config.h"
+
+using namespace std;
+using namespace cv;
+
+//Cheap checks on a detected face, so that IntraFace is not run on faces it
+//would reject or whose landmarks would be useless: too small, blurred,
+//weakly detected or badly exposed. Measuring samples the face on a
+//QUALITY_SIZE x QUALITY_SIZE grid, tens of microseconds against milliseconds
+//for landmarking.
+
+#define QUALITY_SIZE 64
+
+enum GATE_RESULT {GATE_PASS, GATE_SMALL, GATE_BLURRED, GATE_WEAK, GATE_EXPOSURE};
+
+struct FaceQuality{
+	int size; //face width in pixels
+	float sharpness; //variance of the 4-neighbour Laplacian
+	int neighbors; //cascade windows grouped into the face
+	float brightness; //mean gray level
+};
+
+//gray is the 8-bit image the face was detected on
+void MeasureFaceQuality(const Mat& gray, const Rect& face, int neighbors, FaceQuality& quality);
+//the first check failed, GATE_PASS if none
+int CheckFaceQuality(const FaceQuality& quality, const QualityGate& gate);
+//METRIC_EVENT counted for a GATE_RESULT
+int GateEvent(int result);
+//false while every check is at its default, nothing needs to be measured then
+bool GateEnabled(const QualityGate& gate);
+
+//faces skipped per reason and the landmarking time saved, estimated from the
+//mean landmark latency. In shadow mode (GATE_SHADOW) the gated faces were
+//landmarked anyway, so the saving is only projected, next to how many of them
+//IntraFace accepted (gate_missed, the faces the gate would lose) or rejected
+//(gate_confirmed)
+void ReportQualityGate(ostream& out, const QualityGate& gate);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __DETECT_RECORDS_H__
+#define __DETECT_RECORDS_H__
+
+#include <stdint.h>
+
+//Binary output of bin/detect -f bin, native byte order:
+//
+//  RecordFileHeader
+//  per input, in input order:
+//    DetectRecord
+//    char[pathLength]        input path, not terminated
+//    float[2*landmarks]      x row then y row, image coordinates
+
+#define RECORD_FILE_MAGIC "KBDREC01"
+
+struct RecordFileHeader{
+	char magic[8];
+	uint32_t recordSize; //sizeof(DetectRecord)
+	uint32_t reserved;
+};
+
+struct DetectRecord{
+	uint32_t pathLength;
+	int32_t found;
+	int32_t face[4]; //x, y, width, height
+	float score;
+	int32_t pose[3]; //roll, yaw, pitch
+	float seconds;
+	uint32_t landmarks;
+	int32_t truncated; //the face search ran out of budget (-d)
+};
+
+#endif
@@ -0,0 +1,40 @@
+#include "renderer.h"
+
+RenderStyle::RenderStyle(){
+	landmarkColor = Scalar(0, 255, 0);
+	landmarkRadius = 2;
+	landmarkThickness = -1;
+	boxColor = Scalar(0, 0, 255);
+	boxThickness = 0;
+}
+
+void DrawLandmarks(Mat& image, const Mat& landmarks, const Scalar& color, int radius, int thickness){
+	if (landmarks.rows < 2)
+		return;
+	Mat points;
+	landmarks.convertTo(points, CV_32F);
+	for (int i = 0; i < points.cols; i++)
+		circle(image, Point((int)points.at<float>(0, i), (int)points.at<float>(1, i)), radius, color, thickness);
+}
+
+static void drawFace(Mat& image, const Rect& face, const Mat& landmarks, const RenderStyle& style){
+	if (style.boxThickness > 0)
+		rectangle(image, face, style.boxColor, style.boxThickness);
+	DrawLandmarks(image, landmarks, style.landmarkColor, style.landmarkRadius, style.landmarkThickness);
+}
+
+void DrawResult(Mat& image, const DetectResult& result, const RenderStyle& style){
+	if (result.found)
+		drawFace(image, result.face, result.landmarks, style);
+}
+
+void DrawFaces(Mat& image, const vector<FaceResult>& faces, const RenderStyle& style){
+	for (size_t i = 0; i < faces.size(); i++)
+		drawFace(image, faces[i].face, faces[i].landmarks, style);
+}
+
+Mat RenderResult(const Mat& frame, const DetectResult& result, const RenderStyle& style){
+	Mat image = frame.clone();
+	DrawResult(image, result, style);
+	return image;
+}
@@ -0,0 +1,29 @@
+#ifndef __DETECT_RENDERER_H__
+#define __DETECT_RENDERER_H__
+
+#include "detector.h"
+
+//Drawing of detection results, separate from detection so that detecting
+//never writes into or copies a frame. Only SANNOTATED and showLandmark
+//make the detector call these.
+
+struct RenderStyle{
+	Scalar landmarkColor;
+	int landmarkRadius;
+	int landmarkThickness; //-1 fills
+	Scalar boxColor;
+	int boxThickness; //0 draws no box
+	
+	//green filled landmarks, no box, as the detector has always drawn them
+	RenderStyle();
+};
+
+//landmarks is 2 x n, x row then y row, in image coordinates
+void DrawLandmarks(Mat& image, const Mat& landmarks, const Scalar& color, int radius, int thickness = -1);
+//draws into image, which must be the frame result was detected on
+void DrawResult(Mat& image, const DetectResult& result, const RenderStyle& style = RenderStyle());
+void DrawFaces(Mat& image, const vector<FaceResult>& faces, const RenderStyle& style = RenderStyle());
+//copy of frame with result drawn, frame is left as it is
+Mat RenderResult(const Mat& frame, const DetectResult& result, const RenderStyle& style = RenderStyle());
+
+#endif
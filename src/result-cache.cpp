@@ -0,0 +1,291 @@
+#include "result-cache.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define CACHE_FILE_MAGIC "KBDCACH1"
+
+//on disk: CacheFileHeader, then float[2*landmarks], x row then y row
+struct CacheFileHeader{
+	char magic[8];
+	CacheKey key;
+	int32_t found;
+	int32_t face[4];
+	float score;
+	int32_t pose[3];
+	uint32_t landmarks;
+};
+
+bool CacheKey::operator<(const CacheKey& other) const{
+	if (hash != other.hash)
+		return hash < other.hash;
+	if (size != other.size)
+		return size < other.size;
+	return options < other.options;
+}
+
+static const uint64_t P1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t P3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t rotl(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t word){
+	return rotl(acc + word*P2, 31)*P1;
+}
+
+static inline uint64_t read64(const uchar* p){
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+uint64_t ResultCache::hashBytes(const void* data, size_t size, uint64_t seed){
+	const uchar* p = (const uchar*)data;
+	const uchar* end = p + size;
+	uint64_t h;
+	//four independent lanes of 8 bytes keep the multipliers busy
+	if (size >= 32){
+		uint64_t a = seed + P1 + P2, b = seed + P2, c = seed, d = seed - P1;
+		for (; p + 32 <= end; p += 32){
+			a = round64(a, read64(p));
+			b = round64(b, read64(p + 8));
+			c = round64(c, read64(p + 16));
+			d = round64(d, read64(p + 24));
+		}
+		h = rotl(a, 1) + rotl(b, 7) + rotl(c, 12) + rotl(d, 18);
+	}
+	else{
+		h = seed + P3;
+	}
+	h += size;
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ round64(0, read64(p)), 27)*P1 + P3;
+	for (; p < end; p++)
+		h = rotl(h ^ (*p*P3), 11)*P1;
+	h ^= h >> 33;
+	h *= P2;
+	h ^= h >> 29;
+	h *= P3;
+	h ^= h >> 32;
+	return h;
+}
+
+bool ResultCache::cacheable(const DetectOptions& options){
+	return (options.stages & ~(SBOX|SLANDMARKS|SPOSE)) == 0;
+}
+
+//field by field, structs with padding would hash uninitialized bytes
+static uint64_t hashScan(const ScanParams& scan, uint64_t seed){
+	seed = ResultCache::hashBytes(&scan.scaleFactor, sizeof(scan.scaleFactor), seed);
+	seed = ResultCache::hashBytes(&scan.minNeighbors, sizeof(scan.minNeighbors), seed);
+	seed = ResultCache::hashBytes(&scan.minFace, sizeof(scan.minFace), seed);
+	seed = ResultCache::hashBytes(&scan.maxFace, sizeof(scan.maxFace), seed);
+	seed = ResultCache::hashBytes(&scan.haarMinFace, sizeof(scan.haarMinFace), seed);
+	return ResultCache::hashBytes(&scan.notFace, sizeof(scan.notFace), seed);
+}
+
+static uint64_t hashModel(const string& path, uint64_t seed){
+	seed = ResultCache::hashBytes(path.data(), path.size(), seed);
+	struct stat st;
+	if (path.empty() || stat(path.data(), &st) != 0)
+		return seed;
+	int64_t identity[2] = {(int64_t)st.st_size, (int64_t)st.st_mtime};
+	return ResultCache::hashBytes(identity, sizeof(identity), seed);
+}
+
+uint64_t ResultCache::configHash(const DetectorConfig& config){
+	uint64_t h = hashBytes(config.type.data(), config.type.size());
+	h = hashModel(config.cascade, h);
+	h = hashModel(config.haarcascade, h);
+	h = hashModel(config.intradetect, h);
+	h = hashModel(config.intratrack, h);
+	const QualityGate& gate = config.gate;
+	float values[] = {(float)gate.minFace, gate.minSharpness, (float)gate.minNeighbors,
+		gate.minBrightness, gate.maxBrightness, gate.shadow ? 1.0f : 0.0f};
+	return hashBytes(values, sizeof(values), h);
+}
+
+CacheKey ResultCache::key(const uchar* data, size_t size, const DetectOptions& options, const DetectorConfig& config, uint64_t hash){
+	CacheKey key;
+	key.hash = hashBytes(data, size);
+	key.size = size;
+	//only what changes the cached outputs: the stages, the configuration
+	//and the scan settings in effect
+	key.options = options.stages | (hashScan(MergeScanParams(config.scan, options.scan), hash) << 8);
+	return key;
+}
+
+ResultCache::ResultCache(size_t entries, const string& directory){
+	capacity = entries > 0 ? entries : 1;
+	this->directory = directory;
+	hitCount = 0;
+	missCount = 0;
+	pthread_mutex_init(&mutex, NULL);
+	if (!directory.empty())
+		mkdir(directory.data(), 0755);
+}
+
+ResultCache::~ResultCache(){
+	pthread_mutex_destroy(&mutex);
+}
+
+bool ResultCache::lookup(const CacheKey& key, DetectResult& result){
+	pthread_mutex_lock(&mutex);
+	map<CacheKey, EntryList::iterator>::iterator it = index.find(key);
+	if (it != index.end()){
+		entries.splice(entries.begin(), entries, it->second);
+		result = it->second->result;
+		hitCount++;
+		pthread_mutex_unlock(&mutex);
+		//the caller owns its landmarks
+		result.landmarks = result.landmarks.clone();
+		Metrics::count(ECACHE_HIT);
+		return true;
+	}
+	pthread_mutex_unlock(&mutex);
+	
+	if (!directory.empty() && load(key, result)){
+		remember(key, result);
+		pthread_mutex_lock(&mutex);
+		hitCount++;
+		pthread_mutex_unlock(&mutex);
+		Metrics::count(ECACHE_DISK_HIT);
+		return true;
+	}
+	pthread_mutex_lock(&mutex);
+	missCount++;
+	pthread_mutex_unlock(&mutex);
+	Metrics::count(ECACHE_MISS);
+	return false;
+}
+
+void ResultCache::insert(const CacheKey& key, const DetectResult& result){
+	remember(key, result);
+	if (!directory.empty())
+		store(key, result);
+}
+
+void ResultCache::remember(const CacheKey& key, const DetectResult& result){
+	Entry entry;
+	entry.key = key;
+	entry.result.found = result.found;
+	entry.result.face = result.face;
+	entry.result.score = result.score;
+	for (int i = 0; i < 3; i++)
+		entry.result.pose[i] = result.pose[i];
+	entry.result.landmarks = result.landmarks.clone();
+	entry.result.seconds = result.seconds;
+	
+	pthread_mutex_lock(&mutex);
+	map<CacheKey, EntryList::iterator>::iterator it = index.find(key);
+	if (it != index.end()){
+		it->second->result = entry.result;
+		entries.splice(entries.begin(), entries, it->second);
+	}
+	else{
+		entries.push_front(entry);
+		index[key] = entries.begin();
+		while (entries.size() > capacity){
+			index.erase(entries.back().key);
+			entries.pop_back();
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+size_t ResultCache::size(){
+	pthread_mutex_lock(&mutex);
+	size_t n = entries.size();
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+uint64_t ResultCache::hits(){
+	pthread_mutex_lock(&mutex);
+	uint64_t n = hitCount;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+uint64_t ResultCache::misses(){
+	pthread_mutex_lock(&mutex);
+	uint64_t n = missCount;
+	pthread_mutex_unlock(&mutex);
+	return n;
+}
+
+//directory/ab/abcdef0123456789-size-options, 256 subdirectories
+string ResultCache::pathOf(const CacheKey& key){
+	char name[96];
+	snprintf(name, sizeof(name), "/%02x/%016llx-%llx-%llx", (unsigned)(key.hash >> 56), (unsigned long long)key.hash, 
+		(unsigned long long)key.size, (unsigned long long)key.options);
+	return directory + name;
+}
+
+bool ResultCache::load(const CacheKey& key, DetectResult& result){
+	FILE* file = fopen(pathOf(key).data(), "rb");
+	if (file == NULL)
+		return false;
+	CacheFileHeader header;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+		header.key.hash == key.hash && header.key.size == key.size && header.key.options == key.options && header.landmarks <= 1024;
+	Mat landmarks;
+	if (ok && header.landmarks > 0){
+		landmarks.create(2, header.landmarks, CV_32F);
+		ok = fread(landmarks.ptr<float>(0), sizeof(float), header.landmarks, file) == header.landmarks &&
+			fread(landmarks.ptr<float>(1), sizeof(float), header.landmarks, file) == header.landmarks;
+	}
+	fclose(file);
+	if (!ok)
+		return false;
+	result = DetectResult();
+	result.found = header.found != 0;
+	result.face = Rect(header.face[0], header.face[1], header.face[2], header.face[3]);
+	result.score = header.score;
+	for (int i = 0; i < 3; i++)
+		result.pose[i] = header.pose[i];
+	result.landmarks = landmarks;
+	return true;
+}
+
+void ResultCache::store(const CacheKey& key, const DetectResult& result){
+	CacheFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CACHE_FILE_MAGIC, sizeof(header.magic));
+	header.key = key;
+	header.found = result.found;
+	header.face[0] = result.face.x;
+	header.face[1] = result.face.y;
+	header.face[2] = result.face.width;
+	header.face[3] = result.face.height;
+	header.score = result.score;
+	for (int i = 0; i < 3; i++)
+		header.pose[i] = result.pose[i];
+	Mat landmarks;
+	if (!result.landmarks.empty())
+		result.landmarks.convertTo(landmarks, CV_32F);
+	header.landmarks = landmarks.cols;
+	
+	string path = pathOf(key);
+	string dir = path.substr(0, path.find_last_of('/'));
+	mkdir(dir.data(), 0755);
+	//written aside and renamed, readers never see a partial entry
+	char suffix[48];
+	snprintf(suffix, sizeof(suffix), ".%d.%lx.tmp", (int)getpid(), (unsigned long)pthread_self());
+	string temp = path + suffix;
+	FILE* file = fopen(temp.data(), "wb");
+	if (file == NULL)
+		return;
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	for (int r = 0; ok && r < landmarks.rows; r++)
+		ok = fwrite(landmarks.ptr<float>(r), sizeof(float), landmarks.cols, file) == (size_t)landmarks.cols;
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(temp.data(), path.data()) != 0)
+		unlink(temp.data());
+}
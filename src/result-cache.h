@@ -0,0 +1,78 @@
+#ifndef __RESULT_CACHE_H__
+#define __RESULT_CACHE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include "detector.h"
+
+using namespace std;
+
+//Identifies an encoded image and the options it was detected with
+struct CacheKey{
+	uint64_t hash; //of the encoded bytes
+	uint64_t size;
+	uint64_t options; //the stages and a hash of the configuration and scan settings
+	
+	bool operator<(const CacheKey& other) const;
+};
+
+//Bounded LRU of detection results keyed by the content of the encoded image,
+//so re-uploads of the same bytes skip decode and detection. Only box,
+//landmarks and pose are kept; requests for aligned or annotated images
+//bypass the cache. Results without a face are cached as well.
+//
+//With a directory the cache has a second tier on disk, one file per entry,
+//which is never evicted and survives restarts: memory misses are looked up
+//there and every new result is written there. Several processes may share
+//the directory. All methods are thread safe.
+class ResultCache{
+	public:
+		//entries in memory; directory may be empty for no disk tier
+		ResultCache(size_t entries, const string& directory = "");
+		~ResultCache();
+		
+		static bool cacheable(const DetectOptions& options);
+		//identity of everything in config that changes results, the model files included
+		//(path, size and modification time), so that the disk tier stays valid across
+		//detector.cfg edits and model updates
+		static uint64_t configHash(const DetectorConfig& config);
+		//hash is configHash(config), computed once per configuration
+		static CacheKey key(const uchar* data, size_t size, const DetectOptions& options, const DetectorConfig& config, uint64_t hash);
+		//fast 64 bit hash, not cryptographic
+		static uint64_t hashBytes(const void* data, size_t size, uint64_t seed = 0);
+		
+		//fills result and returns true on a hit
+		bool lookup(const CacheKey& key, DetectResult& result);
+		void insert(const CacheKey& key, const DetectResult& result);
+		
+		size_t size();
+		uint64_t hits();
+		uint64_t misses();
+	private:
+		struct Entry{
+			CacheKey key;
+			DetectResult result;
+		};
+		typedef list<Entry> EntryList;
+		
+		size_t capacity;
+		string directory;
+		pthread_mutex_t mutex;
+		//most recently used first
+		EntryList entries;
+		map<CacheKey, EntryList::iterator> index;
+		uint64_t hitCount;
+		uint64_t missCount;
+		
+		ResultCache(const ResultCache&);
+		ResultCache& operator=(const ResultCache&);
+		void remember(const CacheKey& key, const DetectResult& result);
+		string pathOf(const CacheKey& key);
+		bool load(const CacheKey& key, DetectResult& result);
+		void store(const CacheKey& key, const DetectResult& result);
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include "shm-ring.h"
+#include "protocol.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//for C libraries older than the sealing API
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS 1033
+#define F_GET_SEALS 1034
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW 0x0004
+#endif
+//the size of a ring cannot change once it is handed over
+#define SHM_RING_SEALS (F_SEAL_SHRINK|F_SEAL_GROW)
+
+static size_t align64(size_t size){
+	return (size + 63) & ~(size_t)63;
+}
+
+//a memfd, which unlike a POSIX shared memory object can be sealed
+static int createSharedFile(){
+#ifdef SYS_memfd_create
+	return (int)syscall(SYS_memfd_create, "kbdetect-ring", MFD_ALLOW_SEALING);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+ShmRing::ShmRing(int fd, void* base, size_t length){
+	descriptor = fd;
+	this->base = base;
+	this->length = length;
+	header = (ShmRingHeader*)base;
+	ringSlots = 0;
+	ringPixelBytes = 0;
+	ringSlotSize = 0;
+}
+
+ShmRing::~ShmRing(){
+	munmap(base, length);
+	close(descriptor);
+}
+
+ShmRing* ShmRing::create(int slots, size_t pixelBytes){
+	if (slots <= 0 || pixelBytes == 0)
+		return NULL;
+	size_t slotSize = align64(sizeof(ShmSlot)) + align64(pixelBytes);
+	size_t length = align64(sizeof(ShmRingHeader)) + slots*slotSize;
+	int fd = createSharedFile();
+	if (fd < 0){
+		fprintf(stderr, "Cannot create shared memory: %s\n", strerror(errno));
+		return NULL;
+	}
+	if (ftruncate(fd, length) != 0 || fcntl(fd, F_ADD_SEALS, SHM_RING_SEALS) != 0){
+		fprintf(stderr, "Cannot size shared memory: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+	void* base = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED){
+		close(fd);
+		return NULL;
+	}
+	ShmRing* ring = new ShmRing(fd, base, length);
+	ring->header->magic = SHM_RING_MAGIC;
+	ring->header->slots = slots;
+	ring->header->pixelBytes = align64(pixelBytes);
+	ring->header->slotSize = slotSize;
+	ring->ringSlots = slots;
+	ring->ringPixelBytes = align64(pixelBytes);
+	ring->ringSlotSize = slotSize;
+	return ring;
+}
+
+ShmRing* ShmRing::attach(int fd){
+	//unsealed, the client could shrink the file under the mapping
+	int seals = fcntl(fd, F_GET_SEALS);
+	struct stat st;
+	if (seals < 0 || (seals & SHM_RING_SEALS) != SHM_RING_SEALS ||
+		fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmRingHeader)){
+		close(fd);
+		return NULL;
+	}
+	size_t length = st.st_size;
+	void* base = mmap(NULL, length, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (base == MAP_FAILED){
+		close(fd);
+		return NULL;
+	}
+	ShmRing* ring = new ShmRing(fd, base, length);
+	//the header comes from the client, which can still write it: the values are
+	//checked against the mapping once, and only the checked copy is used. No sum
+	//of client values is formed, it could wrap around and pass
+	ShmRingHeader header = *ring->header;
+	if (header.magic != SHM_RING_MAGIC || header.slots == 0 || length < align64(sizeof(ShmRingHeader)) ||
+		header.slotSize < align64(sizeof(ShmSlot)) || header.pixelBytes > header.slotSize - align64(sizeof(ShmSlot)) ||
+		header.slotSize > length || header.slots > (length - align64(sizeof(ShmRingHeader)))/header.slotSize){
+		delete ring;
+		return NULL;
+	}
+	ring->ringSlots = header.slots;
+	ring->ringPixelBytes = header.pixelBytes;
+	ring->ringSlotSize = header.slotSize;
+	return ring;
+}
+
+int ShmRing::fd() const{
+	return descriptor;
+}
+
+int ShmRing::slots() const{
+	return ringSlots;
+}
+
+size_t ShmRing::pixelBytes() const{
+	return ringPixelBytes;
+}
+
+ShmSlot* ShmRing::slot(int index){
+	return (ShmSlot*)((char*)base + align64(sizeof(ShmRingHeader)) + index*ringSlotSize);
+}
+
+unsigned char* ShmRing::pixels(int index){
+	return (unsigned char*)slot(index) + align64(sizeof(ShmSlot));
+}
+
+ShmClient::ShmClient(){
+	socket = -1;
+	ring = NULL;
+}
+
+ShmClient::~ShmClient(){
+	if (socket >= 0)
+		close(socket);
+	delete ring;
+}
+
+bool ShmClient::connect(const string& socketPath, int slots, size_t pixelBytes){
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socketPath.data(), sizeof(addr.sun_path) - 1);
+	socket = ::socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socket < 0 || ::connect(socket, (struct sockaddr*)&addr, sizeof(addr)) != 0){
+		fprintf(stderr, "Cannot connect to %s: %s\n", socketPath.data(), strerror(errno));
+		return false;
+	}
+	ring = ShmRing::create(slots, pixelBytes);
+	if (ring == NULL)
+		return false;
+	
+	//the header and the ring's slot count, the descriptor goes with them
+	DetectRequestHeader request;
+	memset(&request, 0, sizeof(request));
+	request.magic = DETECT_REQUEST_MAGIC;
+	request.source = SOURCE_SHM;
+	request.length = sizeof(uint32_t);
+	uint32_t count = slots;
+	DetectResponseHeader response;
+	if (!SendWithFd(socket, &request, sizeof(request), ring->fd()) || !WriteFull(socket, &count, sizeof(count)) ||
+		!ReadFull(socket, &response, sizeof(response)) || response.magic != DETECT_RESPONSE_MAGIC || !response.found){
+		fprintf(stderr, "Shared memory ring refused by %s\n", socketPath.data());
+		return false;
+	}
+	return true;
+}
+
+int ShmClient::slots() const{
+	return ring->slots();
+}
+
+unsigned char* ShmClient::buffer(int slot){
+	return ring->pixels(slot);
+}
+
+bool ShmClient::post(int slot, int width, int height, int stride, int format, int stages){
+	ShmSlot* s = ring->slot(slot);
+	s->width = width;
+	s->height = height;
+	s->stride = stride;
+	s->format = format;
+	s->stages = stages;
+	s->found = 0;
+	uint32_t index = slot;
+	return WriteFull(socket, &index, sizeof(index));
+}
+
+bool ShmClient::wait(int& slot){
+	uint32_t index;
+	if (!ReadFull(socket, &index, sizeof(index)) || index >= (uint32_t)ring->slots())
+		return false;
+	slot = index;
+	return true;
+}
+
+const ShmSlot* ShmClient::result(int slot){
+	return ring->slot(slot);
+}
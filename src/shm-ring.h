@@ -0,0 +1,97 @@
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+
+using namespace std;
+
+//Shared memory transport between a local client and bin/detectd. The client
+//creates a ring of slots in a memfd, sealed against resizing, and
+//passes the descriptor to the daemon once over the socket. From then on the
+//client writes raw pixels and the request into a slot and sends only the slot
+//number; the daemon detects on the pixels in place, through a Mat header, writes
+//the results back into the slot and answers with the slot number.
+//
+//  ShmRingHeader, padded to 64 bytes
+//  slots x (ShmSlot, padded to 64 bytes, then pixelBytes of pixels)
+
+#define SHM_RING_MAGIC 0x4d48534b //"KSHM"
+#define SHM_MAX_LANDMARKS 68
+
+struct ShmRingHeader{
+	uint32_t magic;
+	uint32_t slots;
+	uint64_t pixelBytes; //pixel capacity of each slot
+	uint64_t slotSize; //bytes from one slot to the next
+};
+
+struct ShmSlot{
+	//request, written by the client
+	int32_t width;
+	int32_t height;
+	int32_t stride; //bytes per row
+	int32_t format; //PIXEL_FORMAT
+	uint32_t stages; //DETECT_STAGE mask, box, landmarks and pose only
+	//response, written by the daemon
+	int32_t found;
+	int32_t face[4];
+	float score;
+	int32_t pose[3];
+	uint32_t landmarks;
+	float points[2*SHM_MAX_LANDMARKS]; //x row then y row
+};
+
+class ShmRing{
+	public:
+		//client side, a new ring
+		static ShmRing* create(int slots, size_t pixelBytes);
+		//daemon side, the descriptor received from the client, NULL if it is not a valid ring
+		static ShmRing* attach(int fd);
+		~ShmRing();
+		
+		int fd() const;
+		int slots() const;
+		size_t pixelBytes() const;
+		ShmSlot* slot(int index);
+		unsigned char* pixels(int index);
+	private:
+		int descriptor;
+		void* base;
+		size_t length;
+		ShmRingHeader* header;
+		//the header as checked, the client can rewrite the shared one
+		uint32_t ringSlots;
+		size_t ringPixelBytes;
+		size_t ringSlotSize;
+		
+		ShmRing(int fd, void* base, size_t length);
+		ShmRing(const ShmRing&);
+		ShmRing& operator=(const ShmRing&);
+};
+
+//Client end of the ring, connected to bin/detectd
+class ShmClient{
+	public:
+		ShmClient();
+		~ShmClient();
+		
+		//creates the ring and hands it to the daemon
+		bool connect(const string& socketPath, int slots, size_t pixelBytes);
+		int slots() const;
+		//write pixels here, then post
+		unsigned char* buffer(int slot);
+		bool post(int slot, int width, int height, int stride, int format, int stages);
+		//waits for the next finished slot, its results are in result(slot)
+		bool wait(int& slot);
+		const ShmSlot* result(int slot);
+	private:
+		int socket;
+		ShmRing* ring;
+		
+		ShmClient(const ShmClient&);
+		ShmClient& operator=(const ShmClient&);
+};
+
+#endif
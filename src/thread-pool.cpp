@@ -0,0 +1,106 @@
+#include "thread-pool.h"
+#include <unistd.h>
+
+ThreadPool::ThreadPool(int threads){
+	if (threads <= 0)
+		threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 0)
+		threads = 1;
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&start, NULL);
+	pthread_cond_init(&done, NULL);
+	generation = 0;
+	active = 0;
+	stopping = false;
+	task = NULL;
+	arg = NULL;
+	count = 0;
+	next = 0;
+	
+	//ids must be set before any thread runs, the vector cannot grow afterwards
+	workers.resize(threads - 1);
+	for (size_t i = 0; i < workers.size(); i++){
+		workers[i].pool = this;
+		workers[i].id = (int)i + 1;
+	}
+	for (size_t i = 0; i < workers.size(); i++){
+		if (pthread_create(&workers[i].thread, NULL, run, &workers[i]) != 0){
+			//run with the threads we got, shrinking keeps the started workers in place
+			workers.resize(i);
+			break;
+		}
+	}
+}
+
+ThreadPool::~ThreadPool(){
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&mutex);
+	for (size_t i = 0; i < workers.size(); i++)
+		pthread_join(workers[i].thread, NULL);
+	pthread_cond_destroy(&done);
+	pthread_cond_destroy(&start);
+	pthread_mutex_destroy(&mutex);
+}
+
+int ThreadPool::size() const{
+	return (int)workers.size() + 1;
+}
+
+void ThreadPool::parallelFor(int count, ParallelTask task, void* arg){
+	if (count <= 0)
+		return;
+	if (workers.empty() || count == 1){
+		for (int i = 0; i < count; i++)
+			task(arg, i, 0);
+		return;
+	}
+	
+	pthread_mutex_lock(&mutex);
+	this->task = task;
+	this->arg = arg;
+	this->count = count;
+	next = 0;
+	active = (int)workers.size();
+	generation++;
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&mutex);
+	
+	work(0);
+	
+	pthread_mutex_lock(&mutex);
+	while (active > 0)
+		pthread_cond_wait(&done, &mutex);
+	pthread_mutex_unlock(&mutex);
+}
+
+void ThreadPool::work(int id){
+	int i;
+	while ((i = __sync_fetch_and_add(&next, 1)) < count)
+		task(arg, i, id);
+}
+
+void* ThreadPool::run(void* worker){
+	Worker* self = (Worker*)worker;
+	ThreadPool* pool = self->pool;
+	int seen = 0;
+	
+	pthread_mutex_lock(&pool->mutex);
+	while (true){
+		while (!pool->stopping && pool->generation == seen)
+			pthread_cond_wait(&pool->start, &pool->mutex);
+		if (pool->stopping)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->mutex);
+		
+		pool->work(self->id);
+		
+		pthread_mutex_lock(&pool->mutex);
+		if (--pool->active == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->mutex);
+	return NULL;
+}
@@ -0,0 +1,49 @@
+#ifndef __THREAD_POOL_H__
+#define __THREAD_POOL_H__
+
+#include <pthread.h>
+#include <vector>
+
+using namespace std;
+
+//arg is the caller's data, index the item (0..count-1) and worker the
+//thread running it (0..size()-1), for indexing per-worker state
+typedef void (*ParallelTask)(void* arg, int index, int worker);
+
+//Fixed set of threads sharing index ranges. The calling thread works as
+//worker 0, so a pool of size 1 starts no threads at all.
+class ThreadPool{
+	public:
+		//threads = 0 uses one per CPU
+		ThreadPool(int threads = 0);
+		~ThreadPool();
+		
+		int size() const;
+		//runs task for every index and returns when all are done,
+		//one call at a time per pool
+		void parallelFor(int count, ParallelTask task, void* arg);
+	private:
+		struct Worker{
+			ThreadPool* pool;
+			int id;
+			pthread_t thread;
+		};
+		vector<Worker> workers;
+		pthread_mutex_t mutex;
+		pthread_cond_t start;
+		pthread_cond_t done;
+		int generation;
+		int active;
+		bool stopping;
+		ParallelTask task;
+		void* arg;
+		int count;
+		int next;
+		
+		ThreadPool(const ThreadPool&);
+		ThreadPool& operator=(const ThreadPool&);
+		void work(int id);
+		static void* run(void* worker);
+};
+
+#endif
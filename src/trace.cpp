@@ -0,0 +1,114 @@
+#include "trace.h"
+#include "metrics.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <vector>
+
+using namespace std;
+
+struct TraceBuffer{
+	int thread;
+	vector<TraceEvent> events;
+	uint64_t written; //total, events[written % size] is the next slot
+};
+
+int Trace::active = 0;
+
+static pthread_mutex_t traceMutex = PTHREAD_MUTEX_INITIALIZER;
+static vector<TraceBuffer*> buffers;
+static size_t ringSize = 65536;
+static uint64_t origin = 0;
+static __thread TraceBuffer* threadBuffer = NULL;
+static __thread int threadImage = -1;
+
+void Trace::start(size_t eventsPerThread){
+	pthread_mutex_lock(&traceMutex);
+	if (eventsPerThread > 0)
+		ringSize = eventsPerThread;
+	if (origin == 0)
+		origin = Metrics::now();
+	pthread_mutex_unlock(&traceMutex);
+	__atomic_store_n(&active, 1, __ATOMIC_RELEASE);
+}
+
+void Trace::stop(){
+	__atomic_store_n(&active, 0, __ATOMIC_RELEASE);
+}
+
+void Trace::setImage(int image){
+	threadImage = image;
+}
+
+void Trace::span(const char* name, uint64_t begin, uint64_t end, int arg){
+	if (!enabled())
+		return;
+	TraceBuffer* buffer = threadBuffer;
+	if (buffer == NULL){
+		//buffers outlive their threads, write() still needs them
+		buffer = new TraceBuffer;
+		pthread_mutex_lock(&traceMutex);
+		buffer->thread = (int)buffers.size() + 1;
+		buffer->events.resize(ringSize);
+		buffers.push_back(buffer);
+		pthread_mutex_unlock(&traceMutex);
+		buffer->written = 0;
+		threadBuffer = buffer;
+	}
+	TraceEvent& e = buffer->events[buffer->written % buffer->events.size()];
+	e.name = name;
+	e.begin = begin;
+	e.end = end;
+	e.image = threadImage;
+	e.arg = arg;
+	buffer->written++;
+}
+
+bool Trace::write(const char* filename){
+	FILE* file = fopen(filename, "w");
+	if (file == NULL){
+		fprintf(stderr, "Cannot write trace %s\n", filename);
+		return false;
+	}
+	pthread_mutex_lock(&traceMutex);
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for (size_t b = 0; b < buffers.size(); b++){
+		const TraceBuffer* buffer = buffers[b];
+		fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", 
+			first ? "" : ",\n", buffer->thread, buffer->thread);
+		first = false;
+		size_t size = buffer->events.size();
+		uint64_t oldest = buffer->written > size ? buffer->written - size : 0;
+		for (uint64_t i = oldest; i < buffer->written; i++){
+			const TraceEvent& e = buffer->events[i % size];
+			//timestamps in microseconds from the first start()
+			double ts = e.begin > origin ? (e.begin - origin)/1000.0 : 0;
+			double dur = e.end > e.begin ? (e.end - e.begin)/1000.0 : 0;
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", 
+				e.name, buffer->thread, ts, dur);
+			if (e.image >= 0 || e.arg >= 0){
+				fprintf(file, ",\"args\":{");
+				if (e.image >= 0)
+					fprintf(file, "\"image\":%d%s", e.image, e.arg >= 0 ? "," : "");
+				if (e.arg >= 0)
+					fprintf(file, "\"arg\":%d", e.arg);
+				fprintf(file, "}");
+			}
+			fprintf(file, "}");
+		}
+	}
+	fprintf(file, "\n]}\n");
+	pthread_mutex_unlock(&traceMutex);
+	bool ok = ferror(file) == 0;
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+		fprintf(stderr, "Error writing trace %s\n", filename);
+	return ok;
+}
+
+void Trace::clear(){
+	pthread_mutex_lock(&traceMutex);
+	for (size_t b = 0; b < buffers.size(); b++)
+		buffers[b]->written = 0;
+	pthread_mutex_unlock(&traceMutex);
+}
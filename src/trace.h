@@ -0,0 +1,45 @@
+#ifndef __DETECT_TRACE_H__
+#define __DETECT_TRACE_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Optional span tracing for profiling multi-threaded runs. While enabled,
+//every thread records completed spans into a ring buffer of its own, which
+//keeps the latest events when it fills up. write() saves all of them as a
+//Chrome trace (chrome://tracing, ui.perfetto.dev).
+//
+//Metrics::observe records a span for its stage, so the detector stages are
+//traced without further calls. Spans carry the image set with setImage on
+//the recording thread. When disabled a span costs one load and a branch.
+
+struct TraceEvent{
+	const char* name; //static string
+	uint64_t begin; //Metrics::now() nanoseconds
+	uint64_t end;
+	int image;
+	int arg;
+};
+
+class Trace{
+	public:
+		//eventsPerThread is the ring size of each thread
+		static void start(size_t eventsPerThread = 65536);
+		static void stop();
+		static inline bool enabled(){
+			return __atomic_load_n(&active, __ATOMIC_RELAXED) != 0;
+		}
+		
+		static void span(const char* name, uint64_t begin, uint64_t end, int arg = -1);
+		//image index attached to the calling thread's following spans, -1 for none
+		static void setImage(int image);
+		
+		//call once the traced threads are idle, returns false if the file cannot be written
+		static bool write(const char* filename);
+		//drops recorded events
+		static void clear();
+	private:
+		static int active;
+};
+
+#endif
@@ -0,0 +1,234 @@
+#include "detector.h"
+#include "config.h"
+#include "metrics.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <iterator>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+using namespace std;
+
+//Searches the scan settings (config.h) for the fastest one that still finds a
+//target share of the labelled faces, and writes it into the detector
+//configuration. The labels are one image per line:
+//
+//  path x y width height    the image's face
+//  path                     an image without a face
+//
+//Only the face search is timed (pyramid, scan, grouping, verification),
+//summed over the threads from the Metrics histograms, so decoding and
+//thread scheduling do not blur the comparison.
+
+static void usage(const char* name){
+	cerr<<"Usage: "<<name<<" [options] labels"<<endl;
+	cerr<<"  -c  detector configuration to tune, default detector.cfg"<<endl;
+	cerr<<"  -r  recall to keep, default 0.95"<<endl;
+	cerr<<"  -t  threads, default THREADS from the configuration"<<endl;
+	cerr<<"  -n  only print the best setting, leave the configuration as it is"<<endl;
+}
+
+struct Sample{
+	string path;
+	vector<uchar> data;
+	bool labelled; //has a face
+	Rect face;
+};
+
+struct Trial{
+	ScanParams scan;
+	double recall;
+	int falsePositives; //faces found in images without one
+	double seconds; //face search time per image
+};
+
+static bool readLabels(const char* filename, vector<Sample>& samples){
+	ifstream fin(filename);
+	if (!fin){
+		cerr<<"Cannot open labels "<<filename<<endl;
+		return false;
+	}
+	string line;
+	while (getline(fin, line)){
+		istringstream in(line);
+		Sample sample;
+		if (!(in>>sample.path) || sample.path[0] == '#')
+			continue;
+		int x, y, width, height;
+		sample.labelled = (bool)(in>>x>>y>>width>>height);
+		if (sample.labelled)
+			sample.face = Rect(x, y, width, height);
+
+		ifstream image(sample.path.data(), ios::binary);
+		sample.data.assign((istreambuf_iterator<char>(image)), istreambuf_iterator<char>());
+		if (sample.data.empty()){
+			cerr<<"Cannot read "<<sample.path<<", skipped"<<endl;
+			continue;
+		}
+		samples.push_back(sample);
+	}
+	return !samples.empty();
+}
+
+static double overlap(const Rect& a, const Rect& b){
+	double shared = (a & b).area();
+	return shared/(a.area() + b.area() - shared);
+}
+
+static string describe(const ScanParams& scan, bool haar){
+	char text[128];
+	if (haar)
+		snprintf(text, sizeof(text), "HAAR_MIN_FACE %d", scan.haarMinFace);
+	else
+		snprintf(text, sizeof(text), "SCALE_FACTOR %g MIN_NEIGHBORS %d MIN_FACE %d MAX_FACE %d",
+			scan.scaleFactor, scan.minNeighbors, scan.minFace, scan.maxFace);
+	return text;
+}
+
+static void evaluate(Detector& detector, const vector<Sample>& samples, Trial& trial){
+	vector<BatchInput> inputs;
+	for (size_t i = 0; i < samples.size(); i++)
+		inputs.push_back(BatchInput(&samples[i].data[0], samples[i].data.size()));
+	DetectOptions options(SBOX);
+	options.scan = trial.scan;
+	vector<DetectResult> results;
+
+	Metrics::reset();
+	detector.detectBatch(inputs, results, options);
+	uint64_t nanos = 0;
+	int stages[] = {MPYRAMID, MSCAN, MGROUPING, MVERIFY};
+	for (int s = 0; s < 4; s++){
+		StageHistogram h;
+		Metrics::histogram(stages[s], h);
+		nanos += h.nanos;
+	}
+
+	int faces = 0, found = 0;
+	trial.falsePositives = 0;
+	for (size_t i = 0; i < samples.size(); i++){
+		if (samples[i].labelled){
+			faces++;
+			if (results[i].found && overlap(results[i].face, samples[i].face) >= 0.5)
+				found++;
+		}
+		else if (results[i].found){
+			trial.falsePositives++;
+		}
+	}
+	trial.recall = faces > 0 ? (double)found/faces : 1;
+	trial.seconds = nanos/1e9/samples.size();
+}
+
+//settings meeting the recall beat those that do not, then the faster (by more
+//than the timing noise) wins, and among those short of the recall the higher recall
+static bool better(const Trial& a, const Trial& b, double recall){
+	bool aMeets = a.recall >= recall, bMeets = b.recall >= recall;
+	if (aMeets != bMeets)
+		return aMeets;
+	if (aMeets)
+		return a.seconds < b.seconds*0.98;
+	return a.recall > b.recall;
+}
+
+int main(int argc, char** argv){
+	const char* cfgname = "detector.cfg";
+	double recall = 0.95;
+	int threads = -1;
+	bool write = true;
+	int opt;
+	while ((opt = getopt(argc, argv, "c:r:t:nh")) != -1){
+		switch (opt){
+			case 'c': cfgname = optarg; break;
+			case 'r': recall = atof(optarg); break;
+			case 't': threads = atoi(optarg); break;
+			case 'n': write = false; break;
+			default: usage(argv[0]); return 1;
+		}
+	}
+	if (optind != argc - 1){
+		usage(argv[0]);
+		return 1;
+	}
+
+	DetectorConfig config;
+	if (!LoadDetectorConfig(cfgname, config)){
+		cerr<<"Cannot open configuration "<<cfgname<<endl;
+		return 1;
+	}
+	vector<Sample> samples;
+	if (!readLabels(argv[optind], samples))
+		return 1;
+
+	Detector detector(cfgname);
+	if (threads >= 0)
+		detector.setThreads(threads);
+
+	//the values tried for each setting, the OPENCV detector only has the one
+	bool haar = config.type == "OPENCV";
+	const float scales[] = {1.05f, 1.1f, 1.15f, 1.2f, 1.25f, 1.3f, 1.4f};
+	const int neighbors[] = {1, 2, 3, 4};
+	const int minFaces[] = {24, 32, 40, 50, 64, 80, 100};
+	const int maxFaces[] = {300, 400, 500, 700, 1000, 0};
+	const int haarMinFaces[] = {30, 40, 60, 80, 100, 150};
+	const int counts[] = {7, 4, 7, 6};
+
+	map<string, Trial> tried;
+	Trial best;
+	best.scan = config.scan;
+	evaluate(detector, samples, best);
+	tried[describe(best.scan, haar)] = best;
+	cerr<<"configured: "<<describe(best.scan, haar)<<" recall "<<best.recall<<" false "<<best.falsePositives
+		<<" search "<<best.seconds*1000<<" ms/image"<<endl;
+
+	//one setting at a time, keeping the others at the best so far, until nothing improves
+	for (int round = 0; round < 4; round++){
+		bool improved = false;
+		for (int param = 0; param < (haar ? 1 : 4); param++){
+			int count = haar ? 6 : counts[param];
+			for (int v = 0; v < count; v++){
+				Trial trial;
+				trial.scan = best.scan;
+				if (haar) trial.scan.haarMinFace = haarMinFaces[v];
+				else if (param == 0) trial.scan.scaleFactor = scales[v];
+				else if (param == 1) trial.scan.minNeighbors = neighbors[v];
+				else if (param == 2) trial.scan.minFace = minFaces[v];
+				else trial.scan.maxFace = maxFaces[v];
+				if (!haar && trial.scan.maxFace > 0 && trial.scan.maxFace < trial.scan.minFace)
+					continue;
+				string name = describe(trial.scan, haar);
+				if (tried.count(name))
+					continue;
+				evaluate(detector, samples, trial);
+				tried[name] = trial;
+				cerr<<name<<" recall "<<trial.recall<<" false "<<trial.falsePositives
+					<<" search "<<trial.seconds*1000<<" ms/image"<<endl;
+				if (better(trial, best, recall)){
+					best = trial;
+					improved = true;
+				}
+			}
+		}
+		if (!improved)
+			break;
+	}
+
+	if (best.recall < recall){
+		cerr<<"No setting reaches recall "<<recall<<", the best is "<<best.recall<<" with "
+			<<describe(best.scan, haar)<<endl;
+		return 1;
+	}
+	cout<<describe(best.scan, haar)<<endl;
+	cerr<<"best: recall "<<best.recall<<" false "<<best.falsePositives<<" search "<<best.seconds*1000
+		<<" ms/image, "<<samples.size()<<" images, "<<tried.size()<<" settings tried"<<endl;
+	if (write){
+		if (!SaveScanParams(cfgname, best.scan)){
+			cerr<<"Cannot write "<<cfgname<<endl;
+			return 1;
+		}
+		cerr<<"written to "<<cfgname<<endl;
+	}
+	return 0;
+}